@@ -0,0 +1,94 @@
+# PutToLight - Web asset packer
+#
+# Copyright (c) 2023 Serhii Nesterenko
+# Licensed under the MIT License. See LICENSE file in the project root.
+#
+# PlatformIO pre-script: builds the filesystem image from a packed copy of
+# data/. Web assets are stored gzipped with a content hash, references to
+# them in the UI get a ?v=<hash> suffix, and /assets.json tells the firmware
+# which files to serve compressed and with which ETag. Files the firmware
+# reads or rewrites at runtime are copied as they are.
+#
+# Standalone use: python scripts/gzip_data.py [data_dir] [out_dir]
+
+import gzip
+import hashlib
+import json
+import os
+import re
+import shutil
+import sys
+
+# Read and written by the firmware, never compressed or cached
+RAW_FILES = {"config.json", "models.json", "table.json"}
+
+# Content types of the packed assets
+TYPES = {
+    ".html": "text/html",
+    ".json": "application/json",
+    ".png": "image/png",
+    ".ico": "image/x-icon",
+    ".css": "text/css",
+    ".js": "application/javascript",
+}
+
+# Text assets may reference other assets, so they are packed last
+TEXT = {".html", ".json", ".css", ".js"}
+
+
+def content_hash(data):
+    return hashlib.sha1(data).hexdigest()[:12]
+
+
+def version_refs(text, hashes):
+    # name.png -> name.png?v=<hash> wherever the name is quoted or in url()
+    for name, digest in hashes.items():
+        text = re.sub(r"(?<=[\"'(/])" + re.escape(name) + r"(?=[\"')])",
+                      "%s?v=%s" % (name, digest), text)
+    return text
+
+
+def pack(src, dst):
+    if os.path.isdir(dst):
+        shutil.rmtree(dst)
+    os.makedirs(dst)
+    names = sorted(os.listdir(src))
+    names.sort(key=lambda n: os.path.splitext(n)[1] in TEXT)
+    # index.html references everything else, pack it at the very end
+    names.sort(key=lambda n: n == "index.html")
+    hashes = {}
+    manifest = {}
+    for name in names:
+        path = os.path.join(src, name)
+        ext = os.path.splitext(name)[1]
+        if not os.path.isfile(path):
+            continue
+        if name in RAW_FILES or ext not in TYPES:
+            shutil.copyfile(path, os.path.join(dst, name))
+            continue
+        with open(path, "rb") as f:
+            data = f.read()
+        if ext in TEXT:
+            data = version_refs(data.decode("utf-8"), hashes).encode("utf-8")
+        digest = content_hash(data)
+        hashes[name] = digest
+        manifest["/" + name] = {"etag": digest, "type": TYPES[ext]}
+        with open(os.path.join(dst, name + ".gz"), "wb") as f:
+            # mtime=0 keeps the image reproducible
+            f.write(gzip.compress(data, 9, mtime=0))
+    with open(os.path.join(dst, "assets.json"), "w") as f:
+        json.dump(manifest, f, separators=(",", ":"))
+    return manifest
+
+
+if __name__ == "__main__":
+    src = sys.argv[1] if len(sys.argv) > 1 else "data"
+    dst = sys.argv[2] if len(sys.argv) > 2 else os.path.join(".pio", "data")
+    for path, asset in pack(src, dst).items():
+        print("%-32s %s" % (path, asset["etag"]))
+else:
+    Import("env")  # noqa: F821 - provided by PlatformIO
+    data_dir = env.subst("$PROJECT_DATA_DIR")  # noqa: F821
+    packed_dir = os.path.join(env.subst("$PROJECT_WORKSPACE_DIR"), "data")  # noqa: F821
+    pack(data_dir, packed_dir)
+    env.Replace(PROJECT_DATA_DIR=packed_dir)  # noqa: F821
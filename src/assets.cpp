@@ -0,0 +1,96 @@
+/*
+ * PutToLight - Web Asset Module
+ *
+ * Copyright (c) 2023 Serhii Nesterenko
+ * Licensed under the MIT License. See LICENSE file in the project root.
+ */
+
+#include "ptl.hpp"
+#include <ESPAsyncWebServer.h>
+#include <LittleFS.h>
+
+#define MAX_ASSETS 24 // Maximum entries in /assets.json
+
+// Cache policies: versioned URLs (?v=hash) never change, the rest is
+// revalidated with its ETag on every load
+#define CACHE_IMMUTABLE "public, max-age=31536000, immutable"
+#define CACHE_REVALIDATE "no-cache"
+
+// Packed web asset, stored gzipped as <path>.gz
+typedef struct {
+  char path[40]; // Request path, e.g. /index.html
+  char etag[16]; // Content hash
+  char type[24]; // Content type
+} asset_t;
+
+asset_t assets[MAX_ASSETS]; // Assets listed in /assets.json
+int nAssets = 0;            // Number of assets
+
+// Find asset for a request path, "/" is the index page
+const asset_t *findAsset(const String &url) {
+  const char *path = url == "/" ? "/index.html" : url.c_str();
+  for (int i = 0; i < nAssets; i++) {
+    if (strcmp(assets[i].path, path) == 0)
+      return &assets[i];
+  }
+  return nullptr;
+}
+
+// Serves packed assets gzipped with a strong ETag and cache headers
+class AssetHandler : public AsyncWebHandler {
+public:
+  bool canHandle(AsyncWebServerRequest *request) override {
+    if (request->method() != HTTP_GET || findAsset(request->url()) == nullptr)
+      return false;
+    request->addInterestingHeader("If-None-Match");
+    return true;
+  }
+
+  void handleRequest(AsyncWebServerRequest *request) override {
+    const asset_t *asset = findAsset(request->url());
+    char etag[sizeof(asset->etag) + 2];
+    snprintf(etag, sizeof(etag), "\"%s\"", asset->etag);
+    AsyncWebServerResponse *response;
+    if (request->hasHeader("If-None-Match") &&
+        request->header("If-None-Match") == etag) {
+      response = request->beginResponse(304); // Not modified
+    } else {
+      // Only <path>.gz exists, the response adds Content-Encoding: gzip
+      response = request->beginResponse(LittleFS, asset->path, asset->type);
+    }
+    response->addHeader("ETag", etag);
+    response->addHeader("Cache-Control",
+                        request->hasParam("v") ? CACHE_IMMUTABLE
+                                               : CACHE_REVALIDATE);
+    request->send(response);
+  }
+};
+
+AssetHandler assetHandler;
+
+// Load the asset manifest written by scripts/gzip_data.py and register the
+// handler. Without a manifest the plain files are served as before
+void initAssets(AsyncWebServer &server) {
+  File file = LittleFS.open("/assets.json", FILE_READ);
+  if (!file) {
+    LOGI("No asset manifest, serving plain files");
+    return;
+  }
+  DynamicJsonDocument manifest(3072);
+  DeserializationError error = deserializeJson(manifest, file);
+  file.close();
+  if (error) {
+    LOGE("ERROR: deserialize");
+    return;
+  }
+  for (JsonPair kv : manifest.as<JsonObject>()) {
+    if (nAssets >= MAX_ASSETS)
+      break;
+    asset_t *asset = &assets[nAssets++];
+    strlcpy(asset->path, kv.key().c_str(), sizeof(asset->path));
+    strlcpy(asset->etag, kv.value()["etag"] | "", sizeof(asset->etag));
+    strlcpy(asset->type, kv.value()["type"] | "", sizeof(asset->type));
+  }
+  server.addHandler(&assetHandler);
+  LOGI("Serving %d packed assets", nAssets);
+}
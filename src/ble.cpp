@@ -3,27 +3,54 @@
  *
  * Copyright (c) 2023 Serhii Nesterenko
  * Licensed under the MIT License. See LICENSE file in the project root.
+ *
+ * Advertisers seen by scans go into a fixed registry hashed by address,
+ * with the signal strength and time of the last sighting. When it is
+ * full, the advertiser seen least recently is replaced, scanners whose
+ * service is listed in models.json only when nothing else is left, so a
+ * crowd of phones and beacons cannot push them out. The registry only
+ * feeds the device list of the status event, so in a busy hall phones and
+ * beacons take turns in the slots they leave over; an eviction is a walk
+ * of plain compares, the configured scanner read once per sighting.
  */
 
 #include "NimBLEDevice.h"
 #include "NimBLEScan.h"
 #include "ptl.hpp"
+#include <LittleFS.h>
+
+#define DEVICE_SLOTS 64    // Advertisers tracked
+#define DEVICE_BUCKETS 128 // Hash buckets, a power of two
+#define DEVICE_STALE 60000 // Advertisers not seen for longer are hidden (ms)
+#define MAX_MODELS 8       // Scanner services read from models.json
 
 using namespace std::__cxx11;
 
 // BLE globals
-int codeTarget = 0x5555;       // Target code value (unused)
-device_t devices[MAX_DEVICES]; // Array of discovered BLE devices
-int nDevices = 0;              // Number of devices found
-BLEScan *pBLEScan;             // BLE scanner instance
-char scan[MAX_SCAN];           // Scan data buffer
-int scanPos = 0;               // Current position in scan buffer
-ScanMode scanMode = SCAN_NONE; // Current scan state
+int codeTarget = 0x5555; // Target code value (unused)
+BLEScan *pBLEScan;       // BLE scanner instance
+
+// Scan records. Free ones wait in scanFree, completed ones in scanReady
+// until loop() processes them, so scans arriving while loop() is busy are
+// kept instead of overwriting each other.
+scan_t scanSlots[SCAN_SLOTS];
+QueueHandle_t scanFree = nullptr, scanReady = nullptr;
+scan_t *scanning = nullptr; // Record being filled, nullptr if none was free
+int scanPos = 0;            // Current position in the scanned code
 
 // BLE client and characteristic handles
 NimBLEClient *pClient = BLEDevice::createClient();
 NimBLERemoteCharacteristic *pChar = nullptr;
 
+// Advertiser registry, written by the scan callback
+device_t devices[DEVICE_SLOTS];
+int16_t deviceBucket[DEVICE_BUCKETS]; // First slot of every bucket, -1
+int nDevices = 0;                     // Slots in use
+SemaphoreHandle_t deviceLock = nullptr;
+NimBLEUUID models[MAX_MODELS]; // Services of known scanner models
+int nModels = 0;
+volatile bool targetSeen = false; // Configured scanner seen in this scan
+
 /*class MyAdvertisedDeviceCallbacks: public NimBLEAdvertisedDeviceCallbacks {
     void onResult(BLEAdvertisedDevice advertisedDevice) {
       Serial.printf("Advertised Device: %s; ",
@@ -53,60 +80,83 @@ if (devices[nDevices].name.length() == 0) {
 };*/
 
 // BLE notification callback - receives scan data from connected device
-// Data arrives in chunks until CR (13) is received
+// Data arrives in chunks until CR (13) is received. GS1 fields are split
+// off chunk by chunk, so they are ready when the scan is complete. A scan
+// that finds no free record is read to its end and dropped.
 static void notifyCallback(BLERemoteCharacteristic *pBLERemoteCharacteristic,
                            uint8_t *pData, size_t length, bool isNotify) {
-  scanMode = SCAN_IN_PROGRESS;
+  if (scanPos == 0) {
+    if (!xQueueReceive(scanFree, &scanning, 0))
+      scanning = nullptr;
+    else
+      scanning->gs1.reset();
+  }
   // Prevent buffer overflow
   if (scanPos + length > MAX_SCAN) {
     length = MAX_SCAN - scanPos;
     pData[length - 1] = 13; // Force end of scan
   }
-  strncpy(&scan[scanPos], (const char *)pData, length);
+  bool end = pData[length - 1] == 13; // End of line (CR)?
+  if (scanning != nullptr) {
+    memcpy(&scanning->code[scanPos], pData, length);
+    scanning->gs1.feed(pData, end ? length - 1 : length);
+  }
   scanPos += length;
-  // End of line (CR)? Mark scan as complete
-  if (pData[length - 1] == 13) {
-    scan[scanPos - 1] = 0; // Null terminate
-    scanPos = 0;
-    scanMode = SCAN_FINISHED;
+  if (!end)
+    return;
+  if (scanning != nullptr) {
+    scanning->gs1.end();
+    scanning->code[scanPos - 1] = 0; // Null terminate
+    xQueueSend(scanReady, &scanning, 0); // Holds every record, never full
+  } else {
+    metrics.scanDropped++;
   }
+  scanPos = 0;
 }
 
+// Oldest completed scan, nullptr if none. Called from loop().
+scan_t *nextScan() {
+  scan_t *s = nullptr;
+  if (scanReady != nullptr)
+    xQueueReceive(scanReady, &s, 0);
+  return s;
+}
+
+// Give a processed scan record back to the pool
+void releaseScan(scan_t *s) { xQueueSend(scanFree, &s, 0); }
+
 // Subscribe to BLE characteristic notifications
 bool subscribeCharacteristic() {
   if (pChar == nullptr) {
-    Serial.println("ERROR GETTING CHARACTERISTIC");
+    LOGE("ERROR GETTING CHARACTERISTIC");
     return false;
   }
   if (!pChar->canRead()) {
-    Serial.println("CHARACTERISTIC IS NOT READABLE");
+    LOGE("CHARACTERISTIC IS NOT READABLE");
     return false;
   }
   if (!pChar->canNotify()) {
-    Serial.println("CHARACTERISTIC IS NOT NOTIFYABLE");
+    LOGE("CHARACTERISTIC IS NOT NOTIFYABLE");
     return false;
   }
-  cfg["charact"] = pChar->getUUID().to128().toString();
   pChar->subscribe(false, notifyCallback); // Subscribe for indications
-  Serial.println("SUBSCRIBED");
+  LOGI("SUBSCRIBED");
   return true;
 }
 
-// Connect to BLE scanner device and subscribe to scan characteristic
-bool connectToScanner() {
-  if (cfg["addr"] == "")
+// Connect to the scanner of a config and subscribe to its characteristic
+static bool connectTo(const config_t *c) {
+  if (c->addr[0] == 0)
     return false;
-  Serial.print("Connecting to ");
-  Serial.println((const char *)cfg["addr"]);
+  LOGI("Connecting to %s", c->addr);
   // Try public address first, then random address
-  if (!pClient->connect(NimBLEAddress((const char *)cfg["addr"]))) {
-    if (!pClient->connect(NimBLEAddress((const char *)cfg["addr"]),
-                          BLE_ADDR_RANDOM)) {
-      Serial.println("ERROR CONNECTING OT DEVICE");
+  if (!pClient->connect(c->scanner)) {
+    if (!pClient->connect(c->scanner, BLE_ADDR_RANDOM)) {
+      LOGE("ERROR CONNECTING OT DEVICE");
       return false;
     }
   }
-  Serial.println("CONNECTED TO DEVICE");
+  LOGI("CONNECTED TO DEVICE");
   // Serial.println("2");
   /*std::map<std::string, BLERemoteService*> *foundServices =
   pClient->getServices(); if (foundServices == nullptr) { status =
@@ -121,16 +171,15 @@ bool connectToScanner() {
     Serial.println();
   }*/
   // Get the configured service
-  NimBLERemoteService *srv =
-      pClient->getService(NimBLEUUID((const char *)cfg["service"]));
+  NimBLERemoteService *srv = pClient->getService(c->service);
   if (srv == nullptr) {
-    Serial.println("ERROR CONNECTING TO SERVICE");
+    LOGE("ERROR CONNECTING TO SERVICE");
     return false;
   }
-  Serial.println("CONNECTED TO SERVICE");
+  LOGI("CONNECTED TO SERVICE");
   // If we have a specific characteristic configured, subscribe to it
-  if (cfg["charact"].as<string>().length() > 0) {
-    pChar = srv->getCharacteristic(NimBLEUUID((const char *)cfg["charact"]));
+  if (c->charact.bitSize() > 0) {
+    pChar = srv->getCharacteristic(c->charact);
     if (subscribeCharacteristic())
       return true;
   }
@@ -147,55 +196,186 @@ bool connectToScanner() {
       return true;
     }
   }*/
-  Serial.println("NO VALUABLE CHARACTERISTIC FOUND");
+  LOGE("NO VALUABLE CHARACTERISTIC FOUND");
   return false;
 }
 
-// Initialize BLE subsystem and scanner
-void initBLE() {
-  NimBLEDevice::init("");
-  pBLEScan = NimBLEDevice::getScan(); // Create new scan instance
-  pBLEScan->setInterval(150);         // Set scan interval (ms)
-  pBLEScan->setWindow(50);            // Set scan window (ms)
-  Serial.println("Init BLE ok");
+// Connect to BLE scanner device and subscribe to scan characteristic. The
+// config is held for the whole attempt, which may take seconds.
+bool connectToScanner() {
+  const config_t *c = holdConfig();
+  bool connected = connectTo(c);
+  if (connected)
+    LOGI("Connected to %s service %s", c->addr,
+         c->service.toString().c_str());
+  releaseConfig(c);
+  return connected;
 }
 
-// Find device by address in discovered devices list
-int findDevice(string address) {
-  for (int i = 0; i < nDevices; i++) {
-    if (address == devices[i].address)
-      return i;
+// Bucket of an address
+static int deviceHash(uint64_t mac) {
+  return (mac ^ (mac >> 17) ^ (mac >> 31)) & (DEVICE_BUCKETS - 1);
+}
+
+// Unlink a slot from its hash bucket
+static void unlinkDevice(int slot) {
+  int16_t *link = &deviceBucket[deviceHash(devices[slot].mac)];
+  while (*link != slot)
+    link = &devices[*link].next;
+  *link = devices[slot].next;
+}
+
+// Address of the configured scanner, 0 if none is configured. Read once
+// per callback or walk, not per slot.
+static uint64_t targetMac() {
+  const config_t *c = holdConfig();
+  uint64_t target = c->addr[0] != 0 ? (uint64_t)c->scanner : 0;
+  releaseConfig(c);
+  return target;
+}
+
+// Slot for a new advertiser: a free one, else the one seen least recently,
+// preferring advertisers that are neither scanners nor the target
+static int freeDevice(uint64_t target) {
+  if (nDevices < DEVICE_SLOTS)
+    return nDevices++;
+  int oldest = 0, oldestOther = -1;
+  unsigned long now = millis();
+  for (int i = 0; i < DEVICE_SLOTS; i++) {
+    unsigned long age = now - devices[i].seen;
+    if (age > now - devices[oldest].seen)
+      oldest = i;
+    if (!devices[i].scanner && devices[i].mac != target &&
+        (oldestOther < 0 || age > now - devices[oldestOther].seen))
+      oldestOther = i;
   }
-  return -1; // Not found
+  int slot = oldestOther >= 0 ? oldestOther : oldest;
+  unlinkDevice(slot);
+  return slot;
 }
 
-// Scan for BLE devices and look for configured target device
-bool scanBLE() {
-  Serial.println("Scanning BLE...");
-  NimBLEScanResults foundDevices = pBLEScan->start(SCAN_TIME, false);
-  for (int i = 0; i < foundDevices.getCount(); i++) {
-    NimBLEAdvertisedDevice device = foundDevices.getDevice(i);
-
-    // Add new devices to list
-    if (findDevice(device.getAddress().toString()) == -1 &&
-        nDevices < MAX_DEVICES) {
-      devices[nDevices].address = device.getAddress().toString();
-      devices[nDevices].service = device.getServiceUUID().to128().toString();
-      nDevices++;
+// Record a sighting, adding the advertiser if it is new. Strings are only
+// formatted for new advertisers, into the slot, without allocating.
+static void registerDevice(NimBLEAdvertisedDevice *d, uint64_t target) {
+  uint64_t mac = d->getAddress();
+  int bucket = deviceHash(mac);
+  xSemaphoreTake(deviceLock, portMAX_DELAY);
+  int slot = deviceBucket[bucket];
+  while (slot >= 0 && devices[slot].mac != mac)
+    slot = devices[slot].next;
+  if (slot < 0) {
+    slot = freeDevice(target);
+    device_t *dev = &devices[slot];
+    dev->mac = mac;
+    snprintf(dev->address, sizeof(dev->address),
+             "%02x:%02x:%02x:%02x:%02x:%02x", (uint8_t)(mac >> 40),
+             (uint8_t)(mac >> 32), (uint8_t)(mac >> 24), (uint8_t)(mac >> 16),
+             (uint8_t)(mac >> 8), (uint8_t)mac);
+    dev->scanner = false;
+    dev->service[0] = 0;
+    for (int i = 0; i < nModels && !dev->scanner; i++) {
+      if (d->isAdvertisingService(models[i])) {
+        ble_uuid_to_str(&models[i].getNative()->u, dev->service);
+        dev->scanner = true;
+      }
+    }
+    if (!dev->scanner && d->haveServiceUUID()) {
+      NimBLEUUID uuid = d->getServiceUUID().to128();
+      ble_uuid_to_str(&uuid.getNative()->u, dev->service);
     }
+    dev->next = deviceBucket[bucket];
+    deviceBucket[bucket] = slot;
+  }
+  devices[slot].rssi = d->getRSSI();
+  devices[slot].seen = millis();
+  xSemaphoreGive(deviceLock);
+  LOGD("A: %s S: %s RSSI: %d", devices[slot].address, devices[slot].service,
+       d->getRSSI());
+}
 
-    Serial.printf("A: %s N: %s S: %s RSSI: %d M: %X, X: %X\n",
-                  device.getAddress().toString().c_str(),
-                  device.getName().c_str(),
-                  device.getServiceUUID().toString().c_str(), device.getRSSI(),
-                  device.getManufacturerData(), device.getPayload());
-    // Check if this is our target device
-    if (device.getAddress().toString() == cfg["addr"].as<string>()) {
-      Serial.println("FOUND MY DEVICE!");
-      return true;
+// Copy advertisers seen recently that offer a service, scanners first, in
+// slot order so the list is stable between calls. The configured scanner
+// stays listed while connected, when it no longer advertises.
+int listDevices(device_t *out, int max) {
+  int n = 0;
+  if (deviceLock == nullptr)
+    return 0;
+  uint64_t targetAddr = targetMac();
+  xSemaphoreTake(deviceLock, portMAX_DELAY);
+  unsigned long now = millis();
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < nDevices && n < max; i++) {
+      const device_t *dev = &devices[i];
+      bool target = targetAddr != 0 && dev->mac == targetAddr;
+      if ((dev->scanner || target) == (pass == 0) && dev->service[0] != 0 &&
+          (now - dev->seen <= DEVICE_STALE || target))
+        out[n++] = *dev;
     }
   }
-  return false;
+  xSemaphoreGive(deviceLock);
+  return n;
+}
+
+// Scan callback, runs for every advertiser in the NimBLE host task
+class DeviceCallbacks : public NimBLEAdvertisedDeviceCallbacks {
+  void onResult(NimBLEAdvertisedDevice *d) override {
+    uint64_t target = targetMac();
+    registerDevice(d, target);
+    if (target != 0 && (uint64_t)d->getAddress() == target) {
+      targetSeen = true;
+      NimBLEDevice::getScan()->stop(); // Connect without waiting
+    }
+  }
+} deviceCallbacks;
+
+// Read the services of known scanner models from models.json
+void readModels() {
+  File file = LittleFS.open("/models.json", FILE_READ);
+  if (!file) {
+    LOGE("ERROR: There was an error opening models file");
+    return;
+  }
+  DynamicJsonDocument json(2048);
+  DeserializationError error = deserializeJson(json, file);
+  file.close();
+  if (error) {
+    LOGE("ERROR: models.json: %s", error.c_str());
+    return;
+  }
+  for (JsonPair kv : json.as<JsonObject>()) {
+    if (nModels < MAX_MODELS)
+      models[nModels++] = NimBLEUUID(string(kv.key().c_str()));
+  }
+}
+
+// Initialize BLE subsystem and scanner
+void initBLE() {
+  deviceLock = xSemaphoreCreateMutex();
+  scanFree = xQueueCreate(SCAN_SLOTS, sizeof(scan_t *));
+  for (int i = 0; i < SCAN_SLOTS; i++) {
+    scan_t *s = &scanSlots[i];
+    xQueueSend(scanFree, &s, 0);
+  }
+  scanReady = xQueueCreate(SCAN_SLOTS, sizeof(scan_t *));
+  memset(deviceBucket, -1, sizeof(deviceBucket));
+  readModels();
+  NimBLEDevice::init("");
+  pBLEScan = NimBLEDevice::getScan(); // Create new scan instance
+  pBLEScan->setAdvertisedDeviceCallbacks(&deviceCallbacks);
+  pBLEScan->setMaxResults(0);         // Registry only, no result list
+  pBLEScan->setInterval(150);         // Set scan interval (ms)
+  pBLEScan->setWindow(50);            // Set scan window (ms)
+  LOGI("Init BLE ok");
+}
+
+// Scan for BLE devices, true if the configured target device was seen
+bool scanBLE() {
+  LOGI("Scanning BLE...");
+  targetSeen = false;
+  pBLEScan->start(SCAN_TIME, false);
+  if (targetSeen)
+    LOGI("FOUND MY DEVICE!");
+  return targetSeen;
 }
 
 // Disconnect from BLE scanner device
@@ -207,18 +387,15 @@ void disconnectFromScanner() {
 
 // BLE task - scans for and maintains connection to scanner device
 void BLECode(void *params) {
-  Serial.printf("Running ble on core %d\n", xPortGetCoreID());
+  LOGD("Running ble on core %d", xPortGetCoreID());
 
   initBLE();
 
   if (pClient == nullptr) {
-    Serial.println("Can not create client!");
+    LOGE("Can not create client!");
     return;
   }
 
-  Serial.println();
-  Serial.print("DONE ");
-
   unsigned long lastTime = 0;
 
   // Main BLE loop - periodically scan and reconnect
@@ -228,12 +405,8 @@ void BLECode(void *params) {
       if (!pClient->isConnected()) {
         disconnectFromScanner();
         // Scan for device and try to connect
-        if (scanBLE() && connectToScanner()) {
-          Serial.printf("Connected to %s service %s\n",
-                        (const char *)cfg["addr"],
-                        (const char *)cfg["service"]);
+        if (scanBLE() && connectToScanner())
           status = STATUS_DEVICE_CONNECTED;
-        }
       }
       lastTime = millis();
     }
@@ -3,23 +3,78 @@
  *
  * Copyright (c) 2023 Serhii Nesterenko
  * Licensed under the MIT License. See LICENSE file in the project root.
+ *
+ * Lit pins below full brightness are dimmed with bit-angle modulation:
+ * the frame is shown as BAM_BITS bit planes of 1, 2 and 4 base times, a
+ * pin being lit in the planes whose bit is set in its level. A one-shot
+ * esp_timer ends each plane and wakes the blink task, which writes only
+ * the register bytes that differ from the previous plane.
  */
 
 #include "DFRobot_CH423.h"
 #include "ptl.hpp"
 #include <Wire.h>
+#include <esp_timer.h>
+#include <new>
+
+// Modeled I2C time of a CH423 transfer: start, command byte and data byte
+// with their ACKs, stop - 20 clock periods at the bus clock
+#define I2C_XFER_BITS 20
+#define TEST_STEP 250    // Time each self-test code frame is shown (ms)
+#define TEST_CODES 6     // Code frames, enough bits to number 48 pins
+#define BAM_BASE_US 1000 // Shortest bit plane if the bus is fast enough (us)
 
 // CH423 I2C GPIO expander instances (2 chips for 48 total pins)
 DFRobot_CH423 *ch423, *ch4231;
 
-// Blink state variables
-int currentPin = 0;                    // Currently blinking pin (0-47, 48=all)
-Blink blink = BLINK_NONE;              // Current blink state
-unsigned long blinkStart = 0;          // Blink sequence start time
+// Blink defaults (used by blinkPin() and batch entries without overrides)
 unsigned long blinkDuration = 10000UL; // Total blink duration (ms)
 int blinkPeriod = 1000;                // Blink cycle period (ms)
 int blinkFill = 500;                   // LED on-time per cycle (ms)
-bool blinkTest = false;                // Test mode flag
+
+// Blink state variables
+channel_t channels[NUM_PINS];     // Active frame, one channel per output pin
+TaskHandle_t blinkTask = nullptr; // Blink task handle, woken on requests
+portMUX_TYPE blinkMux = portMUX_INITIALIZER_UNLOCKED; // Guards channels[]
+volatile uint8_t urgentRegs = 0; // Frame bytes with pick lights waiting
+
+// Bit-angle modulation state, owned by the blink task
+esp_timer_handle_t bamTimer = nullptr; // Ends the current bit plane
+volatile bool bamArmed = false;        // Plane timer running
+bool bamOn = false;                    // Last frame had dimmed pins
+int bamPlane = 0;                      // Bit plane being shown
+uint32_t bamBaseUs = BAM_BASE_US;      // Length of plane 0 (us)
+unsigned long lastPoll = 0;            // Last input poll (ms)
+
+// Output frame: one byte per CH423 register, LEDs are active low
+// Byte order: ch423 GPIO, GPO0-7, GPO8-15, then the same for ch4231
+uint8_t out[FRAME_BYTES];     // Wanted register state
+uint8_t written[FRAME_BYTES]; // Register state last written to the chips
+uint32_t xferNs[2];           // Modeled time of one transfer on each bus (ns)
+
+// Confirmation inputs: GPIO banks switched to input mode, polled together
+int8_t inputs[INPUT_LINES];     // Output pin confirmed by each input line
+bool inputChip[2];              // Chip has its GPIO bank in input mode
+uint8_t inputState[2];          // Debounced GPIO state per chip
+uint8_t inputRaw[2];            // GPIO state of the previous poll
+QueueHandle_t inputQueue;       // Input events for the main loop
+
+// Self-test states
+enum TestState { TEST_IDLE, TEST_PENDING, TEST_RUNNING, TEST_DONE };
+
+// Self-test result of both chips. Only the GPIO banks can be read back;
+// GPO pins are shown as binary codes for a person or a camera to check.
+typedef struct {
+  bool present[2];      // Chip answered on its bus
+  bool readback[2];     // GPIO bank was driven and read back
+  uint8_t stuckHigh[2]; // GPIO lines that never went low
+  uint8_t stuckLow[2];  // GPIO lines that never went high
+  uint8_t bridged[2];   // GPIO lines that failed a walking pattern
+  unsigned long ms;     // Test duration
+} selftest_t;
+
+volatile TestState testState = TEST_IDLE;
+selftest_t testResult; // Written by the blink task before TEST_DONE
 
 /*
 void writeS(int t) {
@@ -53,79 +108,342 @@ void writeCodeToLed(int code) {
 }
 */
 
-// Set output level for a specific pin or all pins
-// Pin mapping: 0-7=ch423 GPIO, 8-23=ch423 GPO, 24-31=ch4231 GPIO, 32-47=ch4231
-// GPO, 48=all pins
-void setPin(int x, uint8_t level) {
-  if (x < 0 || x > 48)
-    return; // 48 - write to all
-
-  // Handle missing first chip
-  if (x < 24 && ch423 == nullptr) {
-    if (blinkTest) {
-      Serial.println("No wire0, set current pin to 24");
-      currentPin = 24;
-      x = 24;
-    } else {
-      return;
-    }
+
+// Write one register byte of the output frame to its chip, returns the
+// modeled bus time (ns)
+uint32_t writeRegister(int i, uint8_t value) {
+  DFRobot_CH423 *chip = i < 3 ? ch423 : ch4231;
+  if (chip == nullptr || (i % 3 == 0 && inputChip[i / 3]))
+    return 0; // Missing chip or GPIO bank used for inputs
+  metrics.i2cWrites++;
+  switch (i % 3) {
+  case 0:
+    chip->digitalWrite(DFRobot_CH423::eGPIOTotal, value);
+    break;
+  case 1:
+    chip->digitalWrite(DFRobot_CH423::eGPO0_7, (uint16_t)value);
+    break;
+  case 2:
+    chip->digitalWrite(DFRobot_CH423::eGPO8_15, (uint16_t)(value << 8));
+    break;
+  }
+  return xferNs[i / 3];
+}
+
+// Write a frame byte that changed, returns the modeled bus time (ns)
+uint32_t flushRegister(int i) {
+  if (out[i] == written[i])
+    return 0;
+  written[i] = out[i];
+  return writeRegister(i, out[i]);
+}
+
+// Flush the output frame - only registers that changed hit the I2C bus.
+// Registers with pick lights go first. The others stop as soon as a new
+// pick light is waiting and are written with the next frame instead, so
+// effects coalesce under load. Both buses are driven one after the other,
+// so their times add up.
+void writeFrame(uint8_t urgent) {
+  uint32_t ns = 0;
+  for (int i = 0; i < FRAME_BYTES; i++) {
+    if (urgent & (1 << i))
+      ns += flushRegister(i);
   }
-  // Handle missing second chip
-  if (x >= 24 && x < 48 && ch4231 == nullptr) {
-    if (blinkTest) {
-      Serial.println("No wire1, set current pin to 48");
-      currentPin = 48;
-      x = 48;
-    } else {
-      return;
+  for (int i = 0; i < FRAME_BYTES; i++) {
+    if (urgentRegs != 0 && out[i] != written[i]) {
+      metrics.i2cDeferred++;
+      break;
     }
+    ns += flushRegister(i);
   }
-  // First chip GPIO (0-7)
-  if (x < 8) {
-    ch423->digitalWrite(DFRobot_CH423::eGPIOPin_t(DFRobot_CH423::eGPIO0 + x),
-                        level);
+  if (ns == 0)
     return;
+  metrics.i2cFrames++;
+  metrics.i2cBusUs += ns / 1000;
+  metrics.frameBusUs = ns / 1000;
+  if (metrics.frameBusUs > metrics.frameBusMax)
+    metrics.frameBusMax = metrics.frameBusUs;
+}
+
+// Fill a channel with a blink pattern
+void setChannel(channel_t *ch, unsigned long now, unsigned long duration,
+                int period, int fill) {
+  ch->start = now;
+  ch->duration = duration;
+  ch->period = period > 0 ? period : 1;
+  ch->fill = fill;
+  ch->level = conf->brightness;
+}
+
+// Replace the whole frame atomically with new channel settings
+void blinkFrame(const channel_t *frame, Priority prio) {
+  portENTER_CRITICAL(&blinkMux);
+  for (int i = 0; prio == PRIO_PICK && i < NUM_PINS; i++) {
+    if (memcmp(&channels[i], &frame[i], sizeof(channel_t)) != 0)
+      urgentRegs |= 1 << (i / 8);
   }
-  // First chip GPO (8-23)
-  if (x < 24) {
-    ch423->digitalWrite(DFRobot_CH423::eGPOPin_t(DFRobot_CH423::eGPO0 + x - 8),
-                        level);
+  memcpy(channels, frame, sizeof(channels));
+  portEXIT_CRITICAL(&blinkMux);
+  if (blinkTask != nullptr)
+    xTaskNotifyGive(blinkTask); // Wake blink task to apply the frame
+}
+
+// Update a single channel, the other pins keep their patterns
+void blinkChannel(int pin, const channel_t *ch, Priority prio) {
+  if (pin < 0 || pin >= NUM_PINS)
     return;
+  portENTER_CRITICAL(&blinkMux);
+  channels[pin] = *ch;
+  if (prio == PRIO_PICK)
+    urgentRegs |= 1 << (pin / 8);
+  portEXIT_CRITICAL(&blinkMux);
+  if (blinkTask != nullptr)
+    xTaskNotifyGive(blinkTask);
+}
+
+// Trigger LED blink sequence for a specific pin (48 = all), others go dark
+void blinkPin(int pin, Priority prio) {
+  channel_t frame[NUM_PINS];
+  unsigned long now = millis();
+  memset(frame, 0, sizeof(frame));
+  for (int i = 0; i < NUM_PINS; i++) {
+    if (i == pin || pin == NUM_PINS)
+      setChannel(&frame[i], now, blinkDuration, blinkPeriod, blinkFill);
   }
-  // Second chip GPIO (24-31)
-  if (x < 32) {
-    ch4231->digitalWrite(
-        DFRobot_CH423::eGPIOPin_t(DFRobot_CH423::eGPIO0 + x - 24), level);
-    return;
+  LOGD("Starting to blink %d", pin);
+  blinkFrame(frame, prio);
+}
+
+// Read confirmation input mapping from config: "inputs" lists, for every
+// GPIO line (0-7 first chip, 8-15 second chip), the output pin it confirms
+void initInputs() {
+  for (int i = 0; i < INPUT_LINES; i++) {
+    inputs[i] = conf->inputs[i];
+    if (inputs[i] >= 0)
+      inputChip[i / 8] = true; // Whole GPIO bank switches to input
   }
-  // Second chip GPO (32-47)
-  if (x < 48) {
-    ch4231->digitalWrite(
-        DFRobot_CH423::eGPOPin_t(DFRobot_CH423::eGPO0 + x - 32), level);
-    return;
+  inputQueue = xQueueCreate(16, sizeof(input_t));
+}
+
+// Poll input lines - one GPIO read per chip, diffed against cached state
+// A change must be seen on two polls in a row to count (debounce)
+void pollInputs() {
+  DFRobot_CH423 *chips[2] = {ch423, ch4231};
+  for (int c = 0; c < 2; c++) {
+    if (!inputChip[c] || chips[c] == nullptr)
+      continue;
+    uint8_t raw = chips[c]->digitalRead(DFRobot_CH423::eGPIOTotal);
+    metrics.i2cReads++;
+    metrics.i2cBusUs += xferNs[c] / 1000;
+    uint8_t changed = (raw ^ inputState[c]) & ~(raw ^ inputRaw[c]);
+    inputRaw[c] = raw;
+    if (changed == 0)
+      continue;
+    inputState[c] ^= changed;
+    for (int b = 0; b < 8; b++) {
+      if (!(changed & (1 << b)) || inputs[c * 8 + b] < 0)
+        continue;
+      input_t event;
+      event.line = c * 8 + b;
+      event.pin = inputs[event.line];
+      event.active = !(raw & (1 << b)); // Buttons pull the line low
+      event.session = false;
+      if (event.active) {
+        // Close the pick right away, the web event can follow later
+        event.session = sessionConfirm(event.pin);
+        if (!event.session) {
+          channel_t off;
+          memset(&off, 0, sizeof(off));
+          blinkChannel(event.pin, &off, PRIO_PICK);
+        }
+      }
+      xQueueSend(inputQueue, &event, 0);
+    }
   }
-  // Write to all pins
-  if (level == HIGH)
-    level = 0xff;
-  if (ch423 != nullptr) {
-    ch423->digitalWrite(DFRobot_CH423::eGPIOTotal, level);
-    ch423->digitalWrite(DFRobot_CH423::eGPOTotal, level);
+}
+
+// Take the next input event, false when there is none
+bool nextInput(input_t *event) {
+  return inputQueue != nullptr && xQueueReceive(inputQueue, event, 0);
+}
+
+// Drivers of both chips, constructed in place by initChip()
+alignas(DFRobot_CH423) uint8_t chipStore[2][sizeof(DFRobot_CH423)];
+
+// Initialize CH423 chips, returns nullptr when the chip does not answer
+DFRobot_CH423 *initChip(TwoWire &wire, int bus, bool input) {
+  wire.beginTransmission(CH423_CMD_SET_SYSTEM_ARGS);
+  if (wire.endTransmission() != 0) {
+    LOGE("Wire%d not found!", bus);
+    return nullptr;
+  }
+  xferNs[bus] = I2C_XFER_BITS * (1000000000UL / wire.getClock());
+  DFRobot_CH423 *chip = new (chipStore[bus]) DFRobot_CH423(wire);
+  chip->begin();
+  chip->pinMode(DFRobot_CH423::eGPO, DFRobot_CH423::ePUSH_PULL);
+  chip->pinMode(DFRobot_CH423::eGPIO,
+                input ? DFRobot_CH423::eINPUT : DFRobot_CH423::eOUTPUT);
+  return chip;
+}
+
+// Drive the GPIO bank of a chip with walking ones, walking zeros, all low
+// and all high, reading every pattern back
+void testGpio(int c, DFRobot_CH423 *chip) {
+  int reg = c * 3; // Frame byte of the GPIO bank
+  uint8_t wrong = 0;
+  for (int p = 0; p < 18; p++) {
+    uint8_t pattern = 0xff; // Pattern 17: all high
+    if (p < 8)
+      pattern = 1 << p;
+    else if (p < 16)
+      pattern = ~(1 << (p - 8));
+    else if (p == 16)
+      pattern = 0x00;
+    out[reg] = pattern;
+    flushRegister(reg);
+    uint8_t got = chip->digitalRead(DFRobot_CH423::eGPIOTotal);
+    metrics.i2cReads++;
+    if (p == 16)
+      testResult.stuckHigh[c] = got; // Low everywhere, set bits are stuck
+    else if (p == 17)
+      testResult.stuckLow[c] = ~got;
+    else
+      wrong |= got ^ pattern;
+  }
+  testResult.bridged[c] =
+      wrong & ~testResult.stuckHigh[c] & ~testResult.stuckLow[c];
+  testResult.readback[c] = true;
+}
+
+// Run the self-test in the blink task: probe the chips, read back the
+// GPIO banks, then show every pin's number in binary over TEST_CODES
+// frames. Takes about two seconds, blink requests wait meanwhile.
+void runSelfTest() {
+  TwoWire *wires[2] = {&Wire, &Wire1};
+  DFRobot_CH423 *chips[2] = {ch423, ch4231};
+  unsigned long start = millis();
+  testState = TEST_RUNNING;
+  memset(&testResult, 0, sizeof(testResult));
+  for (int c = 0; c < 2; c++) {
+    if (chips[c] == nullptr)
+      continue;
+    wires[c]->beginTransmission(CH423_CMD_SET_SYSTEM_ARGS);
+    testResult.present[c] = wires[c]->endTransmission() == 0;
+    if (testResult.present[c] && !inputChip[c])
+      testGpio(c, chips[c]);
   }
-  if (ch4231 != nullptr) {
-    ch4231->digitalWrite(DFRobot_CH423::eGPIOTotal, level);
-    ch4231->digitalWrite(DFRobot_CH423::eGPOTotal, level);
+  // Pin n is lit in code frame k when bit k of n is set, LEDs active low
+  for (int k = 0; k < TEST_CODES; k++) {
+    memset(out, 0xff, sizeof(out));
+    for (int i = 0; i < NUM_PINS; i++) {
+      if (i & (1 << k))
+        out[i / 8] &= ~(1 << (i % 8));
+    }
+    for (int i = 0; i < FRAME_BYTES; i++)
+      flushRegister(i);
+    vTaskDelay(pdMS_TO_TICKS(TEST_STEP));
   }
+  testResult.ms = millis() - start;
+  testState = TEST_DONE; // blinkLoop() restores the frame next
+  LOGI("Self-test done in %lu ms", testResult.ms);
 }
 
-// Trigger LED blink sequence for a specific pin
-void blinkPin(int pin) {
-  currentPin = pin;
-  blink = BLINK_START;
+// Ask the blink task to run the self-test, false if one is running
+bool startSelfTest() {
+  if (testState == TEST_PENDING || testState == TEST_RUNNING ||
+      blinkTask == nullptr)
+    return false;
+  testState = TEST_PENDING;
+  xTaskNotifyGive(blinkTask);
+  return true;
+}
+
+// Add the pins of a chip's GPIO lines set in mask to a JSON array
+static void addLines(JsonArray pins, int c, uint8_t mask) {
+  for (int b = 0; b < 8; b++) {
+    if (mask & (1 << b))
+      pins.add(c * 24 + b);
+  }
+}
+
+// Self-test state and, once done, its report
+void selfTestJson(JsonObject json) {
+  static const char *const states[] = {"idle", "pending", "running", "done"};
+  TestState state = testState;
+  json["state"] = states[state];
+  if (state != TEST_DONE)
+    return;
+  const selftest_t *r = &testResult;
+  bool ok = true;
+  int unverified = 0; // GPO pins of present chips, checked by eye only
+  json["ms"] = r->ms;
+  JsonArray chips = json.createNestedArray("chips");
+  JsonArray high = json.createNestedArray("stuckHigh");
+  JsonArray low = json.createNestedArray("stuckLow");
+  JsonArray bridged = json.createNestedArray("bridged");
+  for (int c = 0; c < 2; c++) {
+    JsonObject chip = chips.createNestedObject();
+    chip["bus"] = c;
+    chip["present"] = r->present[c];
+    chip["readback"] = r->readback[c];
+    addLines(high, c, r->stuckHigh[c]);
+    addLines(low, c, r->stuckLow[c]);
+    addLines(bridged, c, r->bridged[c]);
+    ok = ok && r->present[c] &&
+         (r->stuckHigh[c] | r->stuckLow[c] | r->bridged[c]) == 0;
+    if (r->present[c])
+      unverified += 16;
+  }
+  json["unverified"] = unverified;
+  json["ok"] = ok;
+}
+
+// Bit plane over: let the blink task show the next one
+static void onBamPlane(void *) {
+  bamArmed = false;
+  xTaskNotifyGive(blinkTask);
+}
+
+// Create the plane timer. Plane 0 must outlast rewriting the whole frame
+// twice, so slow buses get longer planes rather than late ones.
+void initBam() {
+  esp_timer_create_args_t args = {};
+  args.callback = onBamPlane;
+  args.name = "bam";
+  esp_timer_create(&args, &bamTimer);
+  uint32_t frameNs = 3 * (xferNs[0] + xferNs[1]);
+  bamBaseUs = max((uint32_t)BAM_BASE_US, 2 * frameNs / 1000);
+  LOGD("Dimming with %u us base planes", (unsigned)bamBaseUs);
+}
+
+// Bring up both I2C buses and chips, dimming and inputs, all LEDs off
+void initBlink() {
+  // Initialize I2C buses and probe both CH423 chips
+  initInputs();
+  if (Wire.begin(SDA, SCL, I2C_CLOCK))
+    ch423 = initChip(Wire, 0, inputChip[0]);
+  if (Wire1.begin(SDA_2, SCL_2, I2C_CLOCK))
+    ch4231 = initChip(Wire1, 1, inputChip[1]);
+  initBam();
+  DFRobot_CH423 *chips[2] = {ch423, ch4231};
+  for (int c = 0; c < 2; c++) {
+    if (chips[c] != nullptr && inputChip[c])
+      inputState[c] = inputRaw[c] =
+          chips[c]->digitalRead(DFRobot_CH423::eGPIOTotal);
+  }
+
+  // Turn off all LEDs
+  memset(out, 0xff, sizeof(out));
+  for (int i = 0; i < FRAME_BYTES; i++) {
+    writeRegister(i, out[i]);
+    written[i] = out[i];
+  }
 }
 
 // LED blink task - runs on dedicated core
 void BlinkCode(void *) {
-  Serial.printf("Running blink on core %d\n", xPortGetCoreID());
+  LOGD("Running blink on core %d", xPortGetCoreID());
+  blinkTask = xTaskGetCurrentTaskHandle();
 
   /*
   int code = 0;
@@ -146,85 +464,81 @@ void BlinkCode(void *) {
     digitalWrite(G, LOW);
   */
 
-  // Initialize I2C buses and create CH423 instances
-  if (Wire.begin())
-    ch423 = new DFRobot_CH423(Wire);
-  if (Wire1.begin(SDA_2, SCL_2))
-    ch4231 = new DFRobot_CH423(Wire1);
-
-  // Test first chip presence
-  Wire.beginTransmission(CH423_CMD_SET_SYSTEM_ARGS);
-  if (Wire.endTransmission() != 0) {
-    Serial.println("Wire0 not found!");
-    delete ch423;
-    ch423 = nullptr;
-  } else {
-    ch423->begin();
-    ch423->pinMode(DFRobot_CH423::eGPO, DFRobot_CH423::ePUSH_PULL);
-    ch423->pinMode(DFRobot_CH423::eGPIO, DFRobot_CH423::eOUTPUT);
-  }
-
-  // Test second chip presence
-  Wire1.beginTransmission(CH423_CMD_SET_SYSTEM_ARGS);
-  if (Wire1.endTransmission() != 0) {
-    Serial.println("Wire1 not found!");
-    delete ch4231;
-    ch4231 = nullptr;
-  } else {
-    ch4231->begin();
-    ch4231->pinMode(DFRobot_CH423::eGPO, DFRobot_CH423::ePUSH_PULL);
-    ch4231->pinMode(DFRobot_CH423::eGPIO, DFRobot_CH423::eOUTPUT);
-  }
-
-  setPin(48, HIGH); // Turn off all LEDs
-
-  // Main blink loop
+  initBlink();
+
+  // Main blink loop - sleep until the next edge or a new frame arrives
   for (;;) {
-    blinkLoop();
-    vTaskDelay(10);
+    if (testState == TEST_PENDING)
+      runSelfTest();
+    unsigned long wait = blinkLoop();
+    ulTaskNotifyTake(pdTRUE,
+                     wait == BLINK_IDLE ? portMAX_DELAY : pdMS_TO_TICKS(wait));
   }
 }
 
-unsigned long lastBlink = 0; // Last blink state change time
+// LED blink state machine - renders all channels into the output frame
+// Returns time until the next deadline (ms) or BLINK_IDLE when nothing blinks
+unsigned long blinkLoop() {
+  unsigned long now = millis();
+  unsigned long wait = BLINK_IDLE;
+  bool expired = !bamArmed; // Plane shown long enough, or none running
+  bool dimmed = false;      // Some lit pin is below full brightness
 
-// LED blink state machine - handles blinking patterns
-void blinkLoop() {
-  // Start new blink sequence
-  if (blink == BLINK_START) {
-    Serial.printf("Starting to blink %d\n", currentPin);
-    blinkStart = millis();
-    lastBlink = 0;
-    blink = BLINK_HIGH;
-    setPin(48, HIGH); // Turn off all other LEDs
-  }
-  // Check if blink duration expired
-  if (blink != BLINK_NONE && millis() - blinkStart > blinkDuration) {
-    if (blinkTest) {
-      currentPin++;
-      blink = BLINK_START;
+  if (expired && bamOn)
+    bamPlane = (bamPlane + 1) % BAM_BITS;
+  portENTER_CRITICAL(&blinkMux);
+  uint8_t urgent = urgentRegs; // Taken with the frame it belongs to
+  urgentRegs = 0;
+  for (int i = 0; i < NUM_PINS; i++) {
+    channel_t *ch = &channels[i];
+    bool on = false;
+    if (ch->duration != 0) {
+      unsigned long elapsed = now - ch->start;
+      if (ch->duration != BLINK_FOREVER && elapsed >= ch->duration) {
+        ch->duration = 0; // Sequence finished
+      } else {
+        // Edges are derived from the start time, so they never drift
+        unsigned long phase = elapsed % ch->period;
+        unsigned long next;
+        on = phase < ch->fill;
+        if (ch->fill >= ch->period)
+          next = BLINK_IDLE; // Steady on, no edges
+        else
+          next = on ? ch->fill - phase : ch->period - phase;
+        if (ch->duration != BLINK_FOREVER && ch->duration - elapsed < next)
+          next = ch->duration - elapsed;
+        if (next < wait)
+          wait = next;
+      }
     }
-    if (!blinkTest || currentPin > 48) {
-      blink = BLINK_NONE;
-      blinkTest = false;
-      setPin(48, HIGH); // Turn off all LEDs
+    if (on && ch->level < BAM_FULL) {
+      dimmed = true;
+      on = ch->level & (1 << bamPlane);
     }
+    if (on)
+      out[i / 8] &= ~(1 << (i % 8));
+    else
+      out[i / 8] |= 1 << (i % 8);
   }
-  // LED off period complete, turn LED on
-  if (blink == BLINK_LOW && millis() - lastBlink > blinkFill) {
-    setPin(currentPin, HIGH);
-    lastBlink = millis();
-    blink = BLINK_HIGH;
+  portEXIT_CRITICAL(&blinkMux);
+
+  // Time the plane from before its write, so every plane is late alike
+  bamOn = dimmed;
+  if (dimmed && expired && bamTimer != nullptr) {
+    bamArmed = true;
+    esp_timer_start_once(bamTimer, bamBaseUs << bamPlane);
   }
-  // LED on period complete, turn LED off
-  if (blink == BLINK_HIGH && millis() - lastBlink > blinkPeriod - blinkFill) {
-    setPin(currentPin, LOW);
-    lastBlink = millis();
-    blink = BLINK_LOW;
+  writeFrame(urgent);
+
+  // Inputs need polling, so never sleep longer than the poll interval.
+  // Planes wake the task far more often, debouncing needs the interval.
+  if (inputChip[0] || inputChip[1]) {
+    if (now - lastPoll >= INPUT_POLL) {
+      pollInputs();
+      lastPoll = now;
+    }
+    if (wait > INPUT_POLL - (now - lastPoll))
+      wait = INPUT_POLL - (now - lastPoll);
   }
-  /*
-  if (code != codeTarget) {
-        writeCodeToLed(codeTarget);
-        code = codeTarget;
-      }
-  */
+  return wait;
 }
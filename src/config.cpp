@@ -0,0 +1,468 @@
+/*
+ * PutToLight - Configuration Module
+ *
+ * Copyright (c) 2023 Serhii Nesterenko
+ * Licensed under the MIT License. See LICENSE file in the project root.
+ *
+ * A new config is staged in a temp file, validated and then renamed over
+ * config.json; LittleFS replaces the old file atomically, so a power loss
+ * leaves either the old or the new config. One upload stages at a time,
+ * others are turned away until it is committed or dropped. The main loop
+ * then reloads it and re-initialises only what changed.
+ *
+ * The JSON document only lives while config.json is read: its fields are
+ * parsed into a config_t once, with addresses and UUIDs already converted,
+ * and the running code reads conf. A reload fills a spare copy and then
+ * switches conf to it, so readers never see a half-written one. Readers
+ * that use more than one field hold their copy with holdConfig(); a held
+ * copy is never chosen as the spare, so it stays intact however many
+ * reloads happen meanwhile. Writers run in loop() and async_tcp and take
+ * configLock one at a time.
+ */
+
+#include "ptl.hpp"
+#include <LittleFS.h>
+
+#define CONFIG_FILE "/config.json"
+#define CONFIG_TMP "/config.tmp"
+#define CONFIG_SLOTS 3 // The live copy, one held by a slow reader, a spare
+
+volatile bool configPending = false; // Installed config waits for loop()
+void *configOwner = nullptr;         // Request staging CONFIG_TMP, if any
+size_t configLen = 0;                // Bytes of the upload staged in order
+size_t configTotal = 0;              // Size of the upload being staged
+
+config_t configs[CONFIG_SLOTS];              // Live config and spares
+const config_t *volatile conf = &configs[0]; // Live config
+uint8_t configRefs[CONFIG_SLOTS];            // Readers holding each copy
+portMUX_TYPE configMux = portMUX_INITIALIZER_UNLOCKED; // Guards conf, refs
+SemaphoreHandle_t configLock = nullptr;      // One writer at a time
+
+// Take the live config for a read of several fields; it is not rewritten
+// until released
+const config_t *holdConfig() {
+  portENTER_CRITICAL(&configMux);
+  const config_t *c = conf;
+  configRefs[c - configs]++;
+  portEXIT_CRITICAL(&configMux);
+  return c;
+}
+
+// Give back a copy taken by holdConfig()
+void releaseConfig(const config_t *c) {
+  portENTER_CRITICAL(&configMux);
+  configRefs[c - configs]--;
+  portEXIT_CRITICAL(&configMux);
+}
+
+// A copy that is neither live nor held, with configLock taken. Waits
+// while readers hold all the others.
+static config_t *spareConfig() {
+  for (;;) {
+    portENTER_CRITICAL(&configMux);
+    for (int i = 0; i < CONFIG_SLOTS; i++) {
+      if (&configs[i] != conf && configRefs[i] == 0) {
+        portEXIT_CRITICAL(&configMux);
+        return &configs[i];
+      }
+    }
+    portEXIT_CRITICAL(&configMux);
+    delay(10);
+  }
+}
+
+// Make a filled spare the live config
+static void publishConfig(const config_t *next) {
+  portENTER_CRITICAL(&configMux);
+  conf = next;
+  portEXIT_CRITICAL(&configMux);
+}
+
+// Set the scanner to connect to, empty strings for none
+static void setScanner(config_t *c, const char *addr, const char *service,
+                       const char *charact) {
+  strlcpy(c->addr, addr, sizeof(c->addr));
+  c->scanner = NimBLEAddress(string(addr));
+  c->service = service[0] != 0 ? NimBLEUUID(string(service)) : NimBLEUUID();
+  c->charact = charact[0] != 0 ? NimBLEUUID(string(charact)) : NimBLEUUID();
+}
+
+// Fill a config from config.json, with defaults for missing fields
+static void parseConfig(JsonObject j, config_t *c) {
+  static const char *const gs1Defaults[] = {"00", "01", "10", "403"};
+  // Scanning and blinking next to the radio stacks, the rest on core 1
+  static const task_cfg_t taskDefaults[TASKS] = {
+      {0, 15, 5000}, {0, 10, 5000}, {1, 1, 4096}, {1, 1, 3072}};
+  *c = config_t();
+  c->standalone = j["standalone"] | true;
+  strlcpy(c->ssid, j["ssid"] | "", sizeof(c->ssid));
+  strlcpy(c->wifipass, j["wifipass"] | "", sizeof(c->wifipass));
+  c->staticIp = parseCidr(j["cidr"] | "", c->ip, c->mask) &&
+                c->gw.fromString(j["gw"] | "");
+  if (!c->dns.fromString(j["dns"] | ""))
+    c->dns = c->gw;
+  setScanner(c, j["addr"] | "", j["service"] | "", j["charact"] | "");
+
+  int i = 0;
+  for (JsonVariant name : j["pins"].as<JsonArray>()) {
+    if (i < NUM_PINS)
+      strlcpy(c->pins[i++], name | "", PIN_NAME);
+  }
+  memset(c->inputs, -1, sizeof(c->inputs));
+  i = 0;
+  for (JsonVariant pin : j["inputs"].as<JsonArray>()) {
+    if (i < INPUT_LINES)
+      c->inputs[i++] = pin | -1;
+  }
+
+  // SSCC, GTIN, batch/lot and routing code by default
+  JsonArray keys = j["gs1"];
+  if (keys.isNull()) {
+    for (const char *key : gs1Defaults)
+      strcpy(c->gs1Keys[c->nGs1Keys++], key);
+  }
+  for (JsonVariant key : keys) {
+    if (c->nGs1Keys < GS1_KEYS)
+      strlcpy(c->gs1Keys[c->nGs1Keys++], key | "", sizeof(c->gs1Keys[0]));
+  }
+  int level = levelOf(j["log"] | "info");
+  c->logLevel = level < 0 ? LEVEL_INFO : level;
+  c->brightness = j["brightness"] | BAM_FULL;
+
+  JsonObject fwd = j["forward"];
+  const char *proto = fwd["proto"] | "udp";
+  c->fwdProto = strcmp(proto, "tcp") == 0    ? PROTO_TCP
+                : strcmp(proto, "http") == 0 ? PROTO_HTTP
+                                             : PROTO_UDP;
+  strlcpy(c->fwdHost, fwd["host"] | "", sizeof(c->fwdHost));
+  strlcpy(c->fwdPath, fwd["path"] | "/", sizeof(c->fwdPath));
+  c->fwdPort = fwd["port"] | (c->fwdProto == PROTO_HTTP ? 80 : 9000);
+  c->fwdLatency = fwd["latency"] | 1000;
+  c->fwdBatch = fwd["batch"] | 32;
+
+  for (int i = 0; i < TASKS; i++) {
+    JsonObject t = j["tasks"][taskNames[i]];
+    const task_cfg_t *d = &taskDefaults[i];
+    c->tasks[i].core = t["core"] | d->core;
+    c->tasks[i].priority = t["priority"] | d->priority;
+    c->tasks[i].stack = t["stack"] | d->stack;
+  }
+}
+
+// Load configuration from LittleFS into the spare copy and make it live.
+// A file that cannot be read gives the defaults.
+void readConfig() {
+  DynamicJsonDocument json(CONFIG_DOC);
+  if (configLock == nullptr)
+    configLock = xSemaphoreCreateMutex(); // First call, from setup()
+  File file = LittleFS.open(CONFIG_FILE, FILE_READ);
+  if (!file) {
+    LOGE("ERROR: There was an error opening config file");
+  } else {
+    LOGI("Config opened!");
+    DeserializationError error = deserializeJson(json, file);
+    file.close();
+    if (error)
+      LOGE("ERROR: deserialize");
+    else
+      lastWrite = getTime();
+  }
+  xSemaphoreTake(configLock, portMAX_DELAY);
+  config_t *next = spareConfig();
+  parseConfig(json.as<JsonObject>(), next);
+  publishConfig(next);
+  xSemaphoreGive(configLock);
+}
+
+// Switch to another scanner without saving it, until the next reload
+void selectScanner(const char *addr, const char *service,
+                   const char *charact) {
+  xSemaphoreTake(configLock, portMAX_DELAY);
+  config_t *next = spareConfig();
+  *next = *conf; // Live copies are only replaced under configLock
+  setScanner(next, addr, service, charact);
+  publishConfig(next);
+  xSemaphoreGive(configLock);
+}
+
+// Optional string field no longer than max
+bool isString(JsonVariant v, size_t max) {
+  return v.isNull() ||
+         (v.is<const char *>() && strlen(v.as<const char *>()) <= max);
+}
+
+// Optional integer field within [min, max]
+bool isInt(JsonVariant v, int min, int max) {
+  return v.isNull() ||
+         (v.is<int>() && v.as<int>() >= min && v.as<int>() <= max);
+}
+
+// Optional IPv4 address field, empty means not set
+bool isIp(JsonVariant v) {
+  IPAddress ip;
+  const char *s = v | "";
+  if (v.isNull())
+    return true;
+  return v.is<const char *>() && (s[0] == 0 || ip.fromString(s));
+}
+
+// Optional "aa:bb:cc:dd:ee:ff" field, empty means no scanner selected
+bool isMac(JsonVariant v) {
+  const char *s = v | "";
+  if (!v.isNull() && !v.is<const char *>())
+    return false;
+  if (s[0] == 0)
+    return true;
+  if (strlen(s) != 17)
+    return false;
+  for (int i = 0; i < 17; i++) {
+    if (i % 3 == 2 ? s[i] != ':' : !isxdigit(s[i]))
+      return false;
+  }
+  return true;
+}
+
+// Check a config against the schema, returns error message or nullptr
+const char *validateConfig(JsonObject c) {
+  if (c.isNull())
+    return "config must be an object";
+  if (!c["standalone"].isNull() && !c["standalone"].is<bool>())
+    return "standalone must be true or false";
+  const char *ssid = c["ssid"] | "";
+  if (!c["ssid"].is<const char *>() || ssid[0] == 0 || strlen(ssid) > 32)
+    return "ssid must be 1-32 characters";
+  if (!isString(c["wifipass"], 63))
+    return "wifipass must be up to 63 characters";
+  size_t pass = strlen(c["wifipass"] | "");
+  if (c["standalone"] == true && pass > 0 && pass < 8)
+    return "wifipass must be at least 8 characters for an access point";
+  IPAddress ip, mask;
+  const char *cidr = c["cidr"] | "";
+  if (!isString(c["cidr"], 18) ||
+      (cidr[0] != 0 && !parseCidr(cidr, ip, mask)))
+    return "cidr must be a.b.c.d/bits";
+  if (!isIp(c["gw"]) || !isIp(c["dns"]))
+    return "gw and dns must be IPv4 addresses";
+  if (!isMac(c["addr"]))
+    return "addr must be a MAC address";
+  if (!isString(c["service"], 36) || !isString(c["charact"], 36))
+    return "service and charact must be UUIDs";
+  if (!c["log"].isNull() && levelOf(c["log"] | "") < 0)
+    return "log must be error, warn, info or debug";
+  if (!isInt(c["brightness"], 1, BAM_FULL))
+    return "brightness must be 1-7";
+
+  if (!c["pins"].isNull()) {
+    JsonArray pins = c["pins"];
+    if (pins.isNull() || pins.size() > NUM_PINS)
+      return "pins must be an array of up to 48 names";
+    for (JsonVariant name : pins) {
+      if (!isString(name, PIN_NAME - 1) || name.isNull())
+        return "pins must be names of up to 31 characters";
+    }
+  }
+
+  if (!c["inputs"].isNull()) {
+    JsonArray inputs = c["inputs"];
+    if (inputs.isNull() || inputs.size() > INPUT_LINES)
+      return "inputs must be an array of up to 16 pins";
+    for (JsonVariant pin : inputs) {
+      if (!pin.is<int>() || pin.as<int>() < -1 || pin.as<int>() >= NUM_PINS)
+        return "inputs must be pins 0-47 or -1";
+    }
+  }
+
+  if (!c["gs1"].isNull()) {
+    JsonArray keys = c["gs1"];
+    if (keys.isNull() || keys.size() > GS1_KEYS)
+      return "gs1 must be an array of up to 8 AIs";
+    for (JsonVariant key : keys) {
+      const char *ai = key | "";
+      size_t len = strlen(ai);
+      if (!key.is<const char *>() || len < 2 || len > 4 ||
+          strspn(ai, "0123456789") != len)
+        return "gs1 AIs must be 2-4 digits";
+    }
+  }
+
+  if (!c["forward"].isNull()) {
+    JsonObject fwd = c["forward"];
+    const char *proto = fwd["proto"] | "udp";
+    if (fwd.isNull() || !isString(fwd["host"], 63) ||
+        !isString(fwd["path"], 63))
+      return "forward must be an object with host and path";
+    if (!fwd["port"].isNull() &&
+        (!fwd["port"].is<int>() || fwd["port"] < 1 || fwd["port"] > 65535))
+      return "forward.port must be 1-65535";
+    if (!isInt(fwd["latency"], 0, 60000))
+      return "forward.latency must be 0-60000 ms";
+    if (!isInt(fwd["batch"], 1, 64))
+      return "forward.batch must be 1-64 scans";
+    if (strcmp(proto, "udp") != 0 && strcmp(proto, "tcp") != 0 &&
+        strcmp(proto, "http") != 0)
+      return "forward.proto must be udp, tcp or http";
+  }
+
+  if (!c["tasks"].isNull()) {
+    JsonObject tasks = c["tasks"];
+    if (tasks.isNull())
+      return "tasks must be an object";
+    for (JsonPair kv : tasks) {
+      int id = 0;
+      while (id < TASKS && kv.key() != taskNames[id])
+        id++;
+      JsonObject t = kv.value();
+      if (id == TASKS || t.isNull())
+        return "tasks must be BT, Blink, Forward or Log objects";
+      if (!isInt(t["core"], -1, 1))
+        return "task core must be 0, 1 or -1 for either";
+      if (!isInt(t["priority"], 1, 24))
+        return "task priority must be 1-24";
+      if (!isInt(t["stack"], 2048, 16384))
+        return "task stack must be 2048-16384 bytes";
+    }
+  }
+  return nullptr;
+}
+
+// Replace config.json with the staged file
+bool installConfig() {
+  if (!LittleFS.rename(CONFIG_TMP, CONFIG_FILE))
+    return false;
+  configPending = true;
+  return true;
+}
+
+// Claim the staging file for an upload, false if another one holds it
+bool beginConfigUpload(void *owner) {
+  if (configOwner != nullptr)
+    return false;
+  configOwner = owner;
+  configLen = 0;
+  configTotal = 0;
+  return true;
+}
+
+// True while another request is staging a config
+bool configBusy(void *owner) {
+  return configOwner != nullptr && configOwner != owner;
+}
+
+// Drop an upload that failed or whose client went away
+void abortConfigUpload(void *owner) {
+  if (configOwner != owner)
+    return;
+  LittleFS.remove(CONFIG_TMP);
+  configOwner = nullptr;
+}
+
+// Append a chunk of an uploaded config to the staging file. After a chunk
+// failed, the ones behind it are refused, so the upload stays unfinished.
+bool stageConfig(void *owner, const uint8_t *data, size_t len, size_t index,
+                 size_t total) {
+  if (configOwner != owner || index != configLen)
+    return false;
+  File file = LittleFS.open(CONFIG_TMP, index == 0 ? FILE_WRITE : FILE_APPEND);
+  if (!file)
+    return false;
+  bool written = file.write(data, len) == len;
+  file.close();
+  if (!written)
+    return false;
+  configLen += len;
+  configTotal = total;
+  return true;
+}
+
+// True once every chunk of the owner's upload is staged
+bool configStaged(void *owner) {
+  return configOwner == owner && configTotal > 0 && configLen == configTotal;
+}
+
+// Validate the staged upload and install it, returns error or nullptr.
+// The staging file is free for the next upload afterwards.
+const char *commitConfig(void *owner) {
+  if (configOwner != owner)
+    return "another upload is in progress";
+  DynamicJsonDocument next(CONFIG_DOC);
+  File file = LittleFS.open(CONFIG_TMP, FILE_READ);
+  const char *msg = nullptr;
+  if (!file) {
+    msg = "unable to read file";
+  } else {
+    DeserializationError error = deserializeJson(next, file);
+    file.close();
+    msg = error ? "bad json" : validateConfig(next.as<JsonObject>());
+  }
+  if (msg == nullptr && !installConfig())
+    msg = "unable to write file";
+  if (msg != nullptr)
+    LittleFS.remove(CONFIG_TMP);
+  configOwner = nullptr;
+  return msg;
+}
+
+// Validate a config and install it, returns error or nullptr
+const char *saveConfig(JsonObject config) {
+  const char *msg = validateConfig(config);
+  if (msg != nullptr)
+    return msg;
+  if (configOwner != nullptr)
+    return "another upload is in progress";
+  File file = LittleFS.open(CONFIG_TMP, FILE_WRITE);
+  if (!file)
+    return "unable to write file";
+  bool written = serializeJson(config, file) != 0;
+  file.close();
+  if (!written || !installConfig()) {
+    LittleFS.remove(CONFIG_TMP);
+    return "unable to write file";
+  }
+  return nullptr;
+}
+
+// True if the WiFi settings differ between two configs
+static bool wifiChanged(const config_t *a, const config_t *b) {
+  return a->standalone != b->standalone || strcmp(a->ssid, b->ssid) != 0 ||
+         strcmp(a->wifipass, b->wifipass) != 0 ||
+         a->staticIp != b->staticIp || a->ip != b->ip || a->mask != b->mask ||
+         a->gw != b->gw || a->dns != b->dns;
+}
+
+// True if the scanner differs between two configs
+static bool scannerChanged(const config_t *a, const config_t *b) {
+  return strcmp(a->addr, b->addr) != 0 ||
+         a->service.toString() != b->service.toString() ||
+         a->charact.toString() != b->charact.toString();
+}
+
+// True if settings read only at boot differ between two configs
+static bool bootChanged(const config_t *a, const config_t *b) {
+  return memcmp(a->inputs, b->inputs, sizeof(a->inputs)) != 0 ||
+         strcmp(a->fwdHost, b->fwdHost) != 0 ||
+         strcmp(a->fwdPath, b->fwdPath) != 0 || a->fwdPort != b->fwdPort ||
+         a->fwdProto != b->fwdProto || a->fwdLatency != b->fwdLatency ||
+         a->fwdBatch != b->fwdBatch ||
+         memcmp(a->tasks, b->tasks, sizeof(a->tasks)) != 0;
+}
+
+// Reload an installed config and re-initialise only what it changed.
+// Pins and GS1 keys are read from conf where they are used.
+void checkConfig() {
+  if (!configPending)
+    return;
+  configPending = false;
+  const config_t *a = holdConfig(); // Previous config, to see what changed
+  readConfig();
+  const config_t *b = holdConfig();
+  LOGI("Config reloaded");
+  if (scannerChanged(a, b))
+    disconnectFromScanner(); // BLE task reconnects to the new target
+  if (wifiChanged(a, b))
+    restartWiFi();
+  logLevel = b->logLevel;
+  if (bootChanged(a, b))
+    LOGW("inputs, forward and tasks take effect after a reboot");
+  releaseConfig(a);
+  releaseConfig(b);
+}
@@ -0,0 +1,315 @@
+/*
+ * PutToLight - Scan Forwarding Module
+ *
+ * Copyright (c) 2023 Serhii Nesterenko
+ * Licensed under the MIT License. See LICENSE file in the project root.
+ *
+ * Pushes scan events to an upstream collector as newline-delimited JSON
+ * over UDP, a persistent TCP connection or HTTP POST. Events are batched
+ * for at most "latency" ms; batches that cannot be sent go to a bounded
+ * spool file on flash and are replayed in order once the collector is
+ * reachable again. The replay position is kept in NVS, so a reboot
+ * resumes the replay instead of sending the spool again. An HTTP
+ * collector also sets the clock through its Date header while NTP is
+ * not available.
+ */
+
+#include "ptl.hpp"
+#include <HTTPClient.h>
+#include <LittleFS.h>
+#include <Preferences.h>
+#include <WiFi.h>
+#include <WiFiUdp.h>
+
+#define FWD_LINE 256         // Largest forwarded event
+#define FWD_QUEUE 16         // Events waiting for the forward task
+#define FWD_BATCH_BYTES 2048 // Largest batch sent at once
+#define FWD_DATAGRAM 1400    // Largest UDP datagram
+#define FWD_SPOOL_MAX 32768  // Spool file size limit (bytes)
+#define FWD_RETRY 5000       // Spool replay interval while idle (ms)
+#define FWD_TIMEOUT 2000     // TCP connect and HTTP timeout (ms)
+#define FWD_SPOOL "/spool.jsonl"
+
+// Queued event, copied so the caller's buffer can be reused at once
+typedef struct {
+  char line[FWD_LINE];
+} fwd_line_t;
+
+QueueHandle_t fwdQueue = nullptr;
+
+// Target, copied from the config at boot
+char fwdHost[64];
+char fwdPath[64];
+uint16_t fwdPort;
+Proto fwdProto;
+unsigned long fwdLatency; // Longest time an event waits in a batch (ms)
+int fwdBatch;             // Events per batch
+char fwdDev[18];          // Controller MAC, tags every event
+
+// Batch being collected and spool replay buffer
+char batch[FWD_BATCH_BYTES];
+size_t batchLen = 0;
+int batchCount = 0;
+unsigned long batchFirst = 0; // Arrival of the oldest event in the batch
+char replay[FWD_BATCH_BYTES];
+size_t spoolOffset = 0; // Bytes of the spool file already delivered
+Preferences fwdPrefs;   // spoolOffset across reboots
+
+WiFiUDP udp;
+WiFiClient tcp;
+HTTPClient http;
+
+// Send a datagram per group of whole lines
+bool sendUdp(const char *data, size_t len) {
+  size_t start = 0;
+  while (start < len) {
+    size_t end = start, cut = start;
+    while (end < len && end - start < FWD_DATAGRAM) {
+      if (data[end++] == '\n')
+        cut = end;
+    }
+    if (end == len)
+      cut = len;
+    if (cut == start) // Single line longer than a datagram
+      cut = end;
+    if (!udp.beginPacket(fwdHost, fwdPort))
+      return false;
+    udp.write((const uint8_t *)data + start, cut - start);
+    if (!udp.endPacket())
+      return false;
+    start = cut;
+  }
+  return true;
+}
+
+// Write lines to the persistent connection, reconnecting if it dropped
+bool sendTcp(const char *data, size_t len) {
+  if (!tcp.connected()) {
+    tcp.stop();
+    if (!tcp.connect(fwdHost, fwdPort, FWD_TIMEOUT))
+      return false;
+    tcp.setNoDelay(true);
+  }
+  if (tcp.write((const uint8_t *)data, len) != len) {
+    tcp.stop();
+    return false;
+  }
+  return true;
+}
+
+// Unix time of an HTTP date ("Sun, 06 Nov 1994 08:49:37 GMT"), 0 if bad
+unsigned long parseHttpDate(const char *s) {
+  static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  char mon[4];
+  int d, y, hh, mm, ss;
+  if (sscanf(s, "%*3s, %d %3s %d %d:%d:%d", &d, mon, &y, &hh, &mm, &ss) !=
+          6 ||
+      strlen(mon) != 3)
+    return 0;
+  const char *m = strstr(months, mon);
+  if (m == nullptr || (m - months) % 3 != 0 || y < 1970)
+    return 0;
+  // Days since 1970-01-01 in the proleptic Gregorian calendar, with the
+  // year starting in March so that leap days come last
+  int month = (m - months) / 3;
+  y -= month < 2;
+  long era = y / 400, yoe = y - era * 400;
+  long doy = (153 * (month < 2 ? month + 10 : month - 2) + 2) / 5 + d - 1;
+  long days = era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+  return days * 86400UL + hh * 3600 + mm * 60 + ss;
+}
+
+// POST lines as one NDJSON body, keeping the connection alive
+bool sendHttp(const char *data, size_t len) {
+  static const char *headers[] = {"Date"};
+  http.setReuse(true);
+  http.setTimeout(FWD_TIMEOUT);
+  if (!http.begin(fwdHost, fwdPort, fwdPath))
+    return false;
+  http.addHeader("Content-Type", "application/x-ndjson");
+  http.collectHeaders(headers, 1);
+  int code = http.POST((uint8_t *)data, len);
+  bool ok = code >= 200 && code < 300;
+  if (ok && http.hasHeader("Date"))
+    pushTime(parseHttpDate(http.header("Date").c_str())); // No-op with NTP
+  http.end();
+  return ok;
+}
+
+// Deliver a block of lines over the configured transport
+bool sendLines(const char *data, size_t len) {
+  if (WiFi.status() != WL_CONNECTED)
+    return false;
+  switch (fwdProto) {
+  case PROTO_TCP:
+    return sendTcp(data, len);
+  case PROTO_HTTP:
+    return sendHttp(data, len);
+  default:
+    return sendUdp(data, len);
+  }
+}
+
+// Append the current batch to the spool, dropping it if the spool is full
+void spoolBatch() {
+  File file = LittleFS.open(FWD_SPOOL, FILE_APPEND);
+  if (!file || file.size() + batchLen > FWD_SPOOL_MAX) {
+    metrics.fwdDropped += batchCount;
+  } else if (file.write((const uint8_t *)batch, batchLen) != batchLen) {
+    metrics.fwdDropped += batchCount;
+  } else {
+    metrics.fwdSpooled += batchCount;
+  }
+  if (file)
+    file.close();
+}
+
+// Record delivered spool bytes, in NVS too so a reboot does not send
+// them again
+static void saveOffset(size_t offset) {
+  spoolOffset = offset;
+  fwdPrefs.putUInt("offset", offset);
+}
+
+// Skip the rest of a line too long for the replay buffer. Returns the
+// bytes up to and including its newline, or up to the end of the spool.
+static size_t skipLine(File &file) {
+  size_t skipped = 0;
+  for (;;) {
+    size_t len = file.read((uint8_t *)replay, sizeof(replay));
+    if (len == 0)
+      return skipped;
+    const char *end = (const char *)memchr(replay, '\n', len);
+    if (end != nullptr)
+      return skipped + (end - replay) + 1;
+    skipped += len;
+  }
+}
+
+// Send spooled lines oldest first, true once the spool is empty
+bool replaySpool() {
+  if (!LittleFS.exists(FWD_SPOOL))
+    return true;
+  File file = LittleFS.open(FWD_SPOOL, FILE_READ);
+  if (!file)
+    return false;
+  file.seek(spoolOffset);
+  for (;;) {
+    size_t len = file.read((uint8_t *)replay, sizeof(replay));
+    if (len == 0)
+      break;
+    size_t cut = len;
+    while (cut > 0 && replay[cut - 1] != '\n')
+      cut--;
+    if (cut == 0) // Line longer than the buffer, skip all of it
+      cut = len + skipLine(file);
+    else if (!sendLines(replay, cut)) {
+      file.close();
+      return false;
+    }
+    saveOffset(spoolOffset + cut);
+    file.seek(spoolOffset);
+  }
+  file.close();
+  LittleFS.remove(FWD_SPOOL); // Before the offset: a reboot between the
+  saveOffset(0);              // two finds no spool and starts at 0
+  return true;
+}
+
+// Send the current batch after any spooled events, or spool it
+void flushBatch() {
+  if (replaySpool() && sendLines(batch, batchLen))
+    metrics.forwarded += batchCount;
+  else
+    spoolBatch();
+  batchLen = 0;
+  batchCount = 0;
+}
+
+// Add one line to the batch, false if it does not fit
+bool appendBatch(const char *line) {
+  size_t len = strlen(line);
+  if (batchLen + len + 1 > sizeof(batch))
+    return false;
+  memcpy(batch + batchLen, line, len);
+  batchLen += len;
+  batch[batchLen++] = '\n';
+  batchCount++;
+  return true;
+}
+
+// One round of the forward task: take an event, then send once the batch
+// is full or the oldest event has waited fwdLatency; retry the spool
+// while idle
+void forwardStep() {
+  fwd_line_t item;
+  TickType_t wait = portMAX_DELAY;
+  if (batchCount > 0) {
+    long left = (long)fwdLatency - (long)(millis() - batchFirst);
+    wait = left > 0 ? pdMS_TO_TICKS(left) : 0;
+  } else if (LittleFS.exists(FWD_SPOOL)) {
+    wait = pdMS_TO_TICKS(FWD_RETRY);
+  }
+  if (xQueueReceive(fwdQueue, &item, wait) == pdTRUE) {
+    if (!appendBatch(item.line)) {
+      flushBatch();
+      appendBatch(item.line);
+    }
+    if (batchCount == 1)
+      batchFirst = millis();
+    if (batchCount < fwdBatch)
+      return;
+  }
+  if (batchCount > 0)
+    flushBatch();
+  else
+    replaySpool();
+}
+
+// Forward task
+void ForwardCode(void *params) {
+  for (;;)
+    forwardStep();
+}
+
+// Queue a scan event for forwarding, never blocks the caller
+void forwardScan(const char *json) {
+  if (fwdQueue == nullptr)
+    return;
+  fwd_line_t item;
+  // Tag the event with the controller: {"dev":"<mac>", + rest of the object
+  int len = snprintf(item.line, sizeof(item.line), "{\"dev\":\"%s\",%s",
+                     fwdDev, json + 1);
+  if (len >= (int)sizeof(item.line) ||
+      xQueueSend(fwdQueue, &item, 0) != pdTRUE)
+    metrics.fwdDropped++;
+}
+
+// Start forwarding if the config names a collector
+void initForward() {
+  static const char *const protos[] = {"udp", "tcp", "http"};
+  const config_t *c = holdConfig();
+  strlcpy(fwdHost, c->fwdHost, sizeof(fwdHost));
+  strlcpy(fwdPath, c->fwdPath, sizeof(fwdPath));
+  fwdProto = c->fwdProto;
+  fwdPort = c->fwdPort;
+  fwdLatency = c->fwdLatency;
+  fwdBatch = constrain(c->fwdBatch, 1, FWD_BATCH_BYTES / 32);
+  releaseConfig(c);
+  if (fwdHost[0] == 0)
+    return;
+  strlcpy(fwdDev, WiFi.macAddress().c_str(), sizeof(fwdDev));
+
+  // Resume the replay where it stopped, unless the spool is gone
+  fwdPrefs.begin("fwd", false);
+  spoolOffset = fwdPrefs.getUInt("offset", 0);
+  File file = LittleFS.open(FWD_SPOOL, FILE_READ);
+  if (spoolOffset != 0 && (!file || spoolOffset > file.size()))
+    saveOffset(0);
+  if (file)
+    file.close();
+
+  fwdQueue = xQueueCreate(FWD_QUEUE, sizeof(fwd_line_t));
+  startTask(TASK_FORWARD, &ForwardCode);
+  LOGI("Forwarding scans to %s:%d (%s)", fwdHost, fwdPort, protos[fwdProto]);
+}
@@ -0,0 +1,380 @@
+/*
+ * PutToLight - GS1 Element String Parser
+ *
+ * Copyright (c) 2023 Serhii Nesterenko
+ * Licensed under the MIT License. See LICENSE file in the project root.
+ *
+ * Splits a GS1 element string (GS1-128, GS1 DataMatrix, GS1 QR, DataBar)
+ * into its application identifiers while the code arrives, one byte at a
+ * time, into a fixed set of fields. A symbology identifier such as ]C1
+ * may lead and FNC1 is sent as GS. Fields with a predefined length need
+ * no separator, the others end with GS or the end of the code.
+ *
+ * GS1 Digital Link URIs (https://id.gs1.org/01/09506000134352/10/AB1)
+ * give the same fields: the path holds AI/value pairs from a primary key
+ * on, after any segments of the resolver's own, and the query string adds
+ * AI=value pairs. Values are %-decoded, and a GTIN-8, -12 or -13 is
+ * padded to 14 digits, as in element strings.
+ */
+
+#include "ptl.hpp"
+
+#define GS 0x1D // Group separator, FNC1 in GS1 codes
+
+// Parser states
+enum Gs1State {
+  G_START,  // Before the first byte
+  G_SYMB,   // In the symbology identifier
+  G_AI,     // In an application identifier
+  G_VALUE,  // In a field value
+  G_NONE,   // Not a GS1 element string
+  G_SCHEME, // Digital Link: in the URI scheme
+  G_PATH,   // Digital Link: in a path segment
+  G_QUERY,  // Digital Link: in the AI of a query parameter
+  G_QVALUE, // Digital Link: in the value of a query parameter
+  G_QSKIP,  // Digital Link: in a query parameter that is not an AI
+  G_FRAG    // Digital Link: in the fragment, ignored
+};
+
+// Digits of an application identifier by its first two digits, 0 for
+// ranges that are not assigned
+static const char aiDigits[] = "2222200000"
+                               "2222222222"
+                               "2223333000"
+                               "2444444204"
+                               "3334000000"
+                               "0000000000"
+                               "0000000000"
+                               "4340000000"
+                               "4440000000"
+                               "2222222222";
+
+// Symbology identifiers of GS1 codes: GS1-128, DataBar, DataMatrix, QR,
+// DotCode
+static const char *const symbologies[] = {"C1", "e0", "d2", "Q3", "J1"};
+
+// Digital Link primary keys, the AIs whose segment starts the pairs
+static const char *const linkKeys[] = {"00",   "01",   "253",  "255",  "401",
+                                       "402",  "414",  "417",  "8003", "8004",
+                                       "8006", "8010", "8013", "8017", "8018"};
+
+// Whether the digits in ai are an assigned application identifier
+static bool isAi(const char *ai, int len) {
+  return len >= 2 && aiDigits[(ai[0] - '0') * 10 + ai[1] - '0'] - '0' == len;
+}
+
+// Data length of AIs with a predefined length, 0 for variable length
+static int aiFixed(const char *ai) {
+  int d = (ai[0] - '0') * 10 + ai[1] - '0';
+  if (d == 0)
+    return 18; // SSCC
+  if (d <= 3)
+    return 14; // GTIN
+  if (d == 4)
+    return 16;
+  if (d >= 11 && d <= 19)
+    return 6; // Dates
+  if (d == 20)
+    return 2;
+  if (d >= 31 && d <= 36)
+    return 6; // Measures
+  if (d == 41)
+    return 13; // Location numbers
+  return 0;
+}
+
+// Prepare for a new code
+void Gs1Parser::reset() {
+  n = 0;
+  state = G_START;
+  aiLen = 0;
+}
+
+// Stop parsing, the code is not a GS1 element string
+void Gs1Parser::invalid() {
+  n = 0;
+  state = G_NONE;
+}
+
+// The field value is complete: keep it if there is room and it fits
+void Gs1Parser::keepField() {
+  if (keep && valueLen <= GS1_VALUE) {
+    gs1_field_t *f = &field[n++];
+    strcpy(f->ai, ai);
+    f->value[valueLen] = 0;
+    f->len = valueLen;
+  }
+  aiLen = 0;
+}
+
+// End the field of an element string, the next AI follows
+void Gs1Parser::endField() {
+  keepField();
+  state = G_AI;
+}
+
+// The AI in ai[] starts a field; its value follows
+void Gs1Parser::beginField() {
+  ai[aiLen] = 0;
+  fixed = aiFixed(ai);
+  valueLen = 0;
+  keep = n < GS1_FIELDS;
+}
+
+// Add a byte to the value of the current field
+void Gs1Parser::putValue(uint8_t c) {
+  if (keep && valueLen < GS1_VALUE)
+    field[n].value[valueLen] = c;
+  valueLen++;
+}
+
+// End the field of a Digital Link. Values are never empty, short GTINs are
+// padded, and other predefined lengths must match.
+void Gs1Parser::endLinkField() {
+  bool gtin = fixed == 14;
+  if (keep && gtin && (valueLen == 8 || valueLen == 12 || valueLen == 13)) {
+    char *v = field[n].value;
+    memmove(v + 14 - valueLen, v, valueLen);
+    memset(v, '0', 14 - valueLen);
+    valueLen = 14;
+  }
+  if (valueLen == 0 || (fixed != 0 && valueLen != fixed)) {
+    invalid();
+    return;
+  }
+  keepField();
+}
+
+// A Digital Link path segment is complete. Segments before the primary
+// key belong to the resolver and are skipped; from the key on they must
+// be AI/value pairs.
+void Gs1Parser::endSegment() {
+  if (valueDue) {
+    valueDue = false;
+    endLinkField();
+  } else if (segAi && aiLen == 0) {
+    // Empty segment, e.g. "//" after the scheme or a trailing "/"
+  } else if (segAi && isAi(ai, aiLen)) {
+    ai[aiLen] = 0;
+    for (const char *key : linkKeys) {
+      if (strcmp(key, ai) == 0)
+        linked = true;
+    }
+    if (linked) {
+      beginField();
+      valueDue = true;
+    }
+  } else if (linked) {
+    invalid(); // Not an AI where one is due
+    return;
+  }
+  aiLen = 0;
+  segAi = true;
+}
+
+// Add a decoded byte to the segment or parameter being read
+void Gs1Parser::putLinkByte(uint8_t c) {
+  if (state == G_QVALUE || (state == G_PATH && valueDue)) {
+    putValue(c);
+  } else if (state == G_PATH || state == G_QUERY) {
+    if (segAi && isdigit(c) && aiLen < 4)
+      ai[aiLen++] = c;
+    else
+      segAi = false;
+  }
+}
+
+// Advance the Digital Link parser by one byte. Separators only count
+// as such when they are not %-escaped.
+void Gs1Parser::putLink(uint8_t c) {
+  if (esc > 0) {
+    if (!isxdigit(c)) {
+      invalid();
+      return;
+    }
+    escByte = escByte << 4 | (isdigit(c) ? c - '0' : (c | 0x20) - 'a' + 10);
+    if (--esc == 0)
+      putLinkByte(escByte);
+    return;
+  }
+  if (c == '%' && state != G_SCHEME && state != G_FRAG) {
+    esc = 2;
+    escByte = 0;
+    return;
+  }
+  switch (state) {
+  case G_SCHEME:
+    if (c == ':') {
+      aiLen = 0;
+      segAi = true;
+      state = G_PATH;
+    } else if (!isalpha(c)) {
+      invalid();
+    }
+    break;
+  case G_PATH:
+    if (c != '/' && c != '?' && c != '#') {
+      putLinkByte(c);
+      break;
+    }
+    endSegment();
+    if (state == G_NONE)
+      break;
+    if (c != '/' && (valueDue || !linked)) {
+      invalid(); // The path must hold a primary key with its value
+    } else if (c == '?') {
+      aiLen = 0;
+      segAi = true;
+      state = G_QUERY;
+    } else if (c == '#') {
+      state = G_FRAG;
+    }
+    break;
+  case G_QUERY:
+    if (c == '=' && segAi && isAi(ai, aiLen)) {
+      beginField();
+      state = G_QVALUE;
+    } else if (c == '=') {
+      state = G_QSKIP; // Not an AI, e.g. linkType
+    } else if (c == '&') {
+      aiLen = 0;
+      segAi = true;
+    } else if (c == '#') {
+      state = G_FRAG;
+    } else {
+      putLinkByte(c);
+    }
+    break;
+  case G_QVALUE:
+    if (c == '&' || c == '#') {
+      endLinkField();
+      if (state != G_NONE)
+        state = c == '&' ? G_QUERY : G_FRAG;
+      segAi = true;
+    } else {
+      putLinkByte(c);
+    }
+    break;
+  case G_QSKIP:
+    if (c == '&') {
+      aiLen = 0;
+      segAi = true;
+      state = G_QUERY;
+    } else if (c == '#') {
+      state = G_FRAG;
+    }
+    break;
+  default:
+    break; // Fragment
+  }
+}
+
+// Advance the parser by one byte
+void Gs1Parser::put(uint8_t c) {
+  if (state >= G_SCHEME) {
+    putLink(c);
+    return;
+  }
+  switch (state) {
+  case G_START:
+    if (c == ']') {
+      symbLen = 0;
+      state = G_SYMB;
+      break;
+    }
+    if (c == 'h' || c == 'H') {
+      linked = false;
+      valueDue = false;
+      esc = 0;
+      state = G_SCHEME; // http: or https:, a Digital Link
+      break;
+    }
+    state = G_AI;
+    put(c);
+    break;
+  case G_SYMB:
+    symb[symbLen++] = c;
+    if (symbLen < 2)
+      break;
+    symb[2] = 0;
+    state = G_NONE;
+    for (const char *id : symbologies) {
+      if (strcmp(id, symb) == 0)
+        state = G_AI;
+    }
+    break;
+  case G_AI:
+    if (c == GS && aiLen == 0)
+      break; // FNC1 before the first field or after a fixed length one
+    if (!isdigit(c)) {
+      invalid();
+      break;
+    }
+    ai[aiLen++] = c;
+    if (aiLen < 2)
+      break;
+    if (aiLen == 2)
+      aiNeed = aiDigits[(ai[0] - '0') * 10 + ai[1] - '0'] - '0';
+    if (aiNeed == 0) {
+      invalid();
+    } else if (aiLen == aiNeed) {
+      beginField();
+      state = G_VALUE;
+    }
+    break;
+  case G_VALUE:
+    if (fixed == 0 && c == GS) {
+      endField();
+      break;
+    }
+    putValue(c);
+    if (valueLen == fixed)
+      endField();
+    break;
+  default:
+    break;
+  }
+}
+
+// Feed the next chunk of a code, without the line terminator
+void Gs1Parser::feed(const uint8_t *data, size_t len) {
+  for (size_t i = 0; i < len && state != G_NONE; i++)
+    put(data[i]);
+}
+
+// The code is complete, false if it is not a GS1 element string or
+// Digital Link
+bool Gs1Parser::end() {
+  if (esc > 0 && state >= G_SCHEME)
+    invalid(); // Cut off inside a %-escape
+  if (state == G_PATH)
+    endSegment();
+  else if (state == G_QVALUE)
+    endLinkField();
+  if (state > G_NONE) {
+    if (!linked || valueDue)
+      invalid();
+    return n > 0;
+  }
+  if (state == G_VALUE && fixed == 0)
+    endField();
+  if (state != G_AI || aiLen != 0 || n == 0)
+    invalid();
+  return n > 0;
+}
+
+// Parse a whole code at once
+bool Gs1Parser::parse(const char *code, size_t len) {
+  reset();
+  feed((const uint8_t *)code, len);
+  return end();
+}
+
+// Field of an application identifier, nullptr if the code has none
+const gs1_field_t *Gs1Parser::find(const char *id) const {
+  for (int i = 0; i < n; i++) {
+    if (strcmp(field[i].ai, id) == 0)
+      return &field[i];
+  }
+  return nullptr;
+}
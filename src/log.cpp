@@ -3,44 +3,179 @@
  *
  * Copyright (c) 2023 Serhii Nesterenko
  * Licensed under the MIT License. See LICENSE file in the project root.
+ *
+ * Timestamps come from the monotonic esp_timer clock plus an offset to
+ * Unix time, so reading the time never waits for NTP. The offset is set
+ * by SNTP when it syncs, or pushed by the web interface or the upstream
+ * collector when there is no NTP server to reach, e.g. in standalone
+ * mode. Every timestamp can be tagged with where its offset came from.
+ *
+ * Diagnostics go through LOGE()..LOGD(): a call formats its message into
+ * a slot of a lock-free ring and returns, and a low-priority task drains
+ * the ring to the UART and to WebSocket clients tailing the log. The
+ * task sleeps until a writer notifies it. When the ring is full, messages
+ * are dropped and counted instead of making the caller wait.
  */
 
 #include "ptl.hpp"
+#include <esp_sntp.h>
+#include <esp_timer.h>
+#include <stdarg.h>
 #include <time.h>
 
-#define LOG_MAX 100 // Maximum log entries in circular buffer
+#define TIME_MIN 1577836800LL // Pushed times before 2020 are rejected
+#define LOG_SLOTS 32          // Messages waiting for the drain task
 
 // NTP time synchronization settings
 const char *ntpServer = "pool.ntp.org"; // NTP server address
 const long gmtOffset_sec = 2 * 60 * 60; // GMT+2 offset (seconds)
 const int daylightOffset_sec = 3600;    // Daylight saving time offset (1 hour)
 
-// Circular log buffer
-log_t *pLog = new log_t[LOG_MAX];
-int beg = 0, end = 0; // Buffer start and end indices
+// Message waiting in the ring
+typedef struct {
+  unsigned long ms;    // millis() when logged
+  uint8_t level;       // LEVEL_ERROR..LEVEL_DEBUG
+  volatile bool ready; // Written completely, owned by the drain task
+  char text[LOG_LINE];
+} log_line_t;
+
+log_line_t logRing[LOG_SLOTS];
+uint32_t logHead = 0;          // Slots claimed by writers, ever
+uint32_t logNext = 0;          // Slots drained, ever
+uint8_t logLevel = LEVEL_INFO; // Most verbose level logged at run time
+TaskHandle_t logDrain = nullptr; // Drain task handle, woken by writers
+
+// Clock offset, Unix time minus esp_timer time (us)
+int64_t timeOffset = 0;
+TimeQuality timeQuality = TIME_NONE;
+portMUX_TYPE timeMux = portMUX_INITIALIZER_UNLOCKED; // Guards both
+
+// Take a new offset from a Unix time in microseconds, unless the clock
+// was set from a better source. Checked and set in one critical section,
+// so a pushed time racing an NTP sync cannot overwrite it.
+static void setOffset(int64_t unixUs, TimeQuality quality) {
+  int64_t offset = unixUs - esp_timer_get_time();
+  portENTER_CRITICAL(&timeMux);
+  if (quality >= timeQuality) {
+    timeOffset = offset;
+    timeQuality = quality;
+  }
+  portEXIT_CRITICAL(&timeMux);
+}
 
-// Get current Unix timestamp from ESP32 RTC
+// SNTP callback, on every sync
+static void onTimeSync(struct timeval *tv) {
+  setOffset(tv->tv_sec * 1000000LL + tv->tv_usec, TIME_NTP);
+}
+
+// Current Unix timestamp, 0 while the clock was never set. Never blocks.
 unsigned long getTime() {
-  time_t now;
-  struct tm timeinfo;
-  if (!getLocalTime(&timeinfo)) {
-    Serial.println("Failed to obtain time");
-    return (0);
+  portENTER_CRITICAL(&timeMux);
+  int64_t offset = timeOffset;
+  TimeQuality quality = timeQuality;
+  portEXIT_CRITICAL(&timeMux);
+  if (quality == TIME_NONE)
+    return 0;
+  return (esp_timer_get_time() + offset) / 1000000;
+}
+
+// Source of the current time: "none", "push" or "ntp"
+const char *timeSource() {
+  static const char *names[] = {"none", "push", "ntp"};
+  return names[timeQuality];
+}
+
+// Set the clock from a time pushed by a client or the collector. Ignored
+// once NTP synced, false if the time is implausible.
+bool pushTime(unsigned long t) {
+  if (t < TIME_MIN)
+    return false;
+  setOffset((int64_t)t * 1000000, TIME_PUSHED);
+  return true;
+}
+
+// Current time, its source and the uptime for the API
+void timeJson(JsonObject json) {
+  json["t"] = getTime();
+  json["tq"] = timeSource();
+  json["uptime"] = esp_timer_get_time() / 1000000;
+}
+
+// Wake the drain task, if it runs yet
+static inline void wakeDrain() {
+  if (logDrain != nullptr)
+    xTaskNotifyGive(logDrain);
+}
+
+// Format a message into the next free slot. Writers claim slots with a
+// compare-and-swap on logHead, so any task may log without taking a lock;
+// a full ring drops the message.
+void logWrite(uint8_t level, const char *fmt, ...) {
+  uint32_t head = __atomic_load_n(&logHead, __ATOMIC_RELAXED);
+  do {
+    if (head - __atomic_load_n(&logNext, __ATOMIC_ACQUIRE) >= LOG_SLOTS) {
+      metrics.logDropped++;
+      wakeDrain(); // To report the drop
+      return;
+    }
+  } while (!__atomic_compare_exchange_n(&logHead, &head, head + 1, true,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+  log_line_t *line = &logRing[head % LOG_SLOTS];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(line->text, LOG_LINE, fmt, args);
+  va_end(args);
+  line->ms = millis();
+  line->level = level;
+  __atomic_store_n(&line->ready, true, __ATOMIC_RELEASE);
+  wakeDrain();
+}
+
+// Level by its name, -1 if the name is unknown
+int levelOf(const char *name) {
+  static const char *const names[] = {"error", "warn", "info", "debug"};
+  for (int i = 0; i < 4; i++) {
+    if (strcmp(name, names[i]) == 0)
+      return i;
   }
-  time(&now);
-  return now;
+  return -1;
 }
 
-// Add entry to circular log buffer
-bool putToLog(string pin, string code) {
-  pLog[end].pin = pin;
-  pLog[end].code = code;
-  pLog[end].t = getTime();
-  if (++end > LOG_MAX) {
-    end = 0; // Wrap around to start
+// Drain task: write messages to the UART in order, at low priority so a
+// slow UART only ever delays this task. Sleeps while the ring is empty; a
+// notification given meanwhile is kept, so no message is left waiting.
+void LogCode(void *params) {
+  char out[LOG_LINE + 24];
+  uint32_t dropped = 0; // Drops already reported
+  logDrain = xTaskGetCurrentTaskHandle();
+  for (;;) {
+    if (metrics.logDropped != dropped) {
+      Serial.printf("%u log messages dropped\n",
+                    (unsigned)(metrics.logDropped - dropped));
+      dropped = metrics.logDropped;
+    }
+    log_line_t *line = &logRing[logNext % LOG_SLOTS];
+    if (!__atomic_load_n(&line->ready, __ATOMIC_ACQUIRE)) {
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      continue;
+    }
+    int len = snprintf(out, sizeof(out), "[%lu.%03lu] %c %s\n",
+                       line->ms / 1000, line->ms % 1000,
+                       "EWID"[line->level], line->text);
+    wsLog(line->ms, line->level, line->text);
+    __atomic_store_n(&line->ready, false, __ATOMIC_RELAXED);
+    __atomic_store_n(&logNext, logNext + 1, __ATOMIC_RELEASE);
+    Serial.write((const uint8_t *)out, min(len, (int)sizeof(out) - 1));
   }
-  return true;
 }
 
-// Initialize NTP time synchronization
-void initLog() { configTime(gmtOffset_sec, daylightOffset_sec, ntpServer); }
+// Start the drain task, messages logged before are kept in the ring
+void initLogging() {
+  startTask(TASK_LOG, &LogCode);
+}
+
+// Initialize NTP time synchronization, runs in the background
+void initLog() {
+  sntp_set_time_sync_notification_cb(onTimeSync);
+  configTime(gmtOffset_sec, daylightOffset_sec, ntpServer);
+}
@@ -5,12 +5,12 @@
  * Licensed under the MIT License. See LICENSE file in the project root.
  */
 
-#include "SPIFFS.h"
 #include "ptl.hpp"
 #include <Adafruit_NeoPixel.h>
-#include <AsyncJson.h>
 #include <ESPAsyncWebServer.h>
 #include <ESPmDNS.h>
+#include <LittleFS.h>
+#include <SPIFFS.h>
 
 // Timing and status globals
 unsigned long timerDelay = 10000;          // Status update interval (ms)
@@ -32,49 +32,72 @@ Adafruit_NeoPixel strip =
 char lineBuf[80];
 int charCount = 0;
 
-bool fileWritten = false; // Config file write success flag
-
-// Initialize SPIFFS
-void initSPIFFS() {
-  if (!SPIFFS.begin()) {
-    Serial.println("An error has occurred while mounting SPIFFS");
-  }
-  Serial.println("SPIFFS mounted successfully");
+// Read a small file of the SPIFFS image left by older firmware
+static String readSpiffs(const char *path) {
+  File file = SPIFFS.open(path, FILE_READ);
+  if (!file)
+    return String();
+  String text = file.size() <= CONFIG_MAX ? file.readString() : String();
+  file.close();
+  return text;
 }
 
-// Initialize WiFi - either as station or access point
-void initWiFi() {
-  IPAddress IP;
-  if (cfg["standalone"] == false) {
-    // Station mode - connect to existing WiFi
-    WiFi.mode(WIFI_STA);
-    WiFi.begin((const char *)cfg["ssid"], (const char *)cfg["wifipass"]);
-    Serial.printf("Connecting to WiFi (%s)\n", (const char *)cfg["ssid"]);
-    while (WiFi.status() != WL_CONNECTED) {
-      Serial.print('.');
-      delay(1000);
-    }
-    IP = WiFi.localIP();
-  } else {
-    // Access Point mode - create own network
-    WiFi.mode(WIFI_AP);
-    Serial.printf("Setting AP (%s)…\n", (const char *)cfg["ssid"]);
-    WiFi.softAP((const char *)cfg["ssid"], (const char *)cfg["wifipass"]);
-    IP = WiFi.softAPIP();
+// Initialize LittleFS. A partition that does not mount is formatted; if it
+// still holds the SPIFFS image of older firmware, config.json (or the
+// backup that firmware kept while replacing it) is carried over first.
+void initFS() {
+  if (LittleFS.begin(false)) {
+    LOGI("LittleFS mounted successfully");
+    return;
+  }
+  String config;
+  if (SPIFFS.begin(false)) {
+    config = readSpiffs("/config.json");
+    if (config.length() == 0)
+      config = readSpiffs("/config.bak");
+    SPIFFS.end();
+  }
+  if (!LittleFS.begin(true)) {
+    LOGE("An error has occurred while mounting LittleFS");
+    return;
   }
-  Serial.println(IP);
+  LOGW("LittleFS formatted, upload the filesystem image and table again");
+  if (config.length() == 0)
+    return;
+  File file = LittleFS.open("/config.json", FILE_WRITE);
+  if (file && file.print(config) == config.length())
+    LOGI("Config migrated from SPIFFS");
+  else
+    LOGE("ERROR: unable to migrate config from SPIFFS");
+  file.close();
 }
 
 // FreeRTOS task handles
 TaskHandle_t Task1, Task2;
 
-// JSON document buffers
+// JSON document buffers, allocated once at boot so that events and
+// requests do not fragment the heap over long uptimes
 char buf[1024];                                      // Serialization buffer
-DynamicJsonDocument cfg = DynamicJsonDocument(1024); // Configuration
-DynamicJsonDocument tbl =
-    DynamicJsonDocument(4096); // Access table (code->pin mapping)
 DynamicJsonDocument doc =
-    DynamicJsonDocument(1024); // Temporary document for responses
+    DynamicJsonDocument(1024); // Events, from loop()
+DynamicJsonDocument reply =
+    DynamicJsonDocument(REPLY_DOC); // HTTP responses, from async_tcp
+
+// JSON request bodies are collected in requestBody, one request at a time:
+// the request that sent the first chunk owns it until it is parsed. They
+// are parsed in place into the response document, as handlers are done
+// with the request before they fill in the reply.
+char requestBody[REQUEST_MAX];
+DynamicJsonDocument &requestDoc = reply;
+void *bodyOwner = nullptr; // Request collecting into requestBody, if any
+size_t bodyLen = 0;        // Bytes collected so far
+
+// Send an event to all web clients (SSE and WebSocket)
+void sendEvent(const char *data, const char *event) {
+  metrics.sseSends++;
+  events.send(data, event, millis());
+  wsEvent(data, event);
+}
 
 // Send status update via Server-Sent Events
 void sendStatus() {
@@ -82,48 +105,38 @@ void sendStatus() {
   json["status"] = status;
   json["r"] = lastRead;
   json["w"] = lastWrite;
+  json["tq"] = timeSource(); // The UI pushes its clock while this is "none"
   JsonArray array = json.createNestedArray("devices");
-  for (int i = 0; i < nDevices; i++) {
+  device_t list[MAX_DEVICES]; // Copies, the registry changes while scanning
+  int n = listDevices(list, MAX_DEVICES);
+  unsigned long now = millis();
+  for (int i = 0; i < n; i++) {
     const JsonObject &d = array.createNestedObject();
-    d["address"] = devices[i].address;
-    d["service"] = devices[i].service;
+    d["address"] = (const char *)list[i].address;
+    d["service"] = (const char *)list[i].service;
+    d["rssi"] = list[i].rssi;
+    d["age"] = (now - list[i].seen) / 1000;
   }
   serializeJson(doc, buf);
-  events.send(buf, "status", millis());
+  sendEvent(buf, "status");
 }
 
-// Load configuration from SPIFFS
-void readConfig() {
-  File file = SPIFFS.open("/config.json", FILE_READ);
-  if (!file) {
-    Serial.println("ERROR: There was an error opening config file");
-    return;
-  }
-  Serial.println("Config opened!");
-  DeserializationError error = deserializeJson(cfg, file);
-  file.close();
-  if (error) {
-    Serial.println("ERROR: deserialize");
-    return;
-  }
-  lastWrite = getTime();
+unsigned long restartAt = 0; // Time of a requested reboot, 0 = none
+
+// Reboot from the main loop once pending responses went out
+void requestRestart() {
+  LOGW("REBOOT ISSUED!");
+  restartAt = millis() + 500;
 }
 
-// Load access control table from SPIFFS (maps codes to pin names)
-void readTable() {
-  File file = SPIFFS.open("/table.json", FILE_READ);
-  if (!file) {
-    Serial.println("ERROR: There was an error opening table file");
-    return;
-  }
-  Serial.println("Table opened!");
-  DeserializationError error = deserializeJson(tbl, file);
-  file.close();
-  if (error) {
-    Serial.println("ERROR: deserialize");
-    return;
-  }
-  lastRead = getTime();
+// Select BLE scanner device: {"address", "service", "charact"}
+void setDevice(JsonObject json) {
+  const char *addr = json["address"] | "";
+  const char *service = json["service"] | "";
+  const char *charact = json["charact"] | "";
+  selectScanner(addr, service, charact);
+  LOGI("Want device: %s/%s/%s", addr, service, charact);
+  disconnectFromScanner();
 }
 
 // 404 handler
@@ -131,48 +144,100 @@ void notFound(AsyncWebServerRequest *request) {
   request->send(404, "text/plain", "Not found");
 }
 
-// Handle config file upload body
-void handleWriteConfigBody(AsyncWebServerRequest *request, uint8_t *data,
-                           size_t len, size_t index, size_t total) {
-  if (data == nullptr || len != total) {
-    return;
+// Collect a JSON request body chunk by chunk. A body that is too large or
+// arrives while another request owns the buffer is not kept, the request
+// is answered by parseJsonBody().
+void handleJsonBody(AsyncWebServerRequest *request, uint8_t *data,
+                    size_t len, size_t index, size_t total) {
+  if (index == 0) {
+    if (bodyOwner != nullptr || total > REQUEST_MAX)
+      return;
+    bodyOwner = request;
+    bodyLen = 0;
+    request->onDisconnect([request]() {
+      if (bodyOwner == request)
+        bodyOwner = nullptr;
+    });
   }
-
-  File file = SPIFFS.open("/config.json", FILE_WRITE);
-  if (!file) {
-    Serial.println("There was an error opening the file for writing");
+  if (bodyOwner != request || index != bodyLen || index + len > REQUEST_MAX)
     return;
+  memcpy(&requestBody[index], data, len);
+  bodyLen += len;
+}
+
+// Parse the collected body of a request into requestDoc, in place. The
+// buffer is free again afterwards; the document stays valid until the
+// handler returns. Sends the error answer and returns false if the body
+// is missing, too large, still owned by another request or not JSON.
+bool parseJsonBody(AsyncWebServerRequest *request) {
+  size_t len = request->contentLength();
+  if (len > REQUEST_MAX) {
+    request->send(413, "application/json", "{\"msg\":\"body too large\"}");
+    return false;
   }
-  if (file.write(data, len) != 0) {
-    fileWritten = true;
+  if (len > 0 && bodyOwner != request) {
+    request->send(503, "application/json",
+                  "{\"msg\":\"another request is in progress\"}");
+    return false;
   }
-  file.close();
+  if (len > 0)
+    bodyOwner = nullptr;
+  if (len == 0 || bodyLen != len ||
+      deserializeJson(requestDoc, requestBody, len)) {
+    request->send(400, "application/json", "{\"msg\":\"bad json\"}");
+    return false;
+  }
+  return true;
+}
 
-  Serial.println("WRITTEN CONFIG:");
-  Serial.write(data, len);
-  Serial.println();
+// Handle config upload body - chunks are staged in a temp file owned by
+// the request
+void handleWriteConfigBody(AsyncWebServerRequest *request, uint8_t *data,
+                           size_t len, size_t index, size_t total) {
+  if (total > CONFIG_MAX)
+    return; // Answered with 413 once the body is in
+  if (index == 0) {
+    if (!beginConfigUpload(request))
+      return; // Another upload is staging
+    request->onDisconnect([request]() { abortConfigUpload(request); });
+  }
+  if (stageConfig(request, data, len, index, total) && index + len == total)
+    LOGI("Config staged (%u bytes)", (unsigned)total);
 }
 
-// Handle config write completion - optionally reboot
+// Handle config write completion - validate, install, optionally reboot
 void handleWriteConfig(AsyncWebServerRequest *request) {
   bool reboot = false;
   AsyncWebParameter *rebootParam = request->getParam("reboot");
 
-  if (rebootParam != nullptr && rebootParam->value() == "true") {
+  if (rebootParam != nullptr && rebootParam->value() == "true")
     reboot = true;
-    Serial.println("REBOOT ISSUED!");
-  }
 
-  if (fileWritten) {
-    request->send(200, "application/json", "{}");
-  } else {
-    request->send(500, "application/json", "{msg:'unable to write file'}");
+  if (request->contentLength() > CONFIG_MAX) {
+    request->send(413, "application/json", "{\"msg\":\"body too large\"}");
+    return;
   }
-
+  if (configBusy(request)) {
+    request->send(409, "application/json",
+                  "{\"msg\":\"another upload is in progress\"}");
+    return;
+  }
+  if (!configStaged(request)) {
+    abortConfigUpload(request);
+    request->send(500, "application/json",
+                  "{\"msg\":\"unable to write file\"}");
+    return;
+  }
+  const char *msg = commitConfig(request);
+  if (msg != nullptr) {
+    char res[128];
+    snprintf(res, sizeof(res), "{\"msg\":\"%s\"}", msg);
+    request->send(400, "application/json", res);
+    return;
+  }
+  request->send(200, "application/json", "{}");
   if (reboot)
-    ESP.restart();
-  else
-    readConfig();
+    requestRestart(); // Otherwise loop() applies it live
 }
 
 uint8_t *b; // Index page buffer (unused)
@@ -183,165 +248,395 @@ void getIndex(AsyncWebServerRequest *request) {
   request->send(response);
 }
 
-// Look up pin name for a given scan code in access table
-JsonString findInTable(JsonString x) {
-  for (JsonPair kv : tbl.as<JsonObject>()) {
-    for (JsonVariant value : kv.value().as<JsonArray>()) {
-      if (value.as<JsonString>() == x)
-        return kv.key(); // Return pin name
-    }
+// Find pin number for a location name, -1 if it is not configured
+int findLocation(JsonString pinName) {
+  if (pinName.isNull() || pinName.size() == 0 || pinName.size() >= PIN_NAME)
+    return -1;
+  const config_t *c = holdConfig();
+  int pin = -1;
+  for (int i = 0; i < NUM_PINS && pin < 0; i++) {
+    if (c->pins[i][pinName.size()] == 0 &&
+        memcmp(c->pins[i], pinName.c_str(), pinName.size()) == 0)
+      pin = i;
   }
-  return JsonString(""); // Not found
+  releaseConfig(c);
+  return pin;
 }
 
 // Find pin number for a given pin name
 int findPin(JsonString pinName) {
-  int i = 0;
-  for (JsonVariant value : cfg["pins"].as<JsonArray>()) {
-    if (value.as<JsonString>() == pinName)
-      return i;
-    i++;
+  int pin = findLocation(pinName);
+  return pin < 0 ? 48 : pin; // Default to "all pins"
+}
+
+// Batch blink request state, lives in request->_tempObject
+typedef struct {
+  JsonSplitter splitter;     // Splits the body into entries
+  channel_t frame[NUM_PINS]; // Frame being assembled
+  unsigned long now;         // Common start time of all entries
+  int applied;               // Entries applied to the frame
+  int errors;                // Entries rejected
+} batch_t;
+
+// Apply one batch entry to a frame: a pin number or
+// {"pin" or "loc", "period", "fill", "duration", "level"}
+bool applyEntry(JsonVariant entry, channel_t *frame, unsigned long now) {
+  int pin = -1;
+  if (entry.is<int>())
+    pin = entry.as<int>();
+  else if (entry["loc"].is<const char *>())
+    pin = findLocation(entry["loc"].as<JsonString>());
+  else
+    pin = entry["pin"] | -1;
+  if (pin < 0 || pin > NUM_PINS)
+    return false;
+  unsigned long duration = entry["duration"] | blinkDuration;
+  if (duration == 0)
+    duration = BLINK_FOREVER;
+  int period = entry["period"] | blinkPeriod;
+  int fill = entry["fill"] | blinkFill;
+  int level = entry["level"] | conf->brightness;
+  if (level < 1 || level > BAM_FULL)
+    return false;
+  for (int i = 0; i < NUM_PINS; i++) {
+    if (i == pin || pin == NUM_PINS) {
+      setChannel(&frame[i], now, duration, period, fill);
+      frame[i].level = level;
+    }
   }
-  return 48; // Default to "all pins"
+  return true;
+}
+
+// Parse one streamed batch entry into the request's frame
+void applyBatchEntry(void *ctx, const char *element, size_t len) {
+  batch_t *batch = (batch_t *)ctx;
+  StaticJsonDocument<2 * SPLIT_MAX> entry; // Reused, no per-entry heap
+  if (deserializeJson(entry, element, len) ||
+      !applyEntry(entry.as<JsonVariant>(), batch->frame, batch->now))
+    batch->errors++;
+  else
+    batch->applied++;
+}
+
+// Handle batch blink body - entries are parsed as the chunks arrive
+void handleBlinkBatchBody(AsyncWebServerRequest *request, uint8_t *data,
+                          size_t len, size_t index, size_t total) {
+  if (index == 0) {
+    batch_t *batch = (batch_t *)malloc(sizeof(batch_t));
+    if (batch == nullptr)
+      return;
+    memset(batch, 0, sizeof(batch_t));
+    batch->splitter.reset();
+    batch->now = millis();
+    request->_tempObject = batch; // Freed with the request
+  }
+  batch_t *batch = (batch_t *)request->_tempObject;
+  if (batch != nullptr)
+    batch->splitter.feed(data, len, applyBatchEntry, batch);
+}
+
+// Handle batch blink completion - show the whole frame at once
+void handleBlinkBatch(AsyncWebServerRequest *request) {
+  batch_t *batch = (batch_t *)request->_tempObject;
+  if (batch == nullptr) {
+    request->send(400, "application/json", "{\"msg\":\"empty batch\"}");
+    return;
+  }
+  blinkFrame(batch->frame);
+  char res[64];
+  snprintf(res, sizeof(res), "{\"applied\":%d,\"errors\":%d}",
+           batch->applied, batch->errors + batch->splitter.dropped);
+  request->send(200, "application/json", res);
+}
+
+// Handle table upload body - each chunk is parsed into the flash index as
+// it arrives, the request itself owns the upload
+void handleTableBody(AsyncWebServerRequest *request, uint8_t *data,
+                     size_t len, size_t index, size_t total) {
+  if (index == 0) {
+    if (!beginTableUpload(request))
+      return;
+    request->onDisconnect([request]() { abortTableUpload(request); });
+  }
+  feedTableUpload(request, data, len);
+}
+
+// Handle table upload completion - the index is swapped in by loop()
+void handleTable(AsyncWebServerRequest *request) {
+  uint32_t codes = 0;
+  int locs = 0;
+  const char *msg = endTableUpload(request, &codes, &locs);
+  char res[128];
+  if (msg != nullptr) {
+    snprintf(res, sizeof(res), "{\"msg\":\"%s\"}", msg);
+    request->send(400, "application/json", res);
+    return;
+  }
+  snprintf(res, sizeof(res), "{\"codes\":%u,\"locations\":%d}",
+           (unsigned)codes, locs);
+  request->send(202, "application/json", res);
 }
 
 // STM32 setup function - initialize system
 void setup() {
   Serial.begin(115200);
 
-  // Initialize file system and load configuration
-  initSPIFFS();
+  // Initialize file system and load configuration. Messages wait in the
+  // log ring until the drain task starts with its configured placement.
+  initFS();
   readConfig();
+  logLevel = conf->logLevel;
+  initLogging();
+  initSession();
 
-  // Create FreeRTOS tasks on separate cores
-  xTaskCreatePinnedToCore(&BLECode, "BT", 5000, NULL, 15, &Task1,
-                          0); // BLE task on core 0
-  xTaskCreatePinnedToCore(&BlinkCode, "Blink", 5000, NULL, 10, &Task2,
-                          0); // Blink task on core 0
+  // Create FreeRTOS tasks where config.json places them
+  Task1 = startTask(TASK_BT, &BLECode);
+  Task2 = startTask(TASK_BLINK, &BlinkCode);
 
   // Initialize peripherals
-  initWiFi();
+  initWiFi(); // Connects in the background
   strip.begin(); // Initialize NeoPixel strip
   initLog();     // Initialize NTP time sync
 
-  readTable(); // Load access control table
+  readTable();   // Open the lookup index, build it if needed
+  initForward(); // Push scans upstream if a collector is configured
 
-  /*File file = SPIFFS.open("/index.html", FILE_READ);
+  /*File file = LittleFS.open("/index.html", FILE_READ);
   b_len = file.available();
   b = new uint8_t[b_len];
   file.read((byte *)b, b_len);
   file.close();*/
 
-  server.serveStatic("/", SPIFFS, "/").setDefaultFile("index.html");
+  initAssets(server); // Packed assets first, plain files as fallback
+  server.serveStatic("/", LittleFS, "/").setDefaultFile("index.html");
 
   // Web Server Root URL
   // server.on("/", HTTP_GET, &getIndex);
   /*
       // CONFIG
       server.on("/config.json", HTTP_GET, [](AsyncWebServerRequest *request){
-        request->send(SPIFFS, "/config.json", "application/json");
+        request->send(LittleFS, "/config.json", "application/json");
       });
       */
 
   server.on("/api/wifiInfo", HTTP_GET, [](AsyncWebServerRequest *request) {
-    Serial.printf("Running server on core %d\n", xPortGetCoreID());
+    LOGD("Running server on core %d", xPortGetCoreID());
     AsyncResponseStream *response =
         request->beginResponseStream("application/json");
-    DynamicJsonDocument json(1024);
+    JsonObject json = reply.to<JsonObject>();
     json["status"] = "ok";
     json["ssid"] = WiFi.SSID();
     json["gw"] = WiFi.gatewayIP().toString();
     json["dns"] = WiFi.dnsIP().toString();
     json["cidr"] = WiFi.localIP().toString() + "/" + WiFi.subnetCIDR();
-    serializeJson(json, *response);
+    serializeJson(reply, *response);
+    request->send(response);
+  });
+
+  server.on("/api/metrics", HTTP_GET, [](AsyncWebServerRequest *request) {
+    AsyncResponseStream *response =
+        request->beginResponseStream("application/json");
+    metricsJson(reply.to<JsonObject>());
+    serializeJson(reply, *response);
     request->send(response);
   });
 
+  server.on("/api/time", HTTP_GET, [](AsyncWebServerRequest *request) {
+    AsyncResponseStream *response =
+        request->beginResponseStream("application/json");
+    timeJson(reply.to<JsonObject>());
+    serializeJson(reply, *response);
+    request->send(response);
+  });
+
+  server.on(
+      "/api/time", HTTP_POST,
+      [](AsyncWebServerRequest *request) {
+        if (!parseJsonBody(request))
+          return;
+        if (!pushTime(requestDoc["t"] | 0UL)) {
+          request->send(400, "application/json", "{\"msg\":\"bad time\"}");
+          return;
+        }
+        AsyncResponseStream *response =
+            request->beginResponseStream("application/json");
+        timeJson(reply.to<JsonObject>());
+        serializeJson(reply, *response);
+        request->send(response);
+      },
+      NULL, handleJsonBody);
+
   server.on("/api/writeConfig", HTTP_POST, handleWriteConfig, NULL,
             handleWriteConfigBody);
 
-  server.addHandler(new AsyncCallbackJsonWebHandler(
-      "/api/blink", [](AsyncWebServerRequest *request, JsonVariant &json) {
-        const JsonObject &jsonObj = json.as<JsonObject>();
-        int pin = jsonObj["pin"];
-        Serial.printf("Command to blink: %d \n", pin);
+  server.on("/api/table", HTTP_POST, handleTable, NULL, handleTableBody);
+
+  server.on("/api/table", HTTP_GET, [](AsyncWebServerRequest *request) {
+    AsyncResponseStream *response =
+        request->beginResponseStream("application/json");
+    tableJson(reply.to<JsonObject>());
+    serializeJson(reply, *response);
+    request->send(response);
+  });
+
+  server.on(
+      "/api/blink", HTTP_POST,
+      [](AsyncWebServerRequest *request) {
+        if (!parseJsonBody(request))
+          return;
+        int pin = requestDoc["pin"];
+        LOGD("Command to blink: %d", pin);
         blinkPin(pin);
         request->send(200);
-      }));
+      },
+      NULL, handleJsonBody);
+
+  server.on("/api/selftest", HTTP_POST, [](AsyncWebServerRequest *request) {
+    if (!startSelfTest()) {
+      request->send(409, "application/json", "{\"msg\":\"test running\"}");
+      return;
+    }
+    request->send(202, "application/json", "{\"state\":\"pending\"}");
+  });
+
+  server.on("/api/selftest", HTTP_GET, [](AsyncWebServerRequest *request) {
+    AsyncResponseStream *response =
+        request->beginResponseStream("application/json");
+    selfTestJson(reply.to<JsonObject>());
+    serializeJson(reply, *response);
+    request->send(response);
+  });
+
+  server.on("/api/blinkBatch", HTTP_POST, handleBlinkBatch, NULL,
+            handleBlinkBatchBody);
+
+  server.on(
+      "/api/session", HTTP_POST,
+      [](AsyncWebServerRequest *request) {
+        if (!parseJsonBody(request))
+          return;
+        if (!startSession(requestDoc.as<JsonObject>())) {
+          request->send(400, "application/json", "{\"msg\":\"bad order\"}");
+          return;
+        }
+        AsyncResponseStream *response =
+            request->beginResponseStream("application/json");
+        sessionProgress(reply.to<JsonObject>());
+        serializeJson(reply, *response);
+        request->send(response);
+      },
+      NULL, handleJsonBody);
+
+  server.on("/api/session", HTTP_GET, [](AsyncWebServerRequest *request) {
+    AsyncResponseStream *response =
+        request->beginResponseStream("application/json");
+    sessionState(reply.to<JsonObject>());
+    serializeJson(reply, *response);
+    request->send(response);
+  });
+
+  server.on("/api/session", HTTP_DELETE, [](AsyncWebServerRequest *request) {
+    stopSession();
+    request->send(200);
+  });
 
-  server.addHandler(new AsyncCallbackJsonWebHandler(
-      "/api/setLed", [](AsyncWebServerRequest *request, JsonVariant &json) {
-        const JsonObject &jsonObj = json.as<JsonObject>();
+  server.on(
+      "/api/setLed", HTTP_POST,
+      [](AsyncWebServerRequest *request) {
+        if (!parseJsonBody(request))
+          return;
+        const char *code = requestDoc["code"];
+        const char *helo = requestDoc["helo"]; // Kept by reply.to<>()
         AsyncResponseStream *response =
             request->beginResponseStream("application/json");
-        DynamicJsonDocument root(1024);
-        Serial.print("Reading: ");
-        const char *code = jsonObj["code"];
-        Serial.println(code);
+        JsonObject root = reply.to<JsonObject>();
+        LOGD("Reading: %s", code != nullptr ? code : "");
         if (code != nullptr) {
           codeTarget = strtol(code, NULL, 0);
-          Serial.print("Code: ");
-          Serial.println(codeTarget);
+          LOGD("Code: %d", codeTarget);
         }
-        root["test"] = jsonObj["helo"]; // ESP.getFreeHeap();
+        root["test"] = helo; // ESP.getFreeHeap();
         root["ssid"] = WiFi.SSID();
-        serializeJson(root, *response);
+        serializeJson(reply, *response);
         request->send(response);
-      }));
-
-  server.addHandler(new AsyncCallbackJsonWebHandler(
-      "/api/setDevice", [](AsyncWebServerRequest *request, JsonVariant &json) {
-        const JsonObject &jsonObj = json.as<JsonObject>();
-        Serial.print("Want device: ");
-        cfg["addr"] = jsonObj["address"] != nullptr
-                          ? string((const char *)jsonObj["address"])
-                          : "";
-        cfg["service"] = jsonObj["service"] != nullptr
-                             ? string((const char *)jsonObj["service"])
-                             : "";
-        cfg["charact"] = jsonObj["charact"] != nullptr
-                             ? string((const char *)jsonObj["charact"])
-                             : "";
-        Serial.printf("%s/%s/%s\n", (const char *)cfg["addr"],
-                      (const char *)cfg["service"],
-                      (const char *)cfg["charact"]);
-        disconnectFromScanner();
+      },
+      NULL, handleJsonBody);
+
+  server.on(
+      "/api/setDevice", HTTP_POST,
+      [](AsyncWebServerRequest *request) {
+        if (!parseJsonBody(request))
+          return;
+        setDevice(requestDoc.as<JsonObject>());
         request->send(200);
-      }));
+      },
+      NULL, handleJsonBody);
 
   events.onConnect([](AsyncEventSourceClient *client) {
     if (client->lastId()) {
-      Serial.printf("Client reconnected! Last message ID that it gat is: %u\n",
-                    client->lastId());
+      LOGD("Client reconnected! Last message ID that it gat is: %u",
+           (unsigned)client->lastId());
     }
     // send event with message "hello!", id current millis and set reconnect
     // delay to 1 second
     client->send("hello!", "open", millis(), 1000);
   });
   server.addHandler(&events);
+  initWs(server); // Bidirectional channel for the UI and integrations
 
   server.onNotFound(notFound);
 
   // initBlink();
   //  Start server
   server.begin();
-  Serial.printf("Running main on core %d\n", xPortGetCoreID());
+  LOGD("Running main on core %d", xPortGetCoreID());
 }
 
 unsigned long lastTime = 0; // Last status update time
 
 // Process received scan from BLE device - look up pin and trigger blink
-void processScan(const char *scan) {
-  JsonString pinName = findInTable(scan); // Look up pin name for this code
-  blinkPin(findPin(JsonString(pinName))); // Trigger LED blink
-  Serial.printf("R: %s = %s\n", scan, pinName);
+void processScan(const scan_t *s) {
+  const char *scan = s->code;
+  metrics.scans++;
+  char loc[PIN_NAME];
+  JsonString pinName = findInTable(scan, loc, &s->gs1); // Pin of the code
+  int line = sessionScan(scan); // Session scans only turn their light off
+  if (line == SESSION_NONE)
+    blinkPin(findPin(JsonString(pinName)), PRIO_PICK); // Ahead of effects
+  LOGI("R: %s = %s", scan, pinName.isNull() ? "" : pinName.c_str());
   // Send scan event to web clients
   JsonObject json = doc.to<JsonObject>();
   json["code"] = scan;
   json["pin"] = pinName;
   json["t"] = getTime();
+  json["tq"] = timeSource();
+  if (line != SESSION_NONE) {
+    JsonObject session = json.createNestedObject("session");
+    sessionProgress(session);
+    session["line"] = line;
+  }
   serializeJson(doc, buf);
-  events.send(buf, "scan", millis());
+  sendEvent(buf, "scan");
+  forwardScan(buf);
+}
+
+// Forward confirmation input events to web clients
+void processInputs() {
+  input_t event;
+  while (nextInput(&event)) {
+    LOGI("I: line %d pin %d %s", event.line, event.pin,
+         event.active ? "on" : "off");
+    JsonObject json = doc.to<JsonObject>();
+    json["line"] = event.line;
+    json["pin"] = event.pin;
+    json["active"] = event.active;
+    json["t"] = getTime();
+    json["tq"] = timeSource();
+    if (event.session)
+      sessionProgress(json.createNestedObject("session"));
+    serializeJson(doc, buf);
+    sendEvent(buf, "input");
+  }
 }
 
 // STM32 main loop
@@ -358,19 +653,24 @@ void loop() {
 
   // Periodic status updates
   if ((millis() - lastTime) > timerDelay) {
-    Serial.printf("HEAP: %d\n", ESP.getFreeHeap());
+    LOGD("HEAP: %u", ESP.getFreeHeap());
+    sampleHeap();
+    sampleCpu();
+    sampleBus();
     sendStatus();
     lastTime = millis();
   }
-  // Process completed scans
-  if (scanMode == SCAN_FINISHED) {
-    scanMode = SCAN_NONE;
-    processScan(scan);
-  }
-  // Handle WiFi reconnection
-  if (WiFi.status() != WL_CONNECTED) {
-    WiFi.disconnect();
-    WiFi.reconnect();
+  // Process completed scans, the record goes back to the BLE callback
+  for (scan_t *s = nextScan(); s != nullptr; s = nextScan()) {
+    processScan(s);
+    releaseScan(s);
   }
+  processInputs();
+  checkConfig(); // Apply a newly written config live
+  checkTable();  // Swap in a newly uploaded table
+  wsCleanup();
+  if (restartAt != 0 && (long)(millis() - restartAt) >= 0)
+    ESP.restart();
+  checkWiFi(); // Reconnect with backoff, never tears down AP mode
   vTaskDelay(1000);
 }
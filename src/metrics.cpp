@@ -0,0 +1,99 @@
+/*
+ * PutToLight - Runtime Metrics Module
+ *
+ * Copyright (c) 2023 Serhii Nesterenko
+ * Licensed under the MIT License. See LICENSE file in the project root.
+ */
+
+#include "ptl.hpp"
+
+metrics_t metrics;                // Event counters since boot
+uint32_t minMaxBlock = UINT32_MAX; // Smallest largest free block seen
+uint32_t busLoad = 0;              // I2C busy share, last interval (0.1 %)
+
+// Record the largest free block, called periodically from loop(). A
+// falling minimum while free heap stays flat means fragmentation.
+void sampleHeap() {
+  uint32_t block = ESP.getMaxAllocHeap();
+  if (block < minMaxBlock)
+    minMaxBlock = block;
+}
+
+// Task handles looked up by name on first use
+TaskHandle_t loopTask = nullptr, tcpTask = nullptr, fwdTask = nullptr,
+             logTask = nullptr;
+
+// Report the stack high-water mark of a task (bytes never used)
+void stackMark(JsonObject json, const char *name, TaskHandle_t task) {
+  if (task != nullptr)
+    json[name] = uxTaskGetStackHighWaterMark(task);
+}
+
+// Share of time the I2C buses were busy since the previous call, called
+// periodically from loop()
+void sampleBus() {
+  static uint32_t lastUs = 0;
+  static unsigned long lastMs = 0;
+  unsigned long now = millis();
+  uint32_t us = metrics.i2cBusUs;
+  if (now != lastMs)
+    busLoad = (us - lastUs) / (now - lastMs); // us per ms = 0.1 %
+  lastUs = us;
+  lastMs = now;
+}
+
+// Write heap, stack and counter metrics into a JSON object
+void metricsJson(JsonObject json) {
+  if (loopTask == nullptr)
+    loopTask = xTaskGetHandle("loopTask");
+  if (tcpTask == nullptr)
+    tcpTask = xTaskGetHandle("async_tcp");
+  if (fwdTask == nullptr)
+    fwdTask = xTaskGetHandle("Forward");
+  if (logTask == nullptr)
+    logTask = xTaskGetHandle("Log");
+
+  json["uptime"] = millis() / 1000;
+
+  JsonObject heap = json.createNestedObject("heap");
+  heap["free"] = ESP.getFreeHeap();
+  heap["min"] = ESP.getMinFreeHeap();      // Lowest free heap since boot
+  heap["maxBlock"] = ESP.getMaxAllocHeap(); // Largest free block
+  sampleHeap();
+  heap["minBlock"] = minMaxBlock; // Smallest largest block since boot
+
+  JsonObject stack = json.createNestedObject("stack");
+  stackMark(stack, "BT", Task1);
+  stackMark(stack, "Blink", Task2);
+  stackMark(stack, "loopTask", loopTask);
+  stackMark(stack, "async_tcp", tcpTask);
+  stackMark(stack, "Forward", fwdTask);
+  stackMark(stack, "Log", logTask);
+
+  cpuJson(json.createNestedObject("cpu"));
+  wifiJson(json.createNestedObject("wifi"));
+
+  JsonObject i2c = json.createNestedObject("i2c");
+  i2c["clock"] = I2C_CLOCK;
+  i2c["load"] = busLoad / 10.0;
+  i2c["bamUs"] = bamBaseUs;
+  i2c["busUs"] = metrics.i2cBusUs;
+  i2c["frames"] = metrics.i2cFrames;
+  i2c["frameUs"] = metrics.frameBusUs;
+  i2c["frameMaxUs"] = metrics.frameBusMax;
+  i2c["deferred"] = metrics.i2cDeferred;
+
+  JsonObject count = json.createNestedObject("count");
+  count["scans"] = metrics.scans;
+  count["lookups"] = metrics.lookups;
+  count["misses"] = metrics.misses;
+  count["i2cWrites"] = metrics.i2cWrites;
+  count["i2cReads"] = metrics.i2cReads;
+  count["sseSends"] = metrics.sseSends;
+  count["wsDropped"] = metrics.wsDropped;
+  count["scanDropped"] = metrics.scanDropped;
+  count["forwarded"] = metrics.forwarded;
+  count["fwdSpooled"] = metrics.fwdSpooled;
+  count["fwdDropped"] = metrics.fwdDropped;
+  count["logDropped"] = metrics.logDropped;
+}
@@ -0,0 +1,216 @@
+/*
+ * PutToLight - WiFi Connection Module
+ *
+ * Copyright (c) 2023 Serhii Nesterenko
+ * Licensed under the MIT License. See LICENSE file in the project root.
+ *
+ * Station mode connects in the background: a static address from "cidr",
+ * "gw" and "dns" skips DHCP, and the BSSID and channel of the last access
+ * point that gave us an address skip the channel scan on the next boot.
+ * Lost connections are retried from loop() with exponential backoff,
+ * driven by WiFi events rather than by polling the status.
+ */
+
+#include "ptl.hpp"
+#include <Preferences.h>
+#include <WiFi.h>
+
+#define WIFI_RETRY 10000       // Time an association attempt gets (ms)
+#define WIFI_BACKOFF_MIN 1000  // First retry delay after a failure (ms)
+#define WIFI_BACKOFF_MAX 60000 // Retry delay cap during long outages (ms)
+
+// Connection manager states
+enum WifiState {
+  WIFI_AP_MODE,    // Standalone access point, nothing to manage
+  WIFI_CONNECTING, // Association attempt in progress
+  WIFI_CONNECTED,  // Station has an address
+  WIFI_WAITING     // Backing off until wifiRetryAt
+};
+
+Preferences wifiPrefs;                        // Fast-connect cache in NVS
+bool fastConnect = false;                     // Attempt uses the cached BSSID
+volatile WifiState wifiState = WIFI_AP_MODE;  // Set by WiFi events and loop()
+unsigned long wifiAttempt = 0;                // Start of the current attempt
+unsigned long wifiRetryAt = 0;                // Next attempt while waiting
+unsigned long wifiBackoff = WIFI_BACKOFF_MIN; // Delay before the next retry
+bool wasConnected = false;                    // Had an address since boot
+unsigned long downSince = 0;                  // Start of the current outage
+unsigned long downTotal = 0;                  // Length of past outages (ms)
+uint32_t wifiDisconnects = 0;                 // Connection losses since boot
+uint32_t wifiReconnects = 0;                  // Recovered connection losses
+
+// Parse "a.b.c.d/bits" into address and netmask
+bool parseCidr(const char *cidr, IPAddress &ip, IPAddress &mask) {
+  char addr[16];
+  const char *slash = strchr(cidr, '/');
+  if (slash == nullptr || slash - cidr >= (int)sizeof(addr))
+    return false;
+  strlcpy(addr, cidr, slash - cidr + 1);
+  int bits = atoi(slash + 1);
+  if (!ip.fromString(addr) || bits < 1 || bits > 32)
+    return false;
+  for (int i = 0; i < 4; i++) {
+    int n = constrain(bits - 8 * i, 0, 8);
+    mask[i] = (0xFF << (8 - n)) & 0xFF;
+  }
+  return true;
+}
+
+// Use the static address from config, DHCP if there is none
+void applyStaticIp() {
+  const config_t *c = holdConfig();
+  if (!c->staticIp)
+    WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE); // Back to DHCP
+  else
+    WiFi.config(c->ip, c->gw, c->mask, c->dns);
+  releaseConfig(c);
+}
+
+// Start association, with the cached BSSID and channel when they belong to
+// the configured network
+void beginStation() {
+  const config_t *c = holdConfig();
+  const char *ssid = c->ssid;
+  const char *pass = c->wifipass;
+  uint8_t bssid[6];
+  fastConnect = wifiPrefs.getString("ssid", "") == ssid &&
+                wifiPrefs.getBytes("bssid", bssid, 6) == 6;
+  if (fastConnect)
+    WiFi.begin(ssid, pass, wifiPrefs.getUChar("channel"), bssid);
+  else
+    WiFi.begin(ssid, pass);
+  releaseConfig(c);
+  wifiAttempt = millis();
+  wifiState = WIFI_CONNECTING;
+}
+
+// Forget the cached access point, the next attempt scans all channels
+void dropCache() {
+  LOGW("Cached access point not reachable, scanning");
+  wifiPrefs.clear();
+  fastConnect = false;
+}
+
+// Wait before the next attempt, doubling the delay up to WIFI_BACKOFF_MAX.
+// The jitter keeps controllers sharing an access point from retrying in
+// lockstep after it comes back.
+void scheduleRetry() {
+  wifiRetryAt = millis() + wifiBackoff + random(wifiBackoff / 4);
+  wifiBackoff = min(wifiBackoff * 2, (unsigned long)WIFI_BACKOFF_MAX);
+  wifiState = WIFI_WAITING;
+}
+
+// Remember the access point that gave us an address, only when it changed
+void onGotIp(WiFiEvent_t event, WiFiEventInfo_t info) {
+  uint8_t bssid[6];
+  uint8_t *current = WiFi.BSSID();
+  uint8_t channel = WiFi.channel();
+  if (current != nullptr &&
+      (wifiPrefs.getBytes("bssid", bssid, 6) != 6 ||
+       memcmp(bssid, current, 6) != 0 ||
+       wifiPrefs.getUChar("channel") != channel ||
+       wifiPrefs.getString("ssid", "") != WiFi.SSID())) {
+    wifiPrefs.putString("ssid", WiFi.SSID());
+    wifiPrefs.putBytes("bssid", current, 6);
+    wifiPrefs.putUChar("channel", channel);
+  }
+  fastConnect = false;
+  if (wasConnected) {
+    wifiReconnects++;
+    downTotal += millis() - downSince;
+  }
+  wasConnected = true;
+  wifiBackoff = WIFI_BACKOFF_MIN;
+  wifiState = WIFI_CONNECTED;
+  LOGI("WiFi connected in %lu ms: %s", millis() - wifiAttempt,
+       WiFi.localIP().toString().c_str());
+}
+
+// Connection lost or attempt failed: schedule the next attempt from loop()
+// instead of reconnecting here, so the radio is left to BLE while waiting
+void onDisconnected(WiFiEvent_t event, WiFiEventInfo_t info) {
+  if (wifiState == WIFI_AP_MODE)
+    return;
+  if (wifiState == WIFI_CONNECTED) {
+    wifiDisconnects++;
+    downSince = millis();
+    LOGW("WiFi lost (reason %d)", info.wifi_sta_disconnected.reason);
+  }
+  if (fastConnect) {
+    // A failed fast connect means the access point moved, scan right away
+    dropCache();
+    wifiRetryAt = millis();
+    wifiState = WIFI_WAITING;
+  } else if (wifiState != WIFI_WAITING) {
+    scheduleRetry();
+  }
+}
+
+// Initialize WiFi - either as station or access point, without waiting
+void initWiFi() {
+  const config_t *c = holdConfig();
+  if (!c->standalone) {
+    // Station mode - connect to existing WiFi in the background
+    static bool registered = false;
+    if (!registered) {
+      wifiPrefs.begin("wifi", false);
+      WiFi.onEvent(onGotIp, ARDUINO_EVENT_WIFI_STA_GOT_IP);
+      WiFi.onEvent(onDisconnected, ARDUINO_EVENT_WIFI_STA_DISCONNECTED);
+      registered = true;
+    }
+    WiFi.mode(WIFI_STA);
+    WiFi.setAutoReconnect(false); // Retries are paced by checkWiFi()
+    applyStaticIp();
+    beginStation();
+    LOGI("Connecting to WiFi (%s)%s", c->ssid,
+         fastConnect ? " using cached access point" : "");
+  } else {
+    // Access Point mode - create own network
+    WiFi.mode(WIFI_AP);
+    WiFi.softAP(c->ssid, c->wifipass);
+    LOGI("Setting AP (%s) %s", c->ssid, WiFi.softAPIP().toString().c_str());
+  }
+  releaseConfig(c);
+}
+
+// Tear down the current mode and start again with the loaded config
+void restartWiFi() {
+  LOGI("WiFi settings changed, reconnecting");
+  wifiState = WIFI_AP_MODE; // Disconnect events below are not outages
+  fastConnect = false;
+  wifiBackoff = WIFI_BACKOFF_MIN;
+  WiFi.softAPdisconnect(true);
+  WiFi.disconnect(true);
+  initWiFi();
+}
+
+// Drive the station connection from loop(): give up on attempts that
+// hang and start the next one once the backoff delay is over
+void checkWiFi() {
+  if (wifiState == WIFI_CONNECTING && millis() - wifiAttempt >= WIFI_RETRY) {
+    LOGW("WiFi attempt timed out");
+    if (fastConnect)
+      dropCache();
+    scheduleRetry(); // Before disconnect(), its event must not reschedule
+    WiFi.disconnect();
+  }
+  if (wifiState == WIFI_WAITING && (long)(millis() - wifiRetryAt) >= 0)
+    beginStation();
+}
+
+// Report connection state, losses and accumulated downtime
+void wifiJson(JsonObject json) {
+  static const char *states[] = {"ap", "connecting", "connected", "waiting"};
+  WifiState state = wifiState;
+  unsigned long down = downTotal;
+  if (wasConnected && state != WIFI_CONNECTED)
+    down += millis() - downSince; // Outage in progress
+  json["state"] = states[state];
+  if (state == WIFI_CONNECTED)
+    json["rssi"] = WiFi.RSSI();
+  json["disconnects"] = wifiDisconnects;
+  json["reconnects"] = wifiReconnects;
+  json["downtime"] = down / 1000;
+  if (state == WIFI_WAITING)
+    json["retryIn"] = max(0L, (long)(wifiRetryAt - millis()));
+}
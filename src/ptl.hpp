@@ -5,7 +5,10 @@
  * Licensed under the MIT License. See LICENSE file in the project root.
  */
 
+#include <Arduino.h>
 #include <ArduinoJson.h>
+#include <NimBLEAddress.h>
+#include <NimBLEUUID.h>
 
 // Shift register pins
 #define SER_IN 13 // Serial data input
@@ -19,16 +22,63 @@
 #define SCL_2 19 // Secondary I2C clock line
 
 // Timing constants
-#define PIN_DELAY 1    // Delay between pin operations (ms)
-#define SCAN_TIME 5    // BLE scan duration (seconds)
-#define MAX_DEVICES 20 // Maximum number of BLE devices to track
-#define MAX_SCAN 100   // Maximum scan buffer size
+#define PIN_DELAY 1          // Delay between pin operations (ms)
+#define SCAN_TIME 5          // BLE scan duration (seconds)
+#define MAX_DEVICES 8        // BLE devices reported in the status event
+#define MAX_SCAN 100         // Maximum scan buffer size
+#define SCAN_SLOTS 4         // Scan records waiting for loop()
+#define BLINK_IDLE ULONG_MAX // blinkLoop() result when nothing is scheduled
+#define BLINK_FOREVER ULONG_MAX // Channel duration: blink until replaced
+#define NUM_PINS 48             // Output pins on both chips (48 = all pins)
+#define FRAME_BYTES 6           // CH423 output registers (3 per chip)
+#define SPLIT_MAX 256           // Largest element of a streamed JSON array
+#define SESSION_MISS -1         // sessionScan(): code is not in the order
+#define SESSION_NONE -2         // sessionScan(): no session running
+#define INPUT_LINES 16          // GPIO lines usable as confirmation inputs
+#define INPUT_POLL 20           // Input poll interval (ms)
+#define CONFIG_DOC 2048         // JSON document size for config.json
+#define CONFIG_MAX 4096         // Largest accepted config upload (bytes)
+#define REPLY_DOC 8192          // HTTP response document, for a full session
+#define REQUEST_MAX 8192        // Largest accepted JSON request body (bytes)
+#define GS1_FIELDS 8            // GS1 elements kept per scanned code
+#define GS1_VALUE 32            // Longest GS1 field value kept
+#define GS1_KEYS 8              // AIs usable as lookup keys
+#define LOG_LINE 120            // Longest log message, longer ones are cut
+#define PIN_NAME 32             // Longest location name of a pin + 1
+#define BAM_BITS 3              // Bit planes of a dimmed frame
+#define BAM_FULL 7              // Brightness levels 1-7, 7 = not dimmed
+
+// I2C clock of both CH423 buses, lower it for long cables
+#ifndef I2C_CLOCK
+#define I2C_CLOCK 400000
+#endif
+
+// Log levels. Calls more verbose than LOG_COMPILED (a build flag) are
+// removed at compile time, those more verbose than logLevel at run time.
+#define LEVEL_ERROR 0
+#define LEVEL_WARN 1
+#define LEVEL_INFO 2
+#define LEVEL_DEBUG 3
+#ifndef LOG_COMPILED
+#define LOG_COMPILED LEVEL_DEBUG
+#endif
+#define LOG_AT(level, ...)                                                     \
+  do {                                                                         \
+    if ((level) <= LOG_COMPILED && (level) <= logLevel)                        \
+      logWrite(level, __VA_ARGS__);                                            \
+  } while (0)
+#define LOGE(...) LOG_AT(LEVEL_ERROR, __VA_ARGS__)
+#define LOGW(...) LOG_AT(LEVEL_WARN, __VA_ARGS__)
+#define LOGI(...) LOG_AT(LEVEL_INFO, __VA_ARGS__)
+#define LOGD(...) LOG_AT(LEVEL_DEBUG, __VA_ARGS__)
 
 // CH423 I2C command
 #define CH423_CMD_SET_SYSTEM_ARGS (0x48 >> 1)
 
 using namespace std::__cxx11;
 
+class AsyncWebServer;
+
 // Device connection status
 enum Status {
   STATUS_INIT,                 // Initializing
@@ -36,42 +86,206 @@ enum Status {
   STATUS_DEVICE_CONNECTED      // Device connected
 };
 
-// LED blink states
-enum Blink {
-  BLINK_NONE,  // Not blinking
-  BLINK_START, // Start blinking sequence
-  BLINK_HIGH,  // LED on state
-  BLINK_LOW    // LED off state
+// Where the clock offset came from, best last
+enum TimeQuality {
+  TIME_NONE,   // Never set, timestamps are 0
+  TIME_PUSHED, // Pushed by the web interface or the collector
+  TIME_NTP     // Synced by SNTP
 };
 
-// BLE scan states
-enum ScanMode {
-  SCAN_NONE,        // Not scanning
-  SCAN_IN_PROGRESS, // Currently scanning
-  SCAN_FINISHED     // Scan complete
+// BLE advertiser seen by scans
+typedef struct {
+  uint64_t mac;       // Address, the registry key
+  char address[18];   // Address as "aa:bb:cc:dd:ee:ff"
+  char service[37];   // Advertised service UUID, "" if none
+  bool scanner;       // Service of a model in models.json
+  int8_t rssi;        // Signal strength of the last sighting (dBm)
+  int16_t next;       // Next slot in the same hash bucket, -1 if none
+  unsigned long seen; // millis() of the last sighting
+} device_t;
+
+// Blink pattern of a single output pin
+typedef struct {
+  unsigned long start;    // Sequence start time (ms)
+  unsigned long duration; // Sequence length (ms), 0 = off
+  uint16_t period;        // Blink cycle period (ms)
+  uint16_t fill;          // LED on-time per cycle (ms), >= period = steady
+  uint8_t level;          // Brightness while on, 1-BAM_FULL
+} channel_t;
+
+// Output priority classes, higher classes reach the chips first
+enum Priority {
+  PRIO_EFFECT, // API blink patterns and other effects
+  PRIO_PICK    // Lights a worker waits for: scans, sessions, confirmations
 };
 
-// BLE device information
+// Confirmation input event (button or bin sensor on a CH423 GPIO line)
 typedef struct {
-  string address; // Device MAC address
-  string service; // Device service UUID
-} device_t;
+  int8_t pin;   // Output pin the input confirms
+  uint8_t line; // Input line (0-7 first chip, 8-15 second chip)
+  bool active;  // Line pulled low (button pressed)
+  bool session; // Press closed lines of the pick session
+} input_t;
+
+// Runtime counters, plain 32-bit increments from any task
+typedef struct {
+  uint32_t scans;       // Scans processed
+  uint32_t lookups;     // Table lookups
+  uint32_t misses;      // Table lookups without a match
+  uint32_t i2cWrites;   // CH423 register writes
+  uint32_t i2cReads;    // CH423 GPIO reads
+  uint32_t i2cBusUs;    // Modeled I2C bus time of all reads and writes (us)
+  uint32_t i2cFrames;   // Output frames that wrote at least one register
+  uint32_t frameBusUs;  // Modeled bus time of the last such frame (us)
+  uint32_t frameBusMax; // Longest frame bus time since boot (us)
+  uint32_t i2cDeferred; // Frames whose effect writes yielded to a pick light
+  uint32_t sseSends;    // Server-sent events
+  uint32_t wsDropped;   // WebSocket events lost while every buffer was queued
+  uint32_t scanDropped; // Scans lost while every scan record was taken
+  uint32_t forwarded;   // Scans delivered to the upstream collector
+  uint32_t fwdSpooled;  // Scans stored in the spool while it was unreachable
+  uint32_t fwdDropped;  // Scans lost to a full queue or spool
+  uint32_t logDropped;  // Log messages lost to a full ring
+} metrics_t;
+
+// Scan forwarding transports
+enum Proto { PROTO_UDP, PROTO_TCP, PROTO_HTTP };
+
+// Tasks created with the settings in config.json
+enum TaskId { TASK_BT, TASK_BLINK, TASK_FORWARD, TASK_LOG, TASKS };
+
+// Placement of a task
+typedef struct {
+  int8_t core;      // Core the task is pinned to, -1 for either
+  uint8_t priority; // FreeRTOS priority, 1-24
+  uint16_t stack;   // Stack size (bytes)
+} task_cfg_t;
 
-// Access log entry
+// Settings parsed from config.json. A loaded config is never changed in
+// place: a reload fills a spare copy and then points conf at it.
 typedef struct {
-  unsigned long t; // Timestamp
-  string pin;      // Pin/location identifier
-  string code;     // Access code/identifier
-} log_t;
+  bool standalone;               // Own access point instead of a station
+  char ssid[33];                 // Network to join or to create
+  char wifipass[64];             // Its password
+  bool staticIp;                 // ip, mask and gw are set, no DHCP
+  IPAddress ip, mask, gw, dns;   // Static address settings
+  char addr[18];                 // Scanner MAC, "" if none is selected
+  NimBLEAddress scanner;         // addr, parsed
+  NimBLEUUID service;            // Scan service
+  NimBLEUUID charact;            // Scan characteristic, unset if not given
+  char pins[NUM_PINS][PIN_NAME]; // Location name of every output pin
+  int8_t inputs[INPUT_LINES];    // Pin confirmed by every input line, -1
+  char gs1Keys[GS1_KEYS][5];     // AIs used as lookup keys, preferred first
+  int nGs1Keys;
+  uint8_t logLevel;              // Most verbose level logged, LEVEL_*
+  uint8_t brightness;            // Default LED level, 1-BAM_FULL
+  char fwdHost[64];              // Scan collector, "" if not forwarding
+  char fwdPath[64];              // Request path for HTTP
+  uint16_t fwdPort;
+  Proto fwdProto;
+  unsigned long fwdLatency;      // Longest time an event waits (ms)
+  int fwdBatch;                  // Events per batch
+  task_cfg_t tasks[TASKS];       // Placement of our tasks, by TaskId
+} config_t;
 
-// Global device storage
-extern device_t devices[MAX_DEVICES]; // Array of discovered BLE devices
-extern int nDevices;                  // Number of devices found
+// Called for every complete top-level element of a streamed JSON array
+typedef void (*SplitCallback)(void *ctx, const char *element, size_t len);
+
+// Splits a JSON array arriving in chunks into its top-level elements, so
+// each one can be parsed on its own with a small fixed-size document
+class JsonSplitter {
+public:
+  void reset();
+  void feed(const uint8_t *data, size_t len, SplitCallback cb, void *ctx);
+  int dropped; // Elements skipped because they did not fit SPLIT_MAX
+
+private:
+  void store(char c);
+  void emit(SplitCallback cb, void *ctx);
+  char buf[SPLIT_MAX]; // Element being collected
+  size_t pos;          // Element length so far
+  int depth;           // Bracket nesting level
+  bool inString;       // Inside a string literal
+  bool escape;         // Previous string byte was a backslash
+  bool overflow;       // Current element did not fit
+};
+
+// GS1 element of a scanned code
+typedef struct {
+  char ai[5];                // Application identifier, 2-4 digits
+  uint8_t len;               // Value length
+  char value[GS1_VALUE + 1]; // Value, without the AI
+} gs1_field_t;
+
+// Splits a GS1 element string or Digital Link URI arriving in chunks into
+// its fields, without allocating; fields are valid once end() returned true
+class Gs1Parser {
+public:
+  void reset();
+  void feed(const uint8_t *data, size_t len);
+  bool end();
+  bool parse(const char *code, size_t len); // reset(), feed() and end()
+  const gs1_field_t *find(const char *ai) const;
+  int n;                         // Fields found
+  gs1_field_t field[GS1_FIELDS]; // Fields in code order
+
+private:
+  void put(uint8_t c);
+  void putValue(uint8_t c);
+  void beginField();
+  void keepField();
+  void endField();
+  void invalid();
+  void putLink(uint8_t c);
+  void putLinkByte(uint8_t c);
+  void endSegment();
+  void endLinkField();
+  uint8_t state;
+  char symb[3]; // Symbology identifier after ]
+  int symbLen;
+  char ai[5]; // Application identifier being read
+  int aiLen;
+  int aiNeed;      // Digits of the AI
+  int fixed;       // Predefined value length, 0 if ended by GS
+  int valueLen;    // Value bytes so far
+  bool keep;       // Room for the field
+  bool linked;     // Digital Link: primary key seen, segments are AI/value
+  bool valueDue;   // Digital Link: the segment being read is a value
+  bool segAi;      // Digital Link: segment or key so far can be an AI
+  uint8_t esc;     // Hex digits of a %-escape still due
+  uint8_t escByte; // The %-escaped byte so far
+};
+
+// BLE advertisers
+int listDevices(device_t *out, int max); // Recent ones that offer a service
+
+// Scan record, filled by the BLE callback and processed by loop()
+typedef struct {
+  char code[MAX_SCAN]; // Scanned code, zero terminated
+  Gs1Parser gs1;       // GS1 fields of the code, parsed as it arrives
+} scan_t;
 
 // Global status variables
-extern Status status;       // Current connection status
-extern char scan[MAX_SCAN]; // Scan result buffer
-extern ScanMode scanMode;   // Current scan state
+extern Status status; // Current connection status
+
+// Completed scans, from a fixed pool of SCAN_SLOTS records
+scan_t *nextScan();          // Oldest completed scan, nullptr if none
+void releaseScan(scan_t *s); // Give a processed record back to the pool
+
+// Runtime metrics
+extern metrics_t metrics;              // Event counters since boot
+extern TaskHandle_t Task1, Task2;      // BT and Blink task handles
+void metricsJson(JsonObject json);     // Heap, stack and counter report
+void sampleHeap();                     // Track the smallest largest block
+void sampleBus();                      // I2C busy share since the last call
+extern uint32_t bamBaseUs;             // Shortest dimming bit plane (us)
+
+// Task placement and CPU load
+extern const char *const taskNames[TASKS]; // Task names, by TaskId
+TaskHandle_t startTask(TaskId id,
+                       TaskFunction_t code); // Create a task as configured
+void sampleCpu();                            // Core loads, from loop()
+void cpuJson(JsonObject json);               // Core loads
 
 // Task entry points
 extern void BLECode(void *params);   // BLE scanning task
@@ -83,15 +297,109 @@ extern int codeTarget; // Target code for comparison
 // Timing
 extern unsigned long timerDelay; // Timer delay value
 
+// Blink defaults
+extern unsigned long blinkDuration; // Total blink duration (ms)
+extern int blinkPeriod;             // Blink cycle period (ms)
+extern int blinkFill;               // LED on-time per cycle (ms)
+
 // Configuration
-extern DynamicJsonDocument cfg; // JSON configuration document
+extern const config_t *volatile conf;     // Live config, for single fields
+const config_t *holdConfig();             // Keep the live config intact
+void releaseConfig(const config_t *c);    // Give back a held config
+extern unsigned long lastWrite;           // Time config.json was last loaded
+extern unsigned long lastRead;            // Time the table was last loaded
+void readConfig();                        // Load config.json into conf
+void selectScanner(const char *addr, const char *service,
+                   const char *charact);  // Use a scanner until reload
+const char *validateConfig(JsonObject c); // Schema check, error or nullptr
+bool beginConfigUpload(void *owner);      // Claim staging, false if busy
+bool configBusy(void *owner);             // Another upload is staging
+void abortConfigUpload(void *owner);      // Drop a staged upload
+bool stageConfig(void *owner, const uint8_t *data, size_t len, size_t index,
+                 size_t total);           // Stage an uploaded chunk
+bool configStaged(void *owner);           // Every chunk of an upload staged
+const char *commitConfig(void *owner);    // Validate and install an upload
+void checkConfig();                       // Apply new config live, from loop()
 
 // Initialization and main loop functions
-void initBlink();       // Initialize LED blink system
-void blinkLoop();       // Process LED blink state machine
-void initLog();         // Initialize logging system
-void blinkPin(int pin); // Trigger LED blink on specific pin
+void initBlink();          // Initialize LED blink system
+unsigned long blinkLoop(); // Process LED blink state machine
+void initLog();            // Initialize logging system
+void blinkPin(int pin, Priority prio = PRIO_EFFECT); // Blink one pin
+void blinkFrame(const channel_t *frame,
+                Priority prio = PRIO_EFFECT); // Replace all channels at once
+void blinkChannel(int pin, const channel_t *ch,
+                  Priority prio = PRIO_EFFECT); // Update a single channel
+bool nextInput(input_t *event); // Take the next confirmation input event
+bool startSelfTest();           // Run the wall self-test, false if busy
+void selfTestJson(JsonObject json); // Self-test state and report
+void setChannel(channel_t *ch, unsigned long now, unsigned long duration,
+                int period, int fill); // Fill a channel with a pattern
+int findLocation(JsonString pinName);  // Pin number of a location, -1 if none
+JsonString findInTable(JsonString x, char *loc,
+                       const Gs1Parser *gs1 = nullptr); // Location of a code
+
+// Lookup table, indexed on flash
+void readTable();                   // Open the index, build it if missing
+bool beginTableUpload(void *owner); // Start an upload, false if busy
+void feedTableUpload(void *owner, const uint8_t *data,
+                     size_t len);   // Parse the next chunk of an upload
+const char *endTableUpload(void *owner, uint32_t *codes,
+                           int *locs); // Finish an upload, error or nullptr
+void abortTableUpload(void *owner); // Drop an unfinished upload
+void checkTable();                  // Swap in a finished upload, loop()
+void tableJson(JsonObject json);    // Table size for the API
+
+// Pick sessions
+void initSession();                  // Initialize session storage
+bool startSession(JsonObject order); // Light all locations of an order
+void stopSession();                  // Cancel session, lights off
+int sessionScan(const char *code);   // Mark a scanned code as picked
+bool sessionConfirm(int pin);        // Mark all lines of a location picked
+void sessionProgress(JsonObject json); // Session id and done/total counts
+void sessionState(JsonObject json);    // Progress plus all order lines
+
+// Web assets
+void initAssets(AsyncWebServer &server); // Serve packed, cacheable assets
+
+// Web commands, shared by the HTTP API and the WebSocket channel
+void setDevice(JsonObject json);           // Select BLE scanner device
+const char *saveConfig(JsonObject config); // Validate and install a config
+void requestRestart();                     // Reboot from the main loop shortly
+bool applyEntry(JsonVariant entry, channel_t *frame,
+                unsigned long now); // Apply one batch entry to a frame
+
+// WebSocket channel
+void initWs(AsyncWebServer &server);              // Register /ws endpoint
+void wsEvent(const char *data, const char *event); // Broadcast an event
+void wsCleanup();                                  // Drop closed clients
+void wsLog(unsigned long ms, uint8_t level,
+           const char *text); // Send a log line to tailing clients
+
+// Upstream scan forwarding
+void initForward();                 // Start forwarding if configured
+void forwardScan(const char *json); // Queue a scan event for the collector
+
+// WiFi
+void initWiFi();                // Start station or AP mode, no waiting
+void restartWiFi();             // Re-apply changed WiFi settings
+void checkWiFi();               // Reconnect state machine, from loop()
+void wifiJson(JsonObject json); // Connection state, losses and downtime
+bool parseCidr(const char *cidr, IPAddress &ip,
+               IPAddress &mask); // Split "a.b.c.d/bits"
+
+// Logging, drained to the UART by a low-priority task
+extern uint8_t logLevel; // Most verbose level logged, LEVEL_*
+void logWrite(uint8_t level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3))); // Use LOGE()..LOGD()
+int levelOf(const char *name);             // LEVEL_* by name, -1 if unknown
+void initLogging();                        // Start the drain task
+
+// Time service
+unsigned long getTime();        // Unix timestamp, 0 if unknown, never blocks
+const char *timeSource();       // "none", "push" or "ntp"
+bool pushTime(unsigned long t); // Set the clock when NTP is unavailable
+void timeJson(JsonObject json); // Time, source and uptime for the API
 
 // Utility functions
-unsigned long getTime();      // Get current timestamp
 void disconnectFromScanner(); // Disconnect from BLE scanner
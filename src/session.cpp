@@ -0,0 +1,177 @@
+/*
+ * PutToLight - Pick Session Module
+ *
+ * Copyright (c) 2023 Serhii Nesterenko
+ * Licensed under the MIT License. See LICENSE file in the project root.
+ */
+
+#include "ptl.hpp"
+
+#define MAX_LINES 128     // Maximum order lines in a session
+#define SESSION_POOL 4096 // Storage for the codes of all order lines
+#define MAX_QTY 255       // Most units of one order line
+
+// Order line of a pick session
+typedef struct {
+  uint16_t code; // Offset of the code in the session pool
+  int8_t pin;    // Output pin, -1 when the code is not in the table
+  uint16_t qty;  // Units still to pick
+} line_t;
+
+// Session storage - fixed size, filled from the uploaded order
+char sessionId[32];            // Order identifier
+line_t lines[MAX_LINES];       // Order lines
+int nLines = 0;                // Number of lines in the session
+int linesDone = 0;             // Lines picked completely
+char pool[SESSION_POOL];       // Line codes, zero separated
+SemaphoreHandle_t sessionLock; // Guards the session between web and loop
+
+// Turn a location on or off without touching the other channels
+void lightPin(int pin, bool on) {
+  channel_t ch;
+  memset(&ch, 0, sizeof(ch));
+  if (on)
+    setChannel(&ch, millis(), BLINK_FOREVER, blinkPeriod, blinkFill);
+  blinkChannel(pin, &ch, PRIO_PICK);
+}
+
+// Check if any unfinished line still needs this pin lit
+bool pinPending(int pin) {
+  for (int i = 0; i < nLines; i++) {
+    if (lines[i].pin == pin && lines[i].qty > 0)
+      return true;
+  }
+  return false;
+}
+
+// Session runs until every line is picked
+bool sessionActive() { return linesDone < nLines; }
+
+// Initialize session storage
+void initSession() { sessionLock = xSemaphoreCreateMutex(); }
+
+// Start a pick session from an order:
+// {"id": "...", "lines": [{"code": "...", "qty": 1}, ...]}
+// All pins are resolved once here and every pending location is lit. An
+// order with a quantity outside 1..MAX_QTY is rejected as a whole.
+bool startSession(JsonObject order) {
+  JsonArray items = order["lines"].as<JsonArray>();
+  if (items.isNull() || items.size() == 0 || items.size() > MAX_LINES)
+    return false;
+  for (JsonObject item : items) {
+    JsonVariant qty = item["qty"];
+    if (!qty.isNull() &&
+        (!qty.is<int>() || qty.as<int>() < 1 || qty.as<int>() > MAX_QTY))
+      return false;
+  }
+
+  xSemaphoreTake(sessionLock, portMAX_DELAY);
+  channel_t frame[NUM_PINS];
+  unsigned long now = millis();
+  size_t used = 0;
+  memset(frame, 0, sizeof(frame));
+  strlcpy(sessionId, order["id"] | "", sizeof(sessionId));
+  nLines = 0;
+  linesDone = 0;
+  for (JsonObject item : items) {
+    const char *code = item["code"];
+    size_t len = code != nullptr ? strlen(code) + 1 : 0;
+    if (len == 0 || used + len > SESSION_POOL)
+      continue;
+    line_t *line = &lines[nLines++];
+    memcpy(&pool[used], code, len);
+    line->code = used;
+    used += len;
+    line->qty = item["qty"] | 1;
+    char loc[PIN_NAME];
+    line->pin = findLocation(findInTable(code, loc));
+    if (line->pin >= 0)
+      setChannel(&frame[line->pin], now, BLINK_FOREVER, blinkPeriod,
+                 blinkFill);
+  }
+  blinkFrame(frame, PRIO_PICK);
+  LOGI("Session %s: %d lines", sessionId, nLines);
+  xSemaphoreGive(sessionLock);
+  return nLines > 0;
+}
+
+// Cancel the active session and turn its lights off
+void stopSession() {
+  channel_t frame[NUM_PINS];
+  memset(frame, 0, sizeof(frame));
+  xSemaphoreTake(sessionLock, portMAX_DELAY);
+  if (sessionActive())
+    blinkFrame(frame, PRIO_PICK);
+  nLines = 0;
+  linesDone = 0;
+  xSemaphoreGive(sessionLock);
+}
+
+// Register a scan against the active session
+// Returns the matching line, SESSION_MISS if the code is not part of the
+// order, or SESSION_NONE when no session is running
+int sessionScan(const char *code) {
+  int found = SESSION_MISS;
+  xSemaphoreTake(sessionLock, portMAX_DELAY);
+  if (!sessionActive()) {
+    xSemaphoreGive(sessionLock);
+    return SESSION_NONE;
+  }
+  // Prefer a line that still needs picking
+  for (int i = 0; i < nLines; i++) {
+    if (strcmp(&pool[lines[i].code], code) == 0) {
+      found = i;
+      if (lines[i].qty > 0)
+        break;
+    }
+  }
+  if (found >= 0 && lines[found].qty > 0 && --lines[found].qty == 0) {
+    linesDone++;
+    if (lines[found].pin >= 0 && !pinPending(lines[found].pin))
+      lightPin(lines[found].pin, false); // Location done, turn it off
+  }
+  xSemaphoreGive(sessionLock);
+  return found;
+}
+
+// Confirm a whole location at once, e.g. from a button at the shelf
+// Returns true if the pin had unfinished lines in the active session
+bool sessionConfirm(int pin) {
+  bool found = false;
+  xSemaphoreTake(sessionLock, portMAX_DELAY);
+  for (int i = 0; sessionActive() && i < nLines; i++) {
+    if (lines[i].pin == pin && lines[i].qty > 0) {
+      lines[i].qty = 0;
+      linesDone++;
+      found = true;
+    }
+  }
+  if (found)
+    lightPin(pin, false);
+  xSemaphoreGive(sessionLock);
+  return found;
+}
+
+// Write session progress into a JSON object
+void sessionProgress(JsonObject json) {
+  xSemaphoreTake(sessionLock, portMAX_DELAY);
+  json["id"] = (const char *)sessionId;
+  json["done"] = linesDone;
+  json["total"] = nLines;
+  json["active"] = sessionActive();
+  xSemaphoreGive(sessionLock);
+}
+
+// Write session progress with every line into a JSON object
+void sessionState(JsonObject json) {
+  sessionProgress(json);
+  JsonArray array = json.createNestedArray("lines");
+  xSemaphoreTake(sessionLock, portMAX_DELAY);
+  for (int i = 0; i < nLines; i++) {
+    JsonObject line = array.createNestedObject();
+    line["code"] = (const char *)&pool[lines[i].code];
+    line["pin"] = lines[i].pin;
+    line["qty"] = lines[i].qty;
+  }
+  xSemaphoreGive(sessionLock);
+}
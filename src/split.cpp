@@ -0,0 +1,89 @@
+/*
+ * PutToLight - Streaming JSON Array Splitter
+ *
+ * Copyright (c) 2023 Serhii Nesterenko
+ * Licensed under the MIT License. See LICENSE file in the project root.
+ */
+
+#include "ptl.hpp"
+
+// Prepare for a new array
+void JsonSplitter::reset() {
+  pos = 0;
+  depth = 0;
+  inString = false;
+  escape = false;
+  overflow = false;
+  dropped = 0;
+}
+
+// Keep a byte of the current element, remember if it did not fit
+void JsonSplitter::store(char c) {
+  if (pos < SPLIT_MAX - 1)
+    buf[pos++] = c;
+  else
+    overflow = true;
+}
+
+// Hand the collected element over to the callback and start a new one
+void JsonSplitter::emit(SplitCallback cb, void *ctx) {
+  if (overflow)
+    dropped++;
+  else if (pos > 0) {
+    buf[pos] = 0;
+    cb(ctx, buf, pos);
+  }
+  pos = 0;
+  overflow = false;
+}
+
+// Feed the next chunk of the array, elements may span chunk borders
+void JsonSplitter::feed(const uint8_t *data, size_t len, SplitCallback cb,
+                        void *ctx) {
+  for (size_t i = 0; i < len; i++) {
+    char c = data[i];
+    if (inString) {
+      store(c);
+      if (escape)
+        escape = false;
+      else if (c == '\\')
+        escape = true;
+      else if (c == '"')
+        inString = false;
+      continue;
+    }
+    switch (c) {
+    case '"':
+      inString = true;
+      store(c);
+      break;
+    case '[':
+    case '{':
+      if (depth++ > 0)
+        store(c); // Depth 0 is the outer array itself
+      break;
+    case ']':
+    case '}':
+      if (depth > 1)
+        store(c);
+      if (--depth <= 1)
+        emit(cb, ctx); // Element (or the whole array) complete
+      break;
+    case ',':
+      if (depth > 1)
+        store(c);
+      else
+        emit(cb, ctx); // Scalar element complete
+      break;
+    case ' ':
+    case '\t':
+    case '\r':
+    case '\n':
+      break;
+    default:
+      if (depth > 0)
+        store(c);
+      break;
+    }
+  }
+}
@@ -0,0 +1,1079 @@
+/*
+ * PutToLight - Lookup Table Module
+ *
+ * Copyright (c) 2023 Serhii Nesterenko
+ * Licensed under the MIT License. See LICENSE file in the project root.
+ *
+ * table.json ({"location": ["code", ...], ...}) is not kept in RAM. It is
+ * parsed as a stream into an index: a header with the location names and
+ * 256 hash buckets, followed by one 8-byte record per code. The index
+ * lives in the raw "table" partition, which is mapped into the address
+ * space through the flash cache, so a lookup hashes the code and scans
+ * its bucket in place without copying anything to the heap.
+ *
+ * The partition holds two index slots. A new index is written to the
+ * slot not in use, its header last, and the valid slot with the higher
+ * generation is the live one. Uploads are parsed chunk by chunk while
+ * they arrive; the index is built by the main loop once the body is
+ * complete and then swapped in.
+ *
+ * A code array may also hold rules: {"prefix": "..."}, {"match": "..."}
+ * with * and ? wildcards, either of them with "ai" to test the value of
+ * a GS1 application identifier instead of the whole code. Rules are
+ * compiled into a trie stored after the records and walked one byte at a
+ * time, so a lookup costs the same however many rules there are. An
+ * exact code wins over rules, and among rules the one with more literal
+ * characters wins. Codes written as "(ai)value" are also found through
+ * the GS1 key fields of a scan (conf->gs1Keys), before any rule.
+ */
+
+#include "ptl.hpp"
+#include <LittleFS.h>
+#include <esp_partition.h>
+
+#define TABLE_LOCS 128         // Distinct location names
+#define TABLE_NAME 32          // Longest location name + 1
+#define TABLE_BUCKETS 256      // Hash buckets, selected by the top hash byte
+#define TABLE_BUILD 1024       // Records sorted in RAM per build pass
+#define TABLE_CHUNK 64         // Records per flash read or write
+#define TABLE_MAGIC 0x494c5450 // "PTLI"
+#define TABLE_VERSION 3        // Index layout
+#define TABLE_RULE 64          // Longest rule pattern
+#define TABLE_NODES 2048       // Trie nodes for all rules
+#define TABLE_ACTIVE 16        // Trie states listed in a lookup, then bitmap
+#define TABLE_SUBTYPE 0x40     // Data partition subtype of "table"
+
+static_assert(TABLE_NAME <= PIN_NAME, "a location name fits a pin name");
+
+#define TABLE_JSON "/table.json"
+#define TABLE_UP "/table.up"   // Raw upload, becomes table.json
+#define TABLE_REC "/table.rec" // Records in upload order
+
+// One code of the table
+typedef struct {
+  uint32_t hash;  // FNV-1a of the code, top byte selects the bucket
+  uint16_t check; // Second hash, tells apart codes with the same hash
+  uint16_t loc;   // Location name index
+} record_t;
+
+// Trie edge labels besides the byte values 0-255
+#define LABEL_ANY 256  // ? matches one byte
+#define LABEL_STAR 257 // * matches any number of bytes
+#define LOC_NONE 0xFFFF
+#define ROOT_CODE 0 // Trie root of rules on the whole code
+#define ROOT_GS1 1  // Trie root of rules on GS1 elements, keyed "ai)value"
+
+// Trie node in the index, edges sorted by label so ? and * come last
+typedef struct {
+  uint16_t edges;  // First edge
+  uint16_t nEdges; // Edges leaving this node
+  uint16_t loc;    // Location of a rule ending here, LOC_NONE if none
+  uint8_t lits;    // Literal bytes on the path from the root
+  uint8_t loop;    // Reached through *, stays active on any byte
+} node_t;
+
+typedef struct {
+  uint16_t label; // Byte, LABEL_ANY or LABEL_STAR
+  uint16_t child; // Node the edge leads to
+} edge_t;
+
+// Trie node while rules are being added, children in a sorted list
+typedef struct {
+  uint16_t child, next, label, loc;
+  uint8_t lits;
+} rule_node_t;
+
+// Index header, records of bucket b start at record bucket[b]; the trie
+// follows the records: nodes, then edges
+typedef struct {
+  uint32_t magic;
+  uint32_t count;      // Records
+  uint16_t nLocs;      // Location names used
+  uint16_t version;    // TABLE_VERSION
+  uint32_t generation; // Higher is newer
+  uint16_t rules;      // Rules compiled into the trie
+  uint16_t nodes;      // Trie nodes, 0 without rules
+  char names[TABLE_LOCS][TABLE_NAME];
+  uint32_t bucket[TABLE_BUCKETS + 1];
+} table_hdr_t;
+
+// Parser states, one per position in {"loc": ["code", ...], ...}
+enum ParseState {
+  P_START,      // Before the opening brace
+  P_KEY,        // Expecting a location name or closing brace
+  P_COLON,      // After a location name
+  P_VALUE,      // Expecting the code array
+  P_CODE,       // Expecting a code, rule or closing bracket
+  P_CODE_NEXT,  // After a code or rule
+  P_KEY_NEXT,   // After a code array
+  P_RULE_KEY,   // Expecting a rule field name or closing brace
+  P_RULE_COLON, // After a rule field name
+  P_RULE_VALUE, // Expecting a rule field value
+  P_RULE_NEXT,  // After a rule field value
+  P_DONE,       // After the closing brace
+  P_ERROR
+};
+
+// What the string being parsed is
+enum StringKind {
+  S_NAME,      // Location name
+  S_CODE,      // Code, only hashed
+  S_RULE_KEY,  // Rule field name
+  S_RULE_VALUE // Rule field value
+};
+
+// Incremental table.json parser, records go to TABLE_REC as they are found
+// and rules into a trie in RAM
+class TableParser {
+public:
+  ~TableParser() { free(nodes); }
+  bool begin(bool keepRaw);
+  void feed(const uint8_t *data, size_t len);
+  const char *end();
+  bool writeTrie(size_t pos);
+  table_hdr_t hdr; // Names, bucket counts until the index is built
+  const char *error;
+  void *owner; // Upload request
+
+private:
+  void parse(uint8_t c);
+  void putChar(uint8_t c);
+  void endString();
+  void addRecord();
+  void addRule();
+  uint16_t addNode(uint16_t parent, uint16_t label);
+  void fail(const char *msg);
+  File raw, rec;
+  record_t recs[TABLE_CHUNK]; // Records waiting to be written
+  int nRecs;
+  rule_node_t *nodes = nullptr; // Rule trie, allocated by the first rule
+  ParseState state;
+  StringKind kind;
+  bool inString, escape;
+  int uCount;      // Hex digits of a \u escape still expected
+  uint16_t uValue; // Code point of the \u escape
+  char name[TABLE_NAME];
+  int nameLen;
+  char text[TABLE_RULE + 1];    // Rule field name or value being read
+  int textLen;
+  int field;                    // Rule field the value is for
+  char ai[5];                   // "ai" of the rule, empty if none
+  char pattern[TABLE_RULE + 1]; // "prefix" or "match" of the rule
+  int patternField;             // Which of them, -1 if none yet
+  uint32_t hash, hash2;         // Hashes of the code so far
+  size_t codeLen;
+  uint16_t loc; // Location of the current code array
+};
+
+const esp_partition_t *tablePart;    // Raw partition with two index slots
+size_t slotSize;                     // Bytes per index slot
+const table_hdr_t *table = nullptr;  // Live index, mapped flash
+const record_t *tableRecs;           // Records of the live index
+const node_t *tableNodes;            // Rule trie of the live index
+const edge_t *tableEdges;
+spi_flash_mmap_handle_t tableHandle; // Mapping of the live slot
+int tableSlot = -1;                  // Slot of the live index
+SemaphoreHandle_t tableLock;         // Guards the live index pointers
+TableParser *upload = nullptr;       // Upload being received
+TableParser *tablePending = nullptr; // Complete upload waiting for loop()
+
+// Fields of a rule object
+enum RuleField { F_AI, F_PREFIX, F_MATCH };
+static const char *const ruleFields[] = {"ai", "prefix", "match"};
+
+// Bytes of a compiled trie in the index
+static inline size_t trieSize(uint16_t nodes) {
+  return nodes == 0 ? 0 : nodes * sizeof(node_t) + (nodes - 2) * sizeof(edge_t);
+}
+
+// Hash one more byte of a code
+static inline void hashStep(uint32_t &hash, uint32_t &hash2, uint8_t c) {
+  hash = (hash ^ c) * 16777619;
+  hash2 = hash2 * 33 + c;
+}
+
+// Fold the second hash into the record check value
+static inline uint16_t checkOf(uint32_t hash2, size_t len) {
+  return (uint16_t)(hash2 ^ (hash2 >> 16) ^ len);
+}
+
+// Start a parse, optionally keeping the raw bytes to replace table.json
+bool TableParser::begin(bool keepRaw) {
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = TABLE_MAGIC;
+  hdr.version = TABLE_VERSION;
+  error = nullptr;
+  owner = nullptr;
+  nRecs = 0;
+  state = P_START;
+  inString = escape = false;
+  uCount = 0;
+  free(nodes);
+  nodes = nullptr;
+  if (keepRaw) {
+    raw = LittleFS.open(TABLE_UP, FILE_WRITE);
+    if (!raw)
+      return false;
+  }
+  rec = LittleFS.open(TABLE_REC, FILE_WRITE);
+  return (bool)rec;
+}
+
+// Stop parsing with an error, the rest of the body is ignored
+void TableParser::fail(const char *msg) {
+  if (error == nullptr)
+    error = msg;
+  state = P_ERROR;
+}
+
+// Write buffered records to the record file
+static bool flushRecords(File &file, record_t *recs, int &n) {
+  size_t len = n * sizeof(record_t);
+  bool ok = n == 0 || file.write((const uint8_t *)recs, len) == len;
+  n = 0;
+  return ok;
+}
+
+// Store the record of the code that just ended
+void TableParser::addRecord() {
+  record_t *r = &recs[nRecs++];
+  r->hash = hash;
+  r->check = checkOf(hash2, codeLen);
+  r->loc = loc;
+  hdr.bucket[hash >> 24]++; // Counts until the index is built
+  hdr.count++;
+  if (nRecs == TABLE_CHUNK && !flushRecords(rec, recs, nRecs))
+    fail("unable to write file");
+}
+
+// Child of a trie node by label, created if missing. Children are kept
+// sorted by label. Returns LOC_NONE when the trie is full.
+uint16_t TableParser::addNode(uint16_t parent, uint16_t label) {
+  uint16_t *link = &nodes[parent].child;
+  while (*link != 0 && nodes[*link].label < label)
+    link = &nodes[*link].next;
+  if (*link != 0 && nodes[*link].label == label)
+    return *link;
+  if (hdr.nodes >= TABLE_NODES)
+    return LOC_NONE;
+  rule_node_t *n = &nodes[hdr.nodes];
+  n->child = 0;
+  n->next = *link;
+  n->label = label;
+  n->loc = LOC_NONE;
+  n->lits = nodes[parent].lits + (label < LABEL_ANY ? 1 : 0);
+  *link = hdr.nodes;
+  return hdr.nodes++;
+}
+
+// Compile the rule object that just ended into the trie. A prefix ends in
+// *, repeated * collapse into one; the first of two equal rules wins.
+void TableParser::addRule() {
+  if (patternField < 0) {
+    fail("rule must have one of prefix and match");
+    return;
+  }
+  if (nodes == nullptr) {
+    nodes = (rule_node_t *)calloc(TABLE_NODES, sizeof(rule_node_t));
+    if (nodes == nullptr) {
+      fail("out of memory");
+      return;
+    }
+    nodes[ROOT_CODE].loc = nodes[ROOT_GS1].loc = LOC_NONE;
+    hdr.nodes = 2;
+  }
+  uint16_t n = ROOT_CODE;
+  if (ai[0] != 0) {
+    n = ROOT_GS1;
+    for (const char *c = ai; *c != 0 && n != LOC_NONE; c++)
+      n = addNode(n, (uint8_t)*c);
+    if (n != LOC_NONE)
+      n = addNode(n, ')');
+  }
+  uint16_t last = 0;
+  for (const char *c = pattern; *c != 0 && n != LOC_NONE; c++) {
+    uint16_t label = (uint8_t)*c;
+    if (patternField == F_MATCH && *c == '*')
+      label = LABEL_STAR;
+    else if (patternField == F_MATCH && *c == '?')
+      label = LABEL_ANY;
+    if (label != LABEL_STAR || last != LABEL_STAR)
+      n = addNode(n, label);
+    last = label;
+  }
+  if (patternField == F_PREFIX && last != LABEL_STAR && n != LOC_NONE)
+    n = addNode(n, LABEL_STAR);
+  if (n == LOC_NONE) {
+    fail("too many rules");
+    return;
+  }
+  if (nodes[n].loc == LOC_NONE)
+    nodes[n].loc = loc;
+  hdr.rules++;
+}
+
+// A byte of a string value: location names and rules are kept, codes
+// only hashed
+void TableParser::putChar(uint8_t c) {
+  if (kind == S_CODE) {
+    hashStep(hash, hash2, c);
+    codeLen++;
+  } else if (kind != S_NAME) {
+    if (textLen >= TABLE_RULE)
+      fail("rule too long");
+    else
+      text[textLen++] = c;
+  } else if (nameLen >= TABLE_NAME - 1) {
+    fail("location name too long");
+  } else {
+    name[nameLen++] = c;
+  }
+}
+
+// A string ended: look up or add the location name, store the code or
+// take in a rule field
+void TableParser::endString() {
+  if (kind == S_CODE) {
+    if (codeLen > 0)
+      addRecord();
+    return;
+  }
+  if (kind == S_RULE_KEY || kind == S_RULE_VALUE) {
+    text[textLen] = 0;
+    if (kind == S_RULE_KEY) {
+      for (field = F_AI; field <= F_MATCH; field++) {
+        if (strcmp(text, ruleFields[field]) == 0)
+          return;
+      }
+      fail("rule fields are ai, prefix and match");
+    } else if (field == F_AI) {
+      if (textLen < 2 || textLen > 4 ||
+          strspn(text, "0123456789") != (size_t)textLen)
+        fail("ai must be 2-4 digits");
+      strlcpy(ai, text, sizeof(ai));
+    } else if (patternField >= 0) {
+      fail("rule must have one of prefix and match");
+    } else {
+      strcpy(pattern, text);
+      patternField = field;
+    }
+    return;
+  }
+  name[nameLen] = 0;
+  for (loc = 0; loc < hdr.nLocs; loc++) {
+    if (strcmp(hdr.names[loc], name) == 0)
+      return;
+  }
+  if (hdr.nLocs >= TABLE_LOCS) {
+    fail("too many locations");
+    return;
+  }
+  strcpy(hdr.names[hdr.nLocs], name);
+  loc = hdr.nLocs++;
+}
+
+// Advance the parser by one byte
+void TableParser::parse(uint8_t c) {
+  if (inString) {
+    if (uCount > 0) {
+      // \uXXXX, encoded as UTF-8 once all four digits are in
+      uValue = uValue << 4 | (isdigit(c) ? c - '0' : (tolower(c) - 'a' + 10));
+      if (!isxdigit(c))
+        fail("bad escape");
+      else if (--uCount == 0) {
+        if (uValue < 0x80) {
+          putChar(uValue);
+        } else if (uValue < 0x800) {
+          putChar(0xC0 | uValue >> 6);
+          putChar(0x80 | (uValue & 0x3F));
+        } else {
+          putChar(0xE0 | uValue >> 12);
+          putChar(0x80 | ((uValue >> 6) & 0x3F));
+          putChar(0x80 | (uValue & 0x3F));
+        }
+      }
+    } else if (escape) {
+      escape = false;
+      switch (c) {
+      case 'b':
+        putChar('\b');
+        break;
+      case 'f':
+        putChar('\f');
+        break;
+      case 'n':
+        putChar('\n');
+        break;
+      case 'r':
+        putChar('\r');
+        break;
+      case 't':
+        putChar('\t');
+        break;
+      case 'u':
+        uCount = 4;
+        uValue = 0;
+        break;
+      default:
+        putChar(c); // \" \\ \/
+      }
+    } else if (c == '\\') {
+      escape = true;
+    } else if (c == '"') {
+      inString = false;
+      endString();
+    } else {
+      putChar(c);
+    }
+    return;
+  }
+  if (isspace(c))
+    return;
+  switch (state) {
+  case P_START:
+    if (c == '{')
+      state = P_KEY;
+    else
+      fail("table must be an object");
+    break;
+  case P_KEY:
+    if (c == '"') {
+      inString = true;
+      kind = S_NAME;
+      nameLen = 0;
+      state = P_COLON;
+    } else if (c == '}') {
+      state = P_DONE;
+    } else {
+      fail("expected location name");
+    }
+    break;
+  case P_COLON:
+    if (c == ':')
+      state = P_VALUE;
+    else
+      fail("expected ':'");
+    break;
+  case P_VALUE:
+    if (c == '[')
+      state = P_CODE;
+    else
+      fail("codes must be an array");
+    break;
+  case P_CODE:
+    if (c == '"') {
+      inString = true;
+      kind = S_CODE;
+      hash = 2166136261;
+      hash2 = 5381;
+      codeLen = 0;
+      state = P_CODE_NEXT;
+    } else if (c == '{') {
+      ai[0] = 0;
+      patternField = -1;
+      state = P_RULE_KEY;
+    } else if (c == ']') {
+      state = P_KEY_NEXT;
+    } else {
+      fail("codes must be strings or rules");
+    }
+    break;
+  case P_CODE_NEXT:
+    if (c == ',')
+      state = P_CODE;
+    else if (c == ']')
+      state = P_KEY_NEXT;
+    else
+      fail("expected ',' or ']'");
+    break;
+  case P_KEY_NEXT:
+    if (c == ',')
+      state = P_KEY;
+    else if (c == '}')
+      state = P_DONE;
+    else
+      fail("expected ',' or '}'");
+    break;
+  case P_RULE_KEY:
+    if (c == '"') {
+      inString = true;
+      kind = S_RULE_KEY;
+      textLen = 0;
+      state = P_RULE_COLON;
+    } else if (c == '}') {
+      state = P_CODE_NEXT;
+      addRule();
+    } else {
+      fail("expected rule field");
+    }
+    break;
+  case P_RULE_COLON:
+    if (c == ':')
+      state = P_RULE_VALUE;
+    else
+      fail("expected ':'");
+    break;
+  case P_RULE_VALUE:
+    if (c == '"') {
+      inString = true;
+      kind = S_RULE_VALUE;
+      textLen = 0;
+      state = P_RULE_NEXT;
+    } else {
+      fail("rule fields must be strings");
+    }
+    break;
+  case P_RULE_NEXT:
+    if (c == ',') {
+      state = P_RULE_KEY;
+    } else if (c == '}') {
+      state = P_CODE_NEXT;
+      addRule();
+    } else {
+      fail("expected ',' or '}'");
+    }
+    break;
+  case P_DONE:
+    fail("data after the table");
+    break;
+  case P_ERROR:
+    break;
+  }
+}
+
+// Feed the next chunk, values may span chunk borders
+void TableParser::feed(const uint8_t *data, size_t len) {
+  if (state == P_ERROR)
+    return;
+  if (raw && raw.write(data, len) != len)
+    fail("unable to write file");
+  for (size_t i = 0; i < len && state != P_ERROR; i++)
+    parse(data[i]);
+}
+
+// Finish the parse and close the staging files, returns error or nullptr
+const char *TableParser::end() {
+  if (!flushRecords(rec, recs, nRecs))
+    fail("unable to write file");
+  if (state != P_DONE && state != P_ERROR)
+    fail("table is incomplete");
+  rec.close();
+  if (raw)
+    raw.close();
+  return error;
+}
+
+// Write the trie at pos: all nodes, then the edges of each node in node
+// order. Every node but the roots has one incoming edge.
+bool TableParser::writeTrie(size_t pos) {
+  node_t flat[TABLE_CHUNK];
+  edge_t edges[TABLE_CHUNK];
+  uint16_t first = 0;
+  int n = 0;
+  for (int i = 0; i < hdr.nodes; i++) {
+    node_t *f = &flat[n++];
+    f->edges = first;
+    f->nEdges = 0;
+    for (uint16_t c = nodes[i].child; c != 0; c = nodes[c].next)
+      f->nEdges++;
+    first += f->nEdges;
+    f->loc = nodes[i].loc;
+    f->lits = nodes[i].lits;
+    f->loop = nodes[i].label == LABEL_STAR;
+    if (n == TABLE_CHUNK || i == hdr.nodes - 1) {
+      if (esp_partition_write(tablePart, pos, flat, n * sizeof(node_t)) !=
+          ESP_OK)
+        return false;
+      pos += n * sizeof(node_t);
+      n = 0;
+    }
+  }
+  for (int i = 0; i < hdr.nodes; i++) {
+    for (uint16_t c = nodes[i].child; c != 0; c = nodes[c].next) {
+      edges[n].label = nodes[c].label;
+      edges[n++].child = c;
+      if (n < TABLE_CHUNK)
+        continue;
+      if (esp_partition_write(tablePart, pos, edges, sizeof(edges)) != ESP_OK)
+        return false;
+      pos += sizeof(edges);
+      n = 0;
+    }
+  }
+  return n == 0 ||
+         esp_partition_write(tablePart, pos, edges, n * sizeof(edge_t)) ==
+             ESP_OK;
+}
+
+// Append records to the index slot being written
+static bool putRecords(size_t &pos, record_t *recs, int &n) {
+  size_t len = n * sizeof(record_t);
+  bool ok = n == 0 || esp_partition_write(tablePart, pos, recs, len) == ESP_OK;
+  pos += len;
+  n = 0;
+  return ok;
+}
+
+// Write records of buckets [b0, b1) to the index, ordered by bucket.
+// With b1 == b0 + 1 the bucket does not fit in RAM and records are
+// appended in file order, which is all a bucket needs.
+static bool writeBuckets(size_t &pos, File &in, const table_hdr_t &hdr,
+                         record_t *buf, uint32_t *cursor, int b0, int b1) {
+  record_t chunk[TABLE_CHUNK];
+  uint32_t base = hdr.bucket[b0];
+  bool direct = hdr.bucket[b1] - base > TABLE_BUILD;
+  int n = 0;
+  for (int b = b0; b < b1; b++)
+    cursor[b] = hdr.bucket[b] - base;
+  in.seek(0);
+  for (;;) {
+    int got = in.read((uint8_t *)chunk, sizeof(chunk)) / sizeof(record_t);
+    if (got <= 0)
+      break;
+    for (int i = 0; i < got; i++) {
+      int b = chunk[i].hash >> 24;
+      if (b < b0 || b >= b1)
+        continue;
+      if (!direct) {
+        buf[cursor[b]++] = chunk[i];
+        continue;
+      }
+      buf[n++] = chunk[i];
+      if (n == TABLE_CHUNK && !putRecords(pos, buf, n))
+        return false;
+    }
+  }
+  if (!direct)
+    n = hdr.bucket[b1] - base;
+  return putRecords(pos, buf, n);
+}
+
+// Build an index from the parsed records in the slot that is not live:
+// records grouped by bucket, sorting up to TABLE_BUILD of them in RAM per
+// pass, the rule trie, then the header. Returns the slot, -1 on failure.
+static int buildIndex(TableParser *p) {
+  table_hdr_t &hdr = p->hdr;
+  int slot = tableSlot == 0 ? 1 : 0;
+  size_t base = slot * slotSize;
+  size_t size = sizeof(hdr) + hdr.count * sizeof(record_t) +
+                trieSize(hdr.nodes);
+  uint32_t start = 0;
+  for (int b = 0; b <= TABLE_BUCKETS; b++) {
+    uint32_t count = b < TABLE_BUCKETS ? hdr.bucket[b] : 0;
+    hdr.bucket[b] = start; // Counts become start offsets
+    start += count;
+  }
+  hdr.generation = table != nullptr ? table->generation + 1 : 1;
+
+  record_t *buf = (record_t *)malloc(TABLE_BUILD * sizeof(record_t));
+  uint32_t *cursor = (uint32_t *)malloc(TABLE_BUCKETS * sizeof(uint32_t));
+  File in = LittleFS.open(TABLE_REC, FILE_READ);
+  size_t pos = base + sizeof(hdr);
+  size_t erase = (size + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+  bool ok = buf != nullptr && cursor != nullptr && in && size <= slotSize &&
+            esp_partition_erase_range(tablePart, base, erase) == ESP_OK;
+  for (int b0 = 0, b1; ok && b0 < TABLE_BUCKETS; b0 = b1) {
+    b1 = b0 + 1;
+    while (b1 < TABLE_BUCKETS &&
+           hdr.bucket[b1 + 1] - hdr.bucket[b0] <= TABLE_BUILD)
+      b1++;
+    ok = writeBuckets(pos, in, hdr, buf, cursor, b0, b1);
+  }
+  ok = ok && p->writeTrie(pos);
+  // The header goes last: until it is written the slot is not valid
+  ok = ok && esp_partition_write(tablePart, base, &hdr, sizeof(hdr)) == ESP_OK;
+  if (in)
+    in.close();
+  free(buf);
+  free(cursor);
+  LittleFS.remove(TABLE_REC);
+  return ok ? slot : -1;
+}
+
+// Map an index slot, nullptr if it does not hold a complete index
+static const table_hdr_t *mapSlot(int slot, spi_flash_mmap_handle_t *handle) {
+  const void *ptr;
+  if (esp_partition_mmap(tablePart, slot * slotSize, slotSize,
+                         SPI_FLASH_MMAP_DATA, &ptr, handle) != ESP_OK)
+    return nullptr;
+  const table_hdr_t *hdr = (const table_hdr_t *)ptr;
+  if (hdr->magic == TABLE_MAGIC && hdr->version == TABLE_VERSION &&
+      hdr->count <= (slotSize - sizeof(table_hdr_t)) / sizeof(record_t) &&
+      sizeof(table_hdr_t) + hdr->count * sizeof(record_t) +
+              trieSize(hdr->nodes) <=
+          slotSize &&
+      hdr->nodes != 1 && hdr->nodes <= TABLE_NODES &&
+      hdr->bucket[TABLE_BUCKETS] == hdr->count)
+    return hdr;
+  spi_flash_munmap(*handle);
+  return nullptr;
+}
+
+// Make a mapped slot the live index and unmap the previous one
+static void useSlot(int slot, const table_hdr_t *hdr,
+                    spi_flash_mmap_handle_t handle) {
+  xSemaphoreTake(tableLock, portMAX_DELAY);
+  bool mapped = table != nullptr;
+  spi_flash_mmap_handle_t old = tableHandle;
+  table = hdr;
+  tableRecs = (const record_t *)(hdr + 1);
+  tableNodes = (const node_t *)(tableRecs + hdr->count);
+  tableEdges = (const edge_t *)(tableNodes + hdr->nodes);
+  tableHandle = handle;
+  tableSlot = slot;
+  xSemaphoreGive(tableLock);
+  if (mapped)
+    spi_flash_munmap(old);
+  lastRead = getTime();
+  LOGI("Table opened! %u codes, %u rules, %u locations",
+       (unsigned)table->count, (unsigned)table->rules, (unsigned)table->nLocs);
+}
+
+// Switch to a newly built slot, and to the uploaded table.json with it
+static bool swapTable(int slot, bool raw) {
+  spi_flash_mmap_handle_t handle;
+  const table_hdr_t *hdr = mapSlot(slot, &handle);
+  if (hdr == nullptr)
+    return false;
+  useSlot(slot, hdr, handle);
+  if (raw)
+    LittleFS.rename(TABLE_UP, TABLE_JSON); // Replaces the old file
+  return true;
+}
+
+// Build the index from table.json, for the first boot after an upload of
+// the file system image
+static void indexJson() {
+  File file = LittleFS.open(TABLE_JSON, FILE_READ);
+  if (!file) {
+    LOGE("ERROR: There was an error opening table file");
+    return;
+  }
+  LOGI("Indexing table.json");
+  TableParser *p = new TableParser();
+  if (p->begin(false)) {
+    uint8_t chunk[256];
+    size_t len;
+    while ((len = file.read(chunk, sizeof(chunk))) > 0)
+      p->feed(chunk, len);
+  }
+  file.close();
+  const char *msg = p->end();
+  int slot = msg == nullptr ? buildIndex(p) : -1;
+  if (msg != nullptr)
+    LOGE("ERROR: table.json: %s", msg);
+  else if (slot < 0 || !swapTable(slot, false))
+    LOGE("ERROR: unable to build table index");
+  delete p;
+}
+
+// Map the live index at boot, building it from table.json when there is
+// none. An upload that was not swapped in completely is indexed again.
+void readTable() {
+  tableLock = xSemaphoreCreateMutex();
+  tablePart = esp_partition_find_first(
+      ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)TABLE_SUBTYPE, "table");
+  if (tablePart == nullptr) {
+    LOGE("ERROR: no table partition");
+    return;
+  }
+  slotSize = tablePart->size / 2;
+  if (LittleFS.exists(TABLE_UP)) {
+    LittleFS.rename(TABLE_UP, TABLE_JSON);
+    indexJson();
+    return;
+  }
+  int best = -1;
+  const table_hdr_t *hdr[2];
+  spi_flash_mmap_handle_t handle[2];
+  for (int slot = 0; slot < 2; slot++) {
+    hdr[slot] = mapSlot(slot, &handle[slot]);
+    if (hdr[slot] != nullptr &&
+        (best < 0 || hdr[slot]->generation > hdr[best]->generation))
+      best = slot;
+  }
+  for (int slot = 0; slot < 2; slot++) {
+    if (hdr[slot] != nullptr && slot != best)
+      spi_flash_munmap(handle[slot]);
+  }
+  if (best >= 0)
+    useSlot(best, hdr[best], handle[best]);
+  else
+    indexJson();
+}
+
+// Start receiving an upload, false if one is already in progress
+bool beginTableUpload(void *owner) {
+  if (upload != nullptr || tablePending != nullptr || tablePart == nullptr)
+    return false;
+  upload = new TableParser();
+  if (!upload->begin(true)) {
+    upload->end();
+    delete upload;
+    upload = nullptr;
+    return false;
+  }
+  upload->owner = owner;
+  return true;
+}
+
+// Parse the next chunk of an upload
+void feedTableUpload(void *owner, const uint8_t *data, size_t len) {
+  if (upload != nullptr && upload->owner == owner)
+    upload->feed(data, len);
+}
+
+// Complete an upload: on success the index is built by checkTable()
+const char *endTableUpload(void *owner, uint32_t *codes, int *locs) {
+  if (upload == nullptr || upload->owner != owner)
+    return "another upload is in progress";
+  const char *msg = upload->end();
+  *codes = upload->hdr.count;
+  *locs = upload->hdr.nLocs;
+  size_t size = sizeof(table_hdr_t) + *codes * sizeof(record_t) +
+                trieSize(upload->hdr.nodes);
+  if (msg == nullptr && size > slotSize)
+    msg = "table too large";
+  if (msg != nullptr) {
+    delete upload;
+    LittleFS.remove(TABLE_UP);
+    LittleFS.remove(TABLE_REC);
+  } else {
+    tablePending = upload;
+  }
+  upload = nullptr;
+  return msg;
+}
+
+// Drop an upload whose client went away before the body was complete
+void abortTableUpload(void *owner) {
+  if (upload == nullptr || upload->owner != owner)
+    return;
+  upload->end();
+  delete upload;
+  upload = nullptr;
+  LittleFS.remove(TABLE_UP);
+  LittleFS.remove(TABLE_REC);
+}
+
+// Build the index of a completed upload and swap it in, from loop()
+void checkTable() {
+  TableParser *p = tablePending;
+  if (p == nullptr)
+    return;
+  unsigned long start = millis();
+  int slot = buildIndex(p);
+  if (slot >= 0 && swapTable(slot, true))
+    LOGI("Table indexed in %lu ms", millis() - start);
+  else
+    LOGE("ERROR: unable to build table index");
+  tablePending = nullptr;
+  delete p;
+}
+
+// Trie states followed at once. The bitmap holds every state and keeps
+// duplicates out; the first TABLE_ACTIVE are also listed, so the usual
+// few states are walked without scanning it. Past that the set spills
+// and is walked from the bitmap.
+typedef struct {
+  uint16_t node[TABLE_ACTIVE];
+  int n; // States in the set, listed or not
+  uint32_t bits[TABLE_NODES / 32];
+} trie_set_t;
+
+// The two sets of matchRules(), only used under tableLock. Empty between
+// lookups, so a lookup clears what it set instead of the whole bitmap.
+static trie_set_t trieSets[2];
+
+// Edge of a node by label, binary search over the sorted edges
+static const edge_t *findEdge(const node_t *node, uint16_t label) {
+  const edge_t *lo = tableEdges + node->edges, *hi = lo + node->nEdges;
+  while (lo < hi) {
+    const edge_t *mid = lo + (hi - lo) / 2;
+    if (mid->label == label)
+      return mid;
+    if (mid->label < label)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return nullptr;
+}
+
+// Make a node active, with the node after its * edge since * may match
+// nothing
+static void enterNode(trie_set_t &set, uint16_t node) {
+  uint32_t *word = &set.bits[node >> 5], bit = 1UL << (node & 31);
+  if (*word & bit)
+    return;
+  *word |= bit;
+  if (set.n < TABLE_ACTIVE)
+    set.node[set.n] = node;
+  set.n++;
+  const node_t *n = &tableNodes[node];
+  if (n->nEdges > 0 && tableEdges[n->edges + n->nEdges - 1].label == LABEL_STAR)
+    enterNode(set, tableEdges[n->edges + n->nEdges - 1].child);
+}
+
+// State of a set at or after position i, -1 past the last one
+static int nextNode(const trie_set_t &set, int &i) {
+  if (set.n <= TABLE_ACTIVE)
+    return i < set.n ? set.node[i++] : -1;
+  while (i < table->nodes) {
+    uint32_t word = set.bits[i >> 5] >> (i & 31);
+    if (word == 0) {
+      i = (i | 31) + 1;
+      continue;
+    }
+    i += __builtin_ctz(word);
+    return i++;
+  }
+  return -1;
+}
+
+// Empty a set: the listed states bit by bit, a spilled set word by word
+static void clearNodes(trie_set_t &set) {
+  if (set.n > TABLE_ACTIVE) {
+    memset(set.bits, 0, (table->nodes + 31) / 32 * sizeof(uint32_t));
+  } else {
+    for (int i = 0; i < set.n; i++)
+      set.bits[set.node[i] >> 5] &= ~(1UL << (set.node[i] & 31));
+  }
+  set.n = 0;
+}
+
+// Advance all active states by one byte into the other set
+static void stepNodes(trie_set_t *&set, trie_set_t *&next, uint8_t c) {
+  for (int i = 0, node; (node = nextNode(*set, i)) >= 0;) {
+    const node_t *n = &tableNodes[node];
+    const edge_t *e;
+    if (n->loop)
+      enterNode(*next, node);
+    if ((e = findEdge(n, c)) != nullptr)
+      enterNode(*next, e->child);
+    if ((e = findEdge(n, LABEL_ANY)) != nullptr)
+      enterNode(*next, e->child);
+  }
+  clearNodes(*set);
+  trie_set_t *done = set;
+  set = next;
+  next = done;
+}
+
+// Walk key and then value from a trie root, returns the best of the rules
+// matching there and best: more literal bytes, then the earlier rule
+static const node_t *matchRules(uint16_t root, const char *key,
+                                const char *value, size_t len,
+                                const node_t *best) {
+  trie_set_t *set = &trieSets[0], *next = &trieSets[1];
+  enterNode(*set, root);
+  for (; *key != 0 && set->n > 0; key++)
+    stepNodes(set, next, *key);
+  for (size_t i = 0; i < len && set->n > 0; i++)
+    stepNodes(set, next, value[i]);
+  for (int i = 0, node; (node = nextNode(*set, i)) >= 0;) {
+    const node_t *n = &tableNodes[node];
+    if (n->loc != LOC_NONE &&
+        (best == nullptr || n->lits > best->lits ||
+         (n->lits == best->lits && n < best)))
+      best = n;
+  }
+  clearNodes(*set);
+  return best;
+}
+
+// Location of the best rule for a code: on the whole code, then on each
+// of its GS1 fields as "ai)value"
+static const char *findRule(const char *code, size_t len,
+                            const Gs1Parser *gs1) {
+  const node_t *best = matchRules(ROOT_CODE, "", code, len, nullptr);
+  for (int i = 0; i < gs1->n; i++) {
+    const gs1_field_t *f = &gs1->field[i];
+    char key[6];
+    snprintf(key, sizeof(key), "%s)", f->ai);
+    best = matchRules(ROOT_GS1, key, f->value, f->len, best);
+  }
+  return best != nullptr ? table->names[best->loc] : nullptr;
+}
+
+// Location of an exact code hash, nullptr if the table has none
+static const char *findRecord(uint32_t hash, uint32_t hash2, size_t len) {
+  uint16_t check = checkOf(hash2, len);
+  const record_t *r = tableRecs + table->bucket[hash >> 24];
+  const record_t *end = tableRecs + table->bucket[(hash >> 24) + 1];
+  for (; r < end; r++) {
+    if (r->hash == hash && r->check == check)
+      return table->names[r->loc];
+  }
+  return nullptr;
+}
+
+// Location of a key field listed as "(ai)value", tried in gs1Keys order
+static const char *findKey(const Gs1Parser *gs1) {
+  const config_t *c = holdConfig();
+  const char *name = nullptr;
+  for (int k = 0; k < c->nGs1Keys && name == nullptr; k++) {
+    const gs1_field_t *f = gs1->find(c->gs1Keys[k]);
+    if (f == nullptr)
+      continue;
+    uint32_t hash = 2166136261, hash2 = 5381;
+    size_t aiLen = strlen(f->ai);
+    hashStep(hash, hash2, '(');
+    for (size_t i = 0; i < aiLen; i++)
+      hashStep(hash, hash2, f->ai[i]);
+    hashStep(hash, hash2, ')');
+    for (int i = 0; i < f->len; i++)
+      hashStep(hash, hash2, f->value[i]);
+    name = findRecord(hash, hash2, aiLen + 2 + f->len);
+  }
+  releaseConfig(c);
+  return name;
+}
+
+// Look up the location name of a scanned code, empty if it is unknown:
+// the code itself, then its GS1 key fields, then rules. gs1 holds the
+// fields when the caller has parsed them already. Records and rules are
+// read straight from mapped flash; the name is copied into loc
+// (PIN_NAME bytes) before the lock is released, since a swap may unmap
+// the index right after.
+JsonString findInTable(JsonString x, char *loc, const Gs1Parser *gs1) {
+  uint32_t hash = 2166136261, hash2 = 5381;
+  for (size_t i = 0; i < x.size(); i++)
+    hashStep(hash, hash2, x.c_str()[i]);
+  const char *name = nullptr;
+  Gs1Parser parsed;
+  metrics.lookups++;
+  if (gs1 == nullptr) {
+    parsed.parse(x.c_str(), x.size());
+    gs1 = &parsed;
+  }
+
+  xSemaphoreTake(tableLock, portMAX_DELAY);
+  if (table != nullptr) {
+    name = findRecord(hash, hash2, x.size());
+    if (name == nullptr && gs1->n > 0)
+      name = findKey(gs1);
+    if (name == nullptr && table->nodes > 0)
+      name = findRule(x.c_str(), x.size(), gs1);
+  }
+  strlcpy(loc, name != nullptr ? name : "", PIN_NAME);
+  xSemaphoreGive(tableLock);
+
+  if (name == nullptr)
+    metrics.misses++;
+  return JsonString(loc);
+}
+
+// Table size for the API
+void tableJson(JsonObject json) {
+  xSemaphoreTake(tableLock, portMAX_DELAY);
+  json["codes"] = table != nullptr ? table->count : 0;
+  json["rules"] = table != nullptr ? table->rules : 0;
+  json["locations"] = table != nullptr ? table->nLocs : 0;
+  xSemaphoreGive(tableLock);
+  json["capacity"] = slotSize > sizeof(table_hdr_t)
+                         ? (slotSize - sizeof(table_hdr_t)) / sizeof(record_t)
+                         : 0;
+  json["r"] = lastRead;
+  json["pending"] = tablePending != nullptr;
+}
@@ -0,0 +1,123 @@
+/*
+ * PutToLight - Task Placement Module
+ *
+ * Copyright (c) 2023 Serhii Nesterenko
+ * Licensed under the MIT License. See LICENSE file in the project root.
+ *
+ * Our tasks are created with the core, priority and stack size from the
+ * "tasks" section of config.json. The load of each core is sampled with
+ * every status update, so the layout can be tuned from measured load.
+ * async_tcp and loopTask are created by the libraries; their core is
+ * fixed at build time.
+ *
+ * Core loads come from the idle tasks. An idle hook on each core notes
+ * when its idle loop is about to wait for an interrupt, and the tick hook
+ * of the core adds the time since then while the idle task still holds
+ * the core, so the wait itself is kept. A task woken by an interrupt
+ * other than the tick makes the idle loop start a new wait once it
+ * blocks, so the time it ran is never counted; the wait before such a
+ * wake is lost too, at most one tick each, which reads a core that
+ * serves many interrupts as slightly busier than it is. CPU time per
+ * task needs the FreeRTOS run time counters, which the prebuilt Arduino
+ * core leaves out, so only core loads are reported.
+ */
+
+#include "ptl.hpp"
+#include <esp_freertos_hooks.h>
+
+// Names of our tasks, by TaskId
+const char *const taskNames[TASKS] = {"BT", "Blink", "Forward", "Log"};
+
+// Create one of our tasks as configured, nullptr if it failed
+TaskHandle_t startTask(TaskId id, TaskFunction_t code) {
+  const config_t *c = holdConfig();
+  task_cfg_t t = c->tasks[id]; // Copied, the task may outlive the config
+  releaseConfig(c);
+  TaskHandle_t handle = nullptr;
+  BaseType_t core = t.core < 0 ? tskNO_AFFINITY : t.core;
+  if (xTaskCreatePinnedToCore(code, taskNames[id], t.stack, NULL, t.priority,
+                              &handle, core) != pdPASS) {
+    LOGE("%s task not created", taskNames[id]);
+    return nullptr;
+  }
+  LOGD("%s task on core %d, priority %d", taskNames[id], t.core, t.priority);
+  return handle;
+}
+
+// Idle time of each core (cycles), counted by its tick hook. Wraps after
+// 2^32 cycles, 17 s at 240 MHz, well over the status interval.
+static volatile uint32_t idleCycles[2];
+static volatile uint32_t idleFrom[2]; // Cycle count the wait began, 0 if busy
+uint16_t coreLoad[2] = {0, 0}; // Busy share of each core (0.1 %)
+bool cpuSampled = false;       // coreLoad holds a sample
+portMUX_TYPE cpuMux = portMUX_INITIALIZER_UNLOCKED; // Guards the sample
+
+// Idle loop of a core about to wait for an interrupt
+static bool idleHook0() {
+  idleFrom[0] = ESP.getCycleCount() | 1; // Of this core, never 0
+  return true; // Wait
+}
+static bool idleHook1() {
+  idleFrom[1] = ESP.getCycleCount() | 1;
+  return true;
+}
+
+// Tick on a core: if its idle task still holds it, the core waited since
+// the idle loop began the wait or since the previous tick
+static inline void IRAM_ATTR idleTick(int core) {
+  if (xTaskGetCurrentTaskHandleForCPU(core) !=
+      xTaskGetIdleTaskHandleForCPU(core)) {
+    idleFrom[core] = 0; // Busy, the idle loop restarts the wait
+    return;
+  }
+  uint32_t now = ESP.getCycleCount() | 1;
+  if (idleFrom[core] != 0)
+    idleCycles[core] += now - idleFrom[core];
+  idleFrom[core] = now;
+}
+static void IRAM_ATTR tickHook0() { idleTick(0); }
+static void IRAM_ATTR tickHook1() { idleTick(1); }
+
+// Busy share of each core since the previous call; the first call starts
+// the hooks
+static void sampleCores() {
+  static int64_t lastUs;
+  static uint32_t lastIdle[2];
+  int64_t now = esp_timer_get_time();
+  if (lastUs == 0) {
+    if (esp_register_freertos_idle_hook_for_cpu(idleHook0, 0) != ESP_OK ||
+        esp_register_freertos_idle_hook_for_cpu(idleHook1, 1) != ESP_OK ||
+        esp_register_freertos_tick_hook_for_cpu(tickHook0, 0) != ESP_OK ||
+        esp_register_freertos_tick_hook_for_cpu(tickHook1, 1) != ESP_OK)
+      LOGE("CPU load hooks not registered");
+  } else {
+    uint64_t cycles = (now - lastUs) * ESP.getCpuFreqMHz();
+    uint16_t load[2];
+    for (int c = 0; c < 2; c++) {
+      uint32_t idle = idleCycles[c] - lastIdle[c];
+      load[c] = cycles == 0 ? 0 : 1000 - min(1000ULL, idle * 1000ULL / cycles);
+    }
+    portENTER_CRITICAL(&cpuMux);
+    memcpy(coreLoad, load, sizeof(coreLoad));
+    cpuSampled = true;
+    portEXIT_CRITICAL(&cpuMux);
+  }
+  lastUs = now;
+  for (int c = 0; c < 2; c++)
+    lastIdle[c] = idleCycles[c];
+}
+
+// Take core loads since the previous call, from loop()
+void sampleCpu() { sampleCores(); }
+
+// Report core loads
+void cpuJson(JsonObject json) {
+  portENTER_CRITICAL(&cpuMux);
+  bool sampled = cpuSampled;
+  uint16_t core0 = coreLoad[0], core1 = coreLoad[1];
+  portEXIT_CRITICAL(&cpuMux);
+  if (!sampled)
+    return; // No sample yet
+  json["core0"] = core0 / 10.0;
+  json["core1"] = core1 / 10.0;
+}
@@ -0,0 +1,261 @@
+/*
+ * PutToLight - WebSocket Channel Module
+ *
+ * Copyright (c) 2023 Serhii Nesterenko
+ * Licensed under the MIT License. See LICENSE file in the project root.
+ *
+ * Messages are JSON text frames in both directions:
+ *   command  {"id": 1, "cmd": "blink", "pin": 5}
+ *   ack      {"ack": 1, "ok": true}
+ *   event    {"ev": "scan", "data": {...}}
+ *
+ * A client that sent {"cmd": "tail", "on": true} also gets every log
+ * message as a "log" event.
+ *
+ * Clients connect and go away in async_tcp, while events are sent from
+ * loop() and log lines from the Log task. wsLock guards the client table
+ * and every walk over the library's client list outside async_tcp.
+ */
+
+#include "ptl.hpp"
+#include <ESPAsyncWebServer.h>
+
+#define WS_MAX_CLIENTS 12 // Concurrent WebSocket clients
+#define WS_MAX_MSG 2048   // Largest accepted command
+#define WS_EVENT "{\"ev\":\"%s\",\"data\":%s}" // Event message format
+#define WS_EVENT_BUFFERS 28 // Event buffers of all sizes
+
+AsyncWebSocket ws("/ws");
+
+// Connected client ids, needed to find clients with full send queues
+uint32_t wsClients[WS_MAX_CLIENTS];
+bool wsTail[WS_MAX_CLIENTS]; // Client follows the log
+int nWsClients = 0;
+int nWsTail = 0; // Clients following the log
+SemaphoreHandle_t wsLock; // Guards the client table and ws.client()
+
+// Event messages, allocated once at boot. The library keeps a buffer until
+// every client has sent it and always sends all of it; only reserve()
+// changes its length, by reallocating. So buffers come in sizes about 1.5
+// times apart, and a message takes the smallest free one it fits, padded
+// with spaces by less than half its own length.
+typedef struct {
+  uint16_t len;  // Buffer length (bytes)
+  uint8_t count; // Buffers of this length
+} ws_size_t;
+
+const ws_size_t wsSizes[] = {{64, 4},  {96, 4},  {128, 4},
+                             {192, 4}, {256, 4}, {384, 2},
+                             {512, 2}, {768, 2}, {1056, 2}};
+AsyncWebSocketMessageBuffer *wsBuffers[WS_EVENT_BUFFERS]; // Shortest first
+
+// Remember a new client, false when all slots are taken
+bool addClient(uint32_t id) {
+  if (nWsClients >= WS_MAX_CLIENTS)
+    return false;
+  wsTail[nWsClients] = false;
+  wsClients[nWsClients++] = id;
+  return true;
+}
+
+// Start or stop sending log messages to a client
+void setTail(uint32_t id, bool on) {
+  for (int i = 0; i < nWsClients; i++) {
+    if (wsClients[i] == id && wsTail[i] != on) {
+      wsTail[i] = on;
+      nWsTail += on ? 1 : -1;
+    }
+  }
+}
+
+// Forget a disconnected client
+void removeClient(uint32_t id) {
+  setTail(id, false);
+  for (int i = 0; i < nWsClients; i++) {
+    if (wsClients[i] == id) {
+      wsClients[i] = wsClients[--nWsClients];
+      wsTail[i] = wsTail[nWsClients];
+      return;
+    }
+  }
+}
+
+// Shortest free event buffer for a message of len bytes, nullptr while all
+// that are long enough still wait in client queues
+AsyncWebSocketMessageBuffer *takeBuffer(size_t len) {
+  for (int i = 0; i < WS_EVENT_BUFFERS; i++) {
+    if (len <= wsBuffers[i]->length() && wsBuffers[i]->canDelete())
+      return wsBuffers[i];
+  }
+  return nullptr;
+}
+
+// Send command result back to the client that issued it
+void sendAck(AsyncWebSocketClient *client, int id, bool ok, const char *msg) {
+  char ack[96];
+  if (msg != nullptr)
+    snprintf(ack, sizeof(ack), "{\"ack\":%d,\"ok\":%s,\"msg\":\"%s\"}", id,
+             ok ? "true" : "false", msg);
+  else
+    snprintf(ack, sizeof(ack), "{\"ack\":%d,\"ok\":%s}", id,
+             ok ? "true" : "false");
+  client->text(ack);
+}
+
+// Run one command, returns error message or nullptr on success
+const char *runCommand(JsonObject json) {
+  const char *cmd = json["cmd"] | "";
+  if (strcmp(cmd, "blink") == 0) {
+    blinkPin(json["pin"] | NUM_PINS);
+  } else if (strcmp(cmd, "blinkBatch") == 0) {
+    channel_t frame[NUM_PINS];
+    unsigned long now = millis();
+    memset(frame, 0, sizeof(frame));
+    for (JsonVariant entry : json["entries"].as<JsonArray>()) {
+      if (!applyEntry(entry, frame, now))
+        return "bad entry";
+    }
+    blinkFrame(frame);
+  } else if (strcmp(cmd, "setDevice") == 0) {
+    setDevice(json);
+  } else if (strcmp(cmd, "session") == 0) {
+    // The order has an id of its own, so it travels in a nested object
+    if (!startSession(json["order"]))
+      return "bad order";
+  } else if (strcmp(cmd, "stopSession") == 0) {
+    stopSession();
+  } else if (strcmp(cmd, "selftest") == 0) {
+    if (!startSelfTest())
+      return "test running";
+  } else if (strcmp(cmd, "setTime") == 0) {
+    if (!pushTime(json["t"] | 0UL))
+      return "bad time";
+  } else if (strcmp(cmd, "writeConfig") == 0) {
+    const char *msg = saveConfig(json["config"].as<JsonObject>());
+    if (msg != nullptr)
+      return msg;
+    if (json["reboot"] == true)
+      requestRestart();
+  } else {
+    return "unknown command";
+  }
+  return nullptr;
+}
+
+// Parsed command, allocated once; messages are handled in async_tcp only
+DynamicJsonDocument wsCommand(2 * WS_MAX_MSG);
+
+// Handle a complete text message from a client
+void handleMessage(AsyncWebSocketClient *client, uint8_t *data, size_t len) {
+  if (deserializeJson(wsCommand, (char *)data, len)) {
+    sendAck(client, -1, false, "bad json");
+    return;
+  }
+  const char *msg = nullptr;
+  if (wsCommand["cmd"] == "tail") { // Per client, not a device command
+    xSemaphoreTake(wsLock, portMAX_DELAY);
+    setTail(client->id(), wsCommand["on"] | true);
+    xSemaphoreGive(wsLock);
+  } else {
+    msg = runCommand(wsCommand.as<JsonObject>());
+  }
+  sendAck(client, wsCommand["id"] | -1, msg == nullptr, msg);
+}
+
+// WebSocket event handler
+void onWsEvent(AsyncWebSocket *server, AsyncWebSocketClient *client,
+               AwsEventType type, void *arg, uint8_t *data, size_t len) {
+  if (type == WS_EVT_CONNECT) {
+    xSemaphoreTake(wsLock, portMAX_DELAY);
+    bool added = addClient(client->id());
+    xSemaphoreGive(wsLock);
+    if (!added) {
+      LOGW("WS: too many clients");
+      client->close(1013); // Try again later
+      return;
+    }
+    client->text("{\"ev\":\"open\"}");
+  } else if (type == WS_EVT_DISCONNECT) {
+    xSemaphoreTake(wsLock, portMAX_DELAY);
+    removeClient(client->id());
+    xSemaphoreGive(wsLock);
+  } else if (type == WS_EVT_DATA) {
+    AwsFrameInfo *info = (AwsFrameInfo *)arg;
+    // Commands are small, accept single-frame text messages only
+    if (!info->final || info->index != 0 || info->len != len ||
+        info->opcode != WS_TEXT || len > WS_MAX_MSG) {
+      sendAck(client, -1, false, "message too large");
+      return;
+    }
+    handleMessage(client, data, len);
+  }
+}
+
+// Broadcast an event to all clients, dropping the ones that fall behind
+void wsEvent(const char *data, const char *event) {
+  if (nWsClients == 0)
+    return;
+  xSemaphoreTake(wsLock, portMAX_DELAY);
+  // A client whose bounded queue is full is too slow, disconnect it
+  for (int i = 0; i < nWsClients; i++) {
+    AsyncWebSocketClient *client = ws.client(wsClients[i]);
+    if (client != nullptr && client->queueIsFull()) {
+      LOGW("WS: dropping slow client %u", client->id());
+      client->close(1008);
+    }
+  }
+  // One shared buffer for all clients instead of a copy per client
+  size_t len = snprintf(nullptr, 0, WS_EVENT, event, data);
+  AsyncWebSocketMessageBuffer *buffer = takeBuffer(len);
+  if (buffer != nullptr) {
+    char *msg = (char *)buffer->get();
+    snprintf(msg, len + 1, WS_EVENT, event, data);
+    memset(msg + len, ' ', buffer->length() - len); // JSON whitespace
+    ws.textAll(buffer);
+  } else {
+    metrics.wsDropped++;
+  }
+  xSemaphoreGive(wsLock);
+}
+
+// Send a log message to the clients tailing the log, from the drain task.
+// Clients with a full queue are skipped, the log must not stall.
+void wsLog(unsigned long ms, uint8_t level, const char *text) {
+  if (nWsTail == 0)
+    return;
+  StaticJsonDocument<LOG_LINE + 96> json;
+  char msg[2 * LOG_LINE + 64];
+  char name[2] = {"EWID"[level], 0}; // Copied into the document
+  json["ev"] = "log";
+  JsonObject data = json.createNestedObject("data");
+  data["ms"] = ms;
+  data["l"] = name;
+  data["m"] = text;
+  serializeJson(json, msg, sizeof(msg));
+  xSemaphoreTake(wsLock, portMAX_DELAY);
+  for (int i = 0; i < nWsClients; i++) {
+    AsyncWebSocketClient *client = ws.client(wsClients[i]);
+    if (wsTail[i] && client != nullptr && !client->queueIsFull())
+      client->text(msg);
+  }
+  xSemaphoreGive(wsLock);
+}
+
+// Free resources of closed clients, called from the main loop
+void wsCleanup() {
+  xSemaphoreTake(wsLock, portMAX_DELAY);
+  ws.cleanupClients(WS_MAX_CLIENTS);
+  xSemaphoreGive(wsLock);
+}
+
+// Register /ws endpoint
+void initWs(AsyncWebServer &server) {
+  wsLock = xSemaphoreCreateMutex();
+  int n = 0;
+  for (const ws_size_t &size : wsSizes) {
+    for (int i = 0; i < size.count && n < WS_EVENT_BUFFERS; i++)
+      wsBuffers[n++] = new AsyncWebSocketMessageBuffer(size.len);
+  }
+  ws.onEvent(onWsEvent);
+  server.addHandler(&ws);
+}
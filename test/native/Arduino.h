@@ -0,0 +1,154 @@
+/*
+ * PutToLight - Host Arduino Core
+ *
+ * Copyright (c) 2023 Serhii Nesterenko
+ * Licensed under the MIT License. See LICENSE file in the project root.
+ *
+ * Just enough of the Arduino core and of FreeRTOS for the firmware modules
+ * built by [env:native] to run as host unit tests. Everything runs in one
+ * thread: critical sections and mutexes do nothing, queues never block,
+ * and time only moves when a test, delay() or vTaskDelay() moves it.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <climits>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctype.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+using std::max;
+using std::min;
+
+typedef std::string String;
+
+#define SDA 21 // Default I2C pins of the board
+#define SCL 22
+#define constrain(x, lo, hi) ((x) < (lo) ? (lo) : ((x) > (hi) ? (hi) : (x)))
+
+// Fake clock, moved by the tests
+inline unsigned long hostMillis = 0;
+
+inline unsigned long millis() { return hostMillis; }
+inline unsigned long micros() { return hostMillis * 1000UL; }
+inline void delay(unsigned long ms) { hostMillis += ms; }
+
+// ESP-IDF error codes
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+
+// strlcpy() is missing from older glibc
+#if defined(__GLIBC__) && (__GLIBC__ < 2 || __GLIBC_MINOR__ < 38)
+inline size_t strlcpy(char *dst, const char *src, size_t size) {
+  size_t len = strlen(src);
+  if (size > 0) {
+    size_t n = len < size - 1 ? len : size - 1;
+    memcpy(dst, src, n);
+    dst[n] = 0;
+  }
+  return len;
+}
+#endif
+
+// IPv4 address
+class IPAddress {
+public:
+  IPAddress() : addr(0) {}
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+      : addr(a | b << 8 | c << 16 | (uint32_t)d << 24) {}
+  IPAddress(uint32_t a) : addr(a) {}
+  operator uint32_t() const { return addr; }
+  uint8_t operator[](int i) const { return addr >> (8 * i); }
+  bool fromString(const char *s) {
+    unsigned b[4];
+    char end;
+    if (sscanf(s, "%u.%u.%u.%u%c", &b[0], &b[1], &b[2], &b[3], &end) != 4 ||
+        b[0] > 255 || b[1] > 255 || b[2] > 255 || b[3] > 255)
+      return false;
+    *this = IPAddress(b[0], b[1], b[2], b[3]);
+    return true;
+  }
+  String toString() const {
+    char s[16];
+    snprintf(s, sizeof(s), "%u.%u.%u.%u", (*this)[0], (*this)[1], (*this)[2],
+             (*this)[3]);
+    return s;
+  }
+
+private:
+  uint32_t addr; // Network byte order, as on the ESP32
+};
+
+// FreeRTOS tasks, all of them the test itself
+typedef void *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define pdFAIL 0
+#define portMAX_DELAY 0xffffffffUL
+#define portTICK_PERIOD_MS 1
+#define tskNO_AFFINITY 0x7fffffff
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+
+inline void vTaskDelay(TickType_t ticks) { hostMillis += ticks; }
+inline TickType_t xTaskGetTickCount() { return hostMillis; }
+inline TaskHandle_t xTaskGetCurrentTaskHandle() { return nullptr; }
+inline BaseType_t xPortGetCoreID() { return 0; }
+inline void xTaskNotifyGive(TaskHandle_t) {}
+inline uint32_t ulTaskNotifyTake(BaseType_t, TickType_t) { return 0; }
+
+// Critical sections and mutexes, nothing to exclude
+typedef int portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define portENTER_CRITICAL(mux) ((void)(mux))
+#define portEXIT_CRITICAL(mux) ((void)(mux))
+
+typedef void *SemaphoreHandle_t;
+inline SemaphoreHandle_t xSemaphoreCreateMutex() {
+  static int mutex;
+  return &mutex;
+}
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t, TickType_t) {
+  return pdTRUE;
+}
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t) { return pdTRUE; }
+
+// Queues, copied items in a deque; full or empty queues fail at once
+struct HostQueue {
+  size_t length, size;
+  std::deque<std::vector<uint8_t>> items;
+};
+typedef HostQueue *QueueHandle_t;
+
+inline QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t size) {
+  return new HostQueue{length, size, {}};
+}
+inline BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t) {
+  if (q->items.size() >= q->length)
+    return pdFALSE;
+  const uint8_t *p = (const uint8_t *)item;
+  q->items.emplace_back(p, p + q->size);
+  return pdTRUE;
+}
+inline BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t) {
+  if (q->items.empty())
+    return pdFALSE;
+  memcpy(item, q->items.front().data(), q->size);
+  q->items.pop_front();
+  return pdTRUE;
+}
+inline UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q) {
+  return q->items.size();
+}
@@ -0,0 +1,203 @@
+/*
+ * PutToLight - Host WebSocket Server
+ *
+ * Copyright (c) 2023 Serhii Nesterenko
+ * Licensed under the MIT License. See LICENSE file in the project root.
+ *
+ * Just enough of ESPAsyncWebServer for the WebSocket module. The test
+ * connects clients and delivers their messages; a buffer sent to a client
+ * waits in its queue until the test calls sendQueued(). Buffers are
+ * allocated with new, as the library allocates them, and released the
+ * way it does, so a test can count what the firmware makes it allocate.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <functional>
+#include <list>
+
+#define WS_MAX_QUEUED_MESSAGES 8
+
+typedef enum {
+  WS_EVT_CONNECT,
+  WS_EVT_DISCONNECT,
+  WS_EVT_PONG,
+  WS_EVT_ERROR,
+  WS_EVT_DATA
+} AwsEventType;
+
+typedef enum {
+  WS_CONTINUATION,
+  WS_TEXT,
+  WS_BINARY,
+  WS_DISCONNECT = 0x08,
+  WS_PING,
+  WS_PONG
+} AwsFrameType;
+
+typedef struct {
+  uint8_t message_opcode;
+  uint32_t num;
+  uint8_t final;
+  uint8_t masked;
+  uint8_t opcode;
+  uint64_t len;
+  uint8_t mask[4];
+  uint64_t index;
+} AwsFrameInfo;
+
+// Message data shared by all clients it is queued at
+class AsyncWebSocketMessageBuffer {
+public:
+  explicit AsyncWebSocketMessageBuffer(size_t size)
+      : _data(new uint8_t[size + 1]), _len(size) {
+    _data[size] = 0;
+  }
+  AsyncWebSocketMessageBuffer(const AsyncWebSocketMessageBuffer &) = delete;
+  ~AsyncWebSocketMessageBuffer() { delete[] _data; }
+  void operator++(int) { _count++; }
+  void operator--(int) {
+    if (_count > 0)
+      _count--;
+  }
+  void lock() { _lock = true; }
+  void unlock() { _lock = false; }
+  uint8_t *get() { return _data; }
+  size_t length() { return _len; }
+  uint32_t count() { return _count; }
+  bool canDelete() { return !_count && !_lock; }
+
+private:
+  uint8_t *_data;
+  size_t _len;
+  bool _lock = false;
+  uint32_t _count = 0; // Clients still to send it
+};
+
+class AsyncWebSocket;
+
+class AsyncWebSocketClient {
+public:
+  explicit AsyncWebSocketClient(uint32_t id) : _id(id) {}
+  uint32_t id() { return _id; }
+  bool queueIsFull() { return queued >= WS_MAX_QUEUED_MESSAGES; }
+  void close(uint16_t code = 0) { closed = code != 0 ? code : 1000; }
+
+  // Copied by the library, sent at once
+  void text(const char *message) {
+    strlcpy(lastText, message, sizeof(lastText));
+  }
+
+  // Queued holding the buffer, dropped when the queue is full
+  void text(AsyncWebSocketMessageBuffer *buffer) {
+    if (queueIsFull())
+      return;
+    (*buffer)++;
+    queue[queued++] = buffer;
+  }
+
+  // Host side: every queued message was sent and acknowledged
+  void sendQueued() {
+    for (size_t i = 0; i < queued; i++)
+      (*queue[i])--;
+    queued = 0;
+  }
+
+  uint16_t closed = 0;     // Close code, 0 while connected
+  char lastText[128] = ""; // Last message copied, acks and replies
+  size_t queued = 0;       // Messages waiting in queue
+  AsyncWebSocketMessageBuffer *queue[WS_MAX_QUEUED_MESSAGES];
+
+private:
+  uint32_t _id;
+};
+
+typedef std::function<void(AsyncWebSocket *server,
+                           AsyncWebSocketClient *client, AwsEventType type,
+                           void *arg, uint8_t *data, size_t len)>
+    AwsEventHandler;
+
+class AsyncWebSocket {
+public:
+  explicit AsyncWebSocket(const char *url) {}
+  void onEvent(AwsEventHandler handler) { _handler = handler; }
+
+  // Connected client by id, nullptr once it closed
+  AsyncWebSocketClient *client(uint32_t id) {
+    for (AsyncWebSocketClient &c : _clients) {
+      if (c.id() == id && c.closed == 0)
+        return &c;
+    }
+    return nullptr;
+  }
+  void cleanupClients(uint16_t maxClients = 8) {}
+
+  // Buffer owned by the library, deleted once no client holds it
+  AsyncWebSocketMessageBuffer *makeBuffer(size_t size) {
+    AsyncWebSocketMessageBuffer *buffer =
+        new AsyncWebSocketMessageBuffer(size);
+    _buffers.push_back(buffer);
+    return buffer;
+  }
+  void textAll(AsyncWebSocketMessageBuffer *buffer) {
+    if (buffer == nullptr)
+      return;
+    buffer->lock();
+    for (AsyncWebSocketClient &c : _clients) {
+      if (c.closed == 0)
+        c.text(buffer);
+    }
+    buffer->unlock();
+    cleanBuffers();
+  }
+  void textAll(const char *message, size_t len) {
+    AsyncWebSocketMessageBuffer *buffer = makeBuffer(len);
+    memcpy(buffer->get(), message, len);
+    textAll(buffer);
+  }
+  void textAll(const char *message) { textAll(message, strlen(message)); }
+
+  // Host side: a client connects, sends a text message or goes away
+  AsyncWebSocketClient *connect() {
+    _clients.emplace_back(_nextId++);
+    AsyncWebSocketClient *c = &_clients.back();
+    _handler(this, c, WS_EVT_CONNECT, nullptr, nullptr, 0);
+    return c;
+  }
+  void receive(AsyncWebSocketClient *c, char *text, size_t len) {
+    AwsFrameInfo info = {WS_TEXT, 0, 1, 1, WS_TEXT, len, {0}, 0};
+    _handler(this, c, WS_EVT_DATA, &info, (uint8_t *)text, len);
+  }
+  void disconnect(AsyncWebSocketClient *c) {
+    c->sendQueued();
+    _handler(this, c, WS_EVT_DISCONNECT, nullptr, nullptr, 0);
+    _clients.remove_if([c](AsyncWebSocketClient &x) { return &x == c; });
+  }
+  void sendQueued() {
+    for (AsyncWebSocketClient &c : _clients)
+      c.sendQueued();
+    cleanBuffers();
+  }
+
+private:
+  void cleanBuffers() {
+    _buffers.remove_if([](AsyncWebSocketMessageBuffer *b) {
+      if (!b->canDelete())
+        return false;
+      delete b;
+      return true;
+    });
+  }
+
+  AwsEventHandler _handler;
+  std::list<AsyncWebSocketClient> _clients;
+  std::list<AsyncWebSocketMessageBuffer *> _buffers; // From makeBuffer()
+  uint32_t _nextId = 1;
+};
+
+class AsyncWebServer {
+public:
+  explicit AsyncWebServer(uint16_t port) {}
+  void addHandler(AsyncWebSocket *handler) {}
+};
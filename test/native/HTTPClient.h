@@ -0,0 +1,113 @@
+/*
+ * PutToLight - Host HTTP Client
+ *
+ * Copyright (c) 2023 Serhii Nesterenko
+ * Licensed under the MIT License. See LICENSE file in the project root.
+ *
+ * HTTP/1.1 POST over WiFiClient: the request with Content-Length, then
+ * the status line, the collected headers and a Content-Length body. With
+ * setReuse(true) the connection stays open for the next request.
+ */
+
+#pragma once
+
+#include <WiFi.h>
+#include <map>
+
+#define HTTPC_ERROR_CONNECTION_REFUSED (-1)
+#define HTTPC_ERROR_SEND_PAYLOAD_FAILED (-3)
+#define HTTPC_ERROR_READ_TIMEOUT (-11)
+
+class HTTPClient {
+public:
+  void setReuse(bool reuse) { this->reuse = reuse; }
+  void setTimeout(uint16_t timeout) { this->timeout = timeout; }
+
+  bool begin(const String &host, uint16_t port, const String &uri = "/") {
+    this->host = host;
+    this->port = port;
+    this->uri = uri;
+    extra.clear();
+    got.clear();
+    return true;
+  }
+  void addHeader(const String &name, const String &value) {
+    extra += name + ": " + value + "\r\n";
+  }
+  void collectHeaders(const char *headerKeys[], const size_t count) {
+    wanted.assign(headerKeys, headerKeys + count);
+  }
+
+  int POST(uint8_t *payload, size_t size) {
+    if (!client.connected() && !client.connect(host.c_str(), port, timeout))
+      return HTTPC_ERROR_CONNECTION_REFUSED;
+    String req = "POST " + uri + " HTTP/1.1\r\nHost: " + host + "\r\n" +
+                 extra + "Content-Length: " + std::to_string(size) +
+                 "\r\nConnection: " + (reuse ? "keep-alive" : "close") +
+                 "\r\n\r\n";
+    req.append((const char *)payload, size);
+    if (client.write((const uint8_t *)req.data(), req.size()) != req.size()) {
+      client.stop();
+      return HTTPC_ERROR_SEND_PAYLOAD_FAILED;
+    }
+    return response();
+  }
+
+  bool hasHeader(const char *name) { return got.count(name) > 0; }
+  String header(const char *name) {
+    return hasHeader(name) ? got[name] : String();
+  }
+  void end() {
+    if (!reuse)
+      client.stop();
+  }
+
+private:
+  // Read the response: status code, wanted headers, skip the body
+  int response() {
+    String in;
+    size_t head;
+    uint8_t buf[512];
+    while ((head = in.find("\r\n\r\n")) == String::npos) {
+      size_t n = client.read(buf, sizeof(buf), timeout);
+      if (n == 0) {
+        client.stop();
+        return HTTPC_ERROR_READ_TIMEOUT;
+      }
+      in.append((const char *)buf, n);
+    }
+    int code = 0;
+    size_t length = 0;
+    sscanf(in.c_str(), "HTTP/1.%*d %d", &code);
+    for (size_t pos = in.find("\r\n") + 2; pos < head;) {
+      size_t eol = in.find("\r\n", pos), colon = in.find(':', pos);
+      if (colon < eol) {
+        String name = in.substr(pos, colon - pos);
+        String value = in.substr(in.find_first_not_of(' ', colon + 1),
+                                 eol - in.find_first_not_of(' ', colon + 1));
+        if (strcasecmp(name.c_str(), "Content-Length") == 0)
+          length = strtoul(value.c_str(), nullptr, 10);
+        for (const char *w : wanted) {
+          if (strcasecmp(name.c_str(), w) == 0)
+            got[w] = value;
+        }
+      }
+      pos = eol + 2;
+    }
+    for (size_t body = in.size() - head - 4; body < length;) {
+      size_t n = client.read(buf, min(sizeof(buf), length - body), timeout);
+      if (n == 0)
+        break;
+      body += n;
+    }
+    return code;
+  }
+
+  WiFiClient client;
+  String host, uri, extra;
+  uint16_t port = 80;
+  uint16_t timeout = 5000;
+  bool reuse = false;
+  std::vector<const char *> wanted;
+  std::map<String, String> got;
+};
@@ -0,0 +1,106 @@
+/*
+ * PutToLight - Host File System
+ *
+ * Copyright (c) 2023 Serhii Nesterenko
+ * Licensed under the MIT License. See LICENSE file in the project root.
+ *
+ * LittleFS kept in RAM: a map from path to file contents. An open File
+ * shares the contents with the map, so a file renamed or removed while
+ * open stays readable through it, like on LittleFS. Tests put files in
+ * place and look at them through LittleFS.files.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <map>
+#include <memory>
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+// Open file, false when the open failed
+class File {
+public:
+  File() {}
+  File(std::shared_ptr<std::string> data, bool writable, size_t pos)
+      : data(data), writable(writable), pos(pos) {}
+
+  explicit operator bool() const { return data != nullptr; }
+
+  size_t write(const uint8_t *buf, size_t len) {
+    if (!data || !writable)
+      return 0;
+    data->replace(pos, min(len, data->size() - pos), (const char *)buf, len);
+    pos += len;
+    return len;
+  }
+  size_t write(uint8_t c) { return write(&c, 1); }
+
+  size_t read(uint8_t *buf, size_t len) {
+    if (!data || pos >= data->size())
+      return 0;
+    len = min(len, data->size() - pos);
+    memcpy(buf, data->data() + pos, len);
+    pos += len;
+    return len;
+  }
+  int read() {
+    uint8_t c;
+    return read(&c, 1) == 1 ? c : -1;
+  }
+  int available() { return data ? data->size() - pos : 0; }
+
+  bool seek(uint32_t to) {
+    if (!data || to > data->size())
+      return false;
+    pos = to;
+    return true;
+  }
+  size_t position() const { return pos; }
+  size_t size() const { return data ? data->size() : 0; }
+  void close() { data = nullptr; }
+
+private:
+  std::shared_ptr<std::string> data;
+  bool writable = false;
+  size_t pos = 0;
+};
+
+class HostFS {
+public:
+  bool begin(bool formatOnFail = false) { return true; }
+  bool format() {
+    files.clear();
+    return true;
+  }
+
+  File open(const char *path, const char *mode = FILE_READ) {
+    auto it = files.find(path);
+    if (*mode == 'r')
+      return it == files.end() ? File() : File(it->second, false, 0);
+    if (*mode == 'w' || it == files.end())
+      it = files.insert_or_assign(path, std::make_shared<std::string>()).first;
+    return File(it->second, true, *mode == 'a' ? it->second->size() : 0);
+  }
+  File open(const String &path, const char *mode = FILE_READ) {
+    return open(path.c_str(), mode);
+  }
+  bool exists(const char *path) { return files.count(path) > 0; }
+  bool remove(const char *path) { return files.erase(path) > 0; }
+  bool rename(const char *from, const char *to) {
+    auto it = files.find(from);
+    if (it == files.end())
+      return false;
+    std::shared_ptr<std::string> data = it->second;
+    files.erase(it);
+    files[to] = data;
+    return true;
+  }
+
+  // Test side: contents by path
+  std::map<std::string, std::shared_ptr<std::string>> files;
+};
+
+inline HostFS LittleFS;
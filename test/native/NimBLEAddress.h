@@ -0,0 +1,23 @@
+/*
+ * PutToLight - Host NimBLEAddress
+ *
+ * Copyright (c) 2023 Serhii Nesterenko
+ * Licensed under the MIT License. See LICENSE file in the project root.
+ *
+ * Only what config_t needs to be built and copied.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+class NimBLEAddress {
+public:
+  NimBLEAddress() {}
+  NimBLEAddress(const std::string &address) : str(address) {}
+  std::string toString() const { return str; }
+  bool operator==(const NimBLEAddress &o) const { return str == o.str; }
+
+private:
+  std::string str;
+};
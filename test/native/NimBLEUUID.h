@@ -0,0 +1,23 @@
+/*
+ * PutToLight - Host NimBLEUUID
+ *
+ * Copyright (c) 2023 Serhii Nesterenko
+ * Licensed under the MIT License. See LICENSE file in the project root.
+ *
+ * Only what config_t needs to be built and copied.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+class NimBLEUUID {
+public:
+  NimBLEUUID() {}
+  NimBLEUUID(const std::string &uuid) : str(uuid) {}
+  std::string toString() const { return str; }
+  bool operator==(const NimBLEUUID &o) const { return str == o.str; }
+
+private:
+  std::string str;
+};
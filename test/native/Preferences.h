@@ -0,0 +1,74 @@
+/*
+ * PutToLight - Host NVS Preferences
+ *
+ * Copyright (c) 2023 Serhii Nesterenko
+ * Licensed under the MIT License. See LICENSE file in the project root.
+ *
+ * Preferences over a map of namespaces in RAM. The map outlives every
+ * Preferences object, so a test can reboot a module and find what it
+ * saved, and look at it through hostNvs.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <map>
+
+// Namespace, then key, then the value bytes
+inline std::map<std::string, std::map<std::string, std::string>> hostNvs;
+
+class Preferences {
+public:
+  bool begin(const char *name, bool readOnly = false,
+             const char *partition = nullptr) {
+    ns = name;
+    this->readOnly = readOnly;
+    return true;
+  }
+  void end() {}
+  bool clear() {
+    hostNvs[ns].clear();
+    return true;
+  }
+  bool isKey(const char *key) { return hostNvs[ns].count(key) > 0; }
+
+  size_t putBytes(const char *key, const void *value, size_t len) {
+    if (readOnly)
+      return 0;
+    hostNvs[ns][key].assign((const char *)value, len);
+    return len;
+  }
+  size_t getBytes(const char *key, void *buf, size_t maxLen) {
+    auto it = hostNvs[ns].find(key);
+    if (it == hostNvs[ns].end() || it->second.size() > maxLen)
+      return 0;
+    memcpy(buf, it->second.data(), it->second.size());
+    return it->second.size();
+  }
+
+  size_t putUInt(const char *key, uint32_t value) {
+    return putBytes(key, &value, sizeof(value));
+  }
+  uint32_t getUInt(const char *key, uint32_t value = 0) {
+    uint32_t v;
+    return getBytes(key, &v, sizeof(v)) == sizeof(v) ? v : value;
+  }
+  size_t putUChar(const char *key, uint8_t value) {
+    return putBytes(key, &value, sizeof(value));
+  }
+  uint8_t getUChar(const char *key, uint8_t value = 0) {
+    uint8_t v;
+    return getBytes(key, &v, sizeof(v)) == sizeof(v) ? v : value;
+  }
+  size_t putString(const char *key, const String &value) {
+    return putBytes(key, value.data(), value.size());
+  }
+  String getString(const char *key, const String &value = String()) {
+    auto it = hostNvs[ns].find(key);
+    return it == hostNvs[ns].end() ? value : it->second;
+  }
+
+private:
+  std::string ns;
+  bool readOnly = false;
+};
@@ -0,0 +1,12 @@
+/*
+ * PutToLight - Host Arduino Core, pre-1.0 name
+ *
+ * Copyright (c) 2023 Serhii Nesterenko
+ * Licensed under the MIT License. See LICENSE file in the project root.
+ *
+ * DFRobot_CH423.h includes this when ARDUINO is not defined, as on the host.
+ */
+
+#pragma once
+
+#include <Arduino.h>
@@ -0,0 +1,115 @@
+/*
+ * PutToLight - Host WiFi
+ *
+ * Copyright (c) 2023 Serhii Nesterenko
+ * Licensed under the MIT License. See LICENSE file in the project root.
+ *
+ * The station is always associated unless a test takes the link down
+ * with WiFi.upFor. WiFiClient is a TCP socket, so forwarding reaches a
+ * collector listening on the loopback interface. Hosts are dotted IPv4
+ * addresses, there is no DNS.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+typedef enum {
+  WL_IDLE_STATUS = 0,
+  WL_CONNECTED = 3,
+  WL_DISCONNECTED = 6
+} wl_status_t;
+
+// Socket address of a dotted IPv4 host, false for anything else
+inline bool hostAddr(const char *host, uint16_t port, sockaddr_in &addr) {
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  return inet_pton(AF_INET, host, &addr.sin_addr) == 1;
+}
+
+class WiFiClass {
+public:
+  wl_status_t status() {
+    if (upFor == 0)
+      return WL_DISCONNECTED;
+    if (upFor > 0)
+      upFor--;
+    return WL_CONNECTED;
+  }
+  String macAddress() { return "24:0A:C4:00:00:01"; }
+
+  // Test side: status() calls that still find the link up, -1 for all
+  int upFor = -1;
+};
+
+inline WiFiClass WiFi;
+
+// TCP connection
+class WiFiClient {
+public:
+  WiFiClient() {}
+  WiFiClient(const WiFiClient &) = delete;
+  ~WiFiClient() { stop(); }
+
+  int connect(const char *host, uint16_t port, int32_t timeout) {
+    sockaddr_in addr;
+    stop();
+    if (!hostAddr(host, port, addr))
+      return 0;
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || ::connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0) {
+      stop();
+      return 0;
+    }
+    return 1;
+  }
+
+  // Open until the peer closed it
+  uint8_t connected() {
+    char c;
+    if (fd < 0)
+      return 0;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+      stop();
+    return fd >= 0;
+  }
+
+  size_t write(const uint8_t *buf, size_t size) {
+    if (fd < 0)
+      return 0;
+    ssize_t n = send(fd, buf, size, MSG_NOSIGNAL);
+    return n < 0 ? 0 : n;
+  }
+
+  // Bytes received within timeout ms, 0 on timeout or close
+  size_t read(uint8_t *buf, size_t size, int timeout) {
+    pollfd p = {fd, POLLIN, 0};
+    if (fd < 0 || poll(&p, 1, timeout) <= 0)
+      return 0;
+    ssize_t n = recv(fd, buf, size, 0);
+    return n < 0 ? 0 : n;
+  }
+
+  int setNoDelay(bool nodelay) {
+    int on = nodelay;
+    return setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  }
+
+  void stop() {
+    if (fd >= 0)
+      close(fd);
+    fd = -1;
+  }
+
+private:
+  int fd = -1;
+};
@@ -0,0 +1,42 @@
+/*
+ * PutToLight - Host UDP
+ *
+ * Copyright (c) 2023 Serhii Nesterenko
+ * Licensed under the MIT License. See LICENSE file in the project root.
+ *
+ * WiFiUDP sending one datagram per packet from a host socket.
+ */
+
+#pragma once
+
+#include <WiFi.h>
+
+class WiFiUDP {
+public:
+  WiFiUDP() {}
+  WiFiUDP(const WiFiUDP &) = delete;
+  ~WiFiUDP() {
+    if (fd >= 0)
+      close(fd);
+  }
+
+  int beginPacket(const char *host, uint16_t port) {
+    packet.clear();
+    return hostAddr(host, port, to);
+  }
+  size_t write(const uint8_t *buf, size_t size) {
+    packet.append((const char *)buf, size);
+    return size;
+  }
+  int endPacket() {
+    if (fd < 0)
+      fd = socket(AF_INET, SOCK_DGRAM, 0);
+    return sendto(fd, packet.data(), packet.size(), 0, (sockaddr *)&to,
+                  sizeof(to)) == (ssize_t)packet.size();
+  }
+
+private:
+  int fd = -1;
+  sockaddr_in to;
+  std::string packet;
+};
@@ -0,0 +1,260 @@
+/*
+ * PutToLight - Host I2C Buses with Emulated CH423 Chips
+ *
+ * Copyright (c) 2023 Serhii Nesterenko
+ * Licensed under the MIT License. See LICENSE file in the project root.
+ *
+ * TwoWire as the firmware uses it, with CH423 chips emulated at register
+ * level behind it. A CH423 has no address: the address byte of a transfer
+ * is the command, so it selects the register. Chips sharing a bus all
+ * take every write, and their read bytes are wired-AND like on the wire.
+ *
+ * Every transfer is logged with its bytes and its modeled time at the
+ * bus clock: start, address byte and data bytes with their ACK bits, and
+ * stop - 20 clock periods for a CH423 command.
+ *
+ * Modeled chip behaviour:
+ * - SET_SYSTEM_ARGS keeps ioEn, decL, decH, intEn, odEn, intens and sleep.
+ *   Dynamic display scanning (decL, decH, intens) is only recorded.
+ * - ioEn 0 leaves GPIO0-7 as inputs at the level the board puts on them.
+ *   ioEn 1 drives them from SET_IO; a driven line reads back wired-AND
+ *   with the board, so a line shorted to ground reads low.
+ * - odEn 1 makes GPO0-15 open drain: a 1 bit releases the pin instead of
+ *   driving it high.
+ * - intEn 1 with decH 0 turns GPO15 into the interrupt output. It latches
+ *   low when the GPIO level differs from SET_IO, even for a pulse, and is
+ *   released by reading the GPIO lines or by writing SET_IO; a new SET_IO
+ *   value that differs from the lines latches it again.
+ * - sleep puts the chip to sleep until the next command.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+#define CH423_SYS 0x24   // SET_SYSTEM_ARGS command
+#define CH423_GPO_L 0x22 // SET_GPO_L command
+#define CH423_GPO_H 0x23 // SET_GPO_H command
+#define CH423_IO 0x30    // SET_IO command
+#define CH423_RD_IO 0x26 // READ_GPIO command
+
+// One emulated CH423
+class Ch423 {
+public:
+  // System args bits
+  enum {
+    IO_EN = 0x01,  // GPIO0-7 are outputs
+    DEC_L = 0x02,  // Dynamic scanning of GPO0-7
+    DEC_H = 0x04,  // Dynamic scanning of GPO8-15
+    INT_EN = 0x08, // Interrupt on GPO15 when decH is 0
+    OD_EN = 0x10,  // GPO0-15 are open drain
+    INTENS = 0x20, // Display drive strength
+    SLEEP = 0x40   // Low-power sleep
+  };
+
+  uint8_t args = 0;     // System args
+  uint8_t io = 0;       // SET_IO register: GPIO outputs, interrupt reference
+  uint16_t gpo = 0;     // SET_GPO_H and SET_GPO_L registers
+  uint8_t board = 0xff; // Level the board puts on the GPIO lines
+  bool latched = false; // Interrupt output pulled low
+  bool asleep = false;  // Sleeping until the next command
+  int commands = 0;     // Commands taken, data or not
+
+  bool gpioOutput() const { return args & IO_EN; }
+  bool openDrain() const { return args & OD_EN; }
+  bool interrupts() const { return (args & INT_EN) && !(args & DEC_H); }
+
+  // Level of the GPIO lines
+  uint8_t gpioLevel() const { return gpioOutput() ? io & board : board; }
+
+  // Level of the GPO pins, pulled up where they are not driven
+  uint16_t gpoLevel() const {
+    if (!interrupts())
+      return gpo;
+    return (gpo & 0x7fff) | (latched ? 0 : 0x8000);
+  }
+
+  // GPO pins the chip drives, open drain only drives the low ones
+  uint16_t gpoDriven() const { return openDrain() ? (uint16_t)~gpo : 0xffff; }
+
+  // The board changes the level on the GPIO lines
+  void drive(uint8_t level) {
+    board = level;
+    check();
+  }
+
+  // Whether the chip acknowledges a command
+  static bool accepts(uint8_t cmd, bool read) {
+    if (read)
+      return cmd == CH423_RD_IO;
+    return cmd == CH423_SYS || cmd == CH423_GPO_L || cmd == CH423_GPO_H ||
+           cmd == CH423_IO;
+  }
+
+  // Take a write command with its data byte
+  void write(uint8_t cmd, uint8_t data) {
+    wake();
+    switch (cmd) {
+    case CH423_SYS:
+      args = data;
+      asleep = args & SLEEP;
+      check();
+      break;
+    case CH423_GPO_L:
+      gpo = (gpo & 0xff00) | data;
+      break;
+    case CH423_GPO_H:
+      gpo = (gpo & 0x00ff) | data << 8;
+      break;
+    case CH423_IO:
+      io = data;
+      latched = false;
+      check();
+      break;
+    }
+  }
+
+  // Answer READ_GPIO
+  uint8_t read() {
+    wake();
+    latched = false;
+    return gpioLevel();
+  }
+
+  // A command without data, e.g. a probe, still wakes the chip
+  void wake() {
+    commands++;
+    asleep = false;
+  }
+
+private:
+  void check() {
+    if (interrupts() && gpioLevel() != io)
+      latched = true;
+  }
+};
+
+// One I2C transfer as it went over the bus
+struct I2cTransfer {
+  uint8_t addr;     // 7-bit address byte, the CH423 command
+  bool read;        // Read transfer
+  bool ack;         // Some chip acknowledged the address
+  uint8_t len;      // Data bytes
+  uint8_t data[4];  // Data bytes written or read
+  uint64_t startNs; // Bus time when the transfer began
+  uint32_t ns;      // Modeled transfer time at the bus clock
+  uint32_t seq;     // Position among the transfers of all buses
+};
+
+// I2C bus with the chips wired to it
+class TwoWire {
+public:
+  explicit TwoWire(uint8_t bus) {}
+
+  bool begin(int sda = -1, int scl = -1, uint32_t frequency = 0) {
+    if (frequency != 0)
+      clock = frequency;
+    return true;
+  }
+  bool end() { return true; }
+  bool setClock(uint32_t frequency) {
+    clock = frequency;
+    return true;
+  }
+  uint32_t getClock() { return clock; }
+
+  void beginTransmission(int address) {
+    memset(&pending, 0, sizeof(pending));
+    pending.addr = address;
+  }
+  size_t write(uint8_t data) {
+    if (pending.len >= sizeof(pending.data))
+      return 0;
+    pending.data[pending.len++] = data;
+    return 1;
+  }
+
+  // 0 when the address was acknowledged, 2 when no chip answered
+  uint8_t endTransmission(bool sendStop = true) {
+    pending.read = false;
+    pending.ack = false;
+    for (Ch423 *chip : chips) {
+      if (!Ch423::accepts(pending.addr, false))
+        continue;
+      pending.ack = true;
+      if (pending.len == 0)
+        chip->wake();
+      else
+        chip->write(pending.addr, pending.data[0]);
+    }
+    log(pending.ack ? pending.len : 0);
+    return pending.ack ? 0 : 2;
+  }
+
+  // Read transfer, the bytes received
+  uint8_t requestFrom(int address, int size, int sendStop = 1) {
+    memset(&pending, 0, sizeof(pending));
+    pending.addr = address;
+    pending.read = true;
+    for (Ch423 *chip : chips) {
+      if (!Ch423::accepts(pending.addr, true))
+        continue;
+      uint8_t value = chip->read();
+      pending.data[0] = pending.ack ? pending.data[0] & value : value;
+      pending.ack = true;
+    }
+    if (!pending.ack) {
+      log(0);
+      return 0;
+    }
+    pending.len = min(size, (int)sizeof(pending.data));
+    for (int i = 1; i < pending.len; i++)
+      pending.data[i] = pending.data[0]; // The chip repeats its one byte
+    log(pending.len);
+    memcpy(rx, pending.data, pending.len);
+    rxPos = 0;
+    rxLen = pending.len;
+    return rxLen;
+  }
+  int available() { return rxLen - rxPos; }
+  int read() { return rxPos < rxLen ? rx[rxPos++] : -1; }
+
+  // Test side: wire a chip to the bus, or start over with no chips
+  void attach(Ch423 &chip) { chips.push_back(&chip); }
+  void reset() {
+    chips.clear();
+    xfers.clear();
+    busNs = 0;
+    clock = 100000;
+    rxPos = rxLen = 0;
+  }
+
+  // Modeled time of a transfer with bytes data bytes (ns)
+  uint32_t transferNs(int bytes) const {
+    return (uint64_t)(2 + 9 * (1 + bytes)) * 1000000000ULL / clock;
+  }
+
+  const std::vector<I2cTransfer> &transfers() const { return xfers; }
+  void clearLog() { xfers.clear(); }
+  uint64_t busNs = 0; // Bus time of all transfers so far
+
+private:
+  // Close the pending transfer; a NACK ends it after the address byte
+  void log(int bytes) {
+    pending.startNs = busNs;
+    pending.ns = transferNs(bytes);
+    pending.seq = seqNext++;
+    busNs += pending.ns;
+    xfers.push_back(pending);
+  }
+
+  static inline uint32_t seqNext = 0;
+  uint32_t clock = 100000; // Arduino default
+  std::vector<Ch423 *> chips;
+  std::vector<I2cTransfer> xfers;
+  I2cTransfer pending;
+  uint8_t rx[4]; // Bytes of the last read
+  int rxPos = 0, rxLen = 0;
+};
+
+inline TwoWire Wire(0), Wire1(1);
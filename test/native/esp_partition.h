@@ -0,0 +1,89 @@
+/*
+ * PutToLight - Host Flash Partitions
+ *
+ * Copyright (c) 2023 Serhii Nesterenko
+ * Licensed under the MIT License. See LICENSE file in the project root.
+ *
+ * The "table" partition of partitions.csv in RAM, with NOR flash rules:
+ * erase works on whole sectors and sets every bit, a write can only
+ * clear bits. A mapping points straight into the partition, so it sees
+ * later writes like the flash cache does after IDF invalidates it.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+#define SPI_FLASH_SEC_SIZE 4096
+#define ESP_ERR_INVALID_ARG 0x102
+#define ESP_ERR_INVALID_SIZE 0x104
+
+typedef enum {
+  ESP_PARTITION_TYPE_APP,
+  ESP_PARTITION_TYPE_DATA
+} esp_partition_type_t;
+typedef int esp_partition_subtype_t;
+typedef enum {
+  SPI_FLASH_MMAP_DATA,
+  SPI_FLASH_MMAP_INST
+} spi_flash_mmap_memory_t;
+typedef uint32_t spi_flash_mmap_handle_t;
+
+typedef struct {
+  esp_partition_type_t type;
+  esp_partition_subtype_t subtype;
+  uint32_t address;
+  uint32_t size;
+  char label[17];
+} esp_partition_t;
+
+// Test side: the partition, its contents and the mappings still open
+inline esp_partition_t hostTable = {ESP_PARTITION_TYPE_DATA, 0x40, 0x370000,
+                                    0x80000, "table"};
+inline std::vector<uint8_t> hostFlash(0x80000, 0xff);
+inline int hostMappings = 0;
+
+inline const esp_partition_t *
+esp_partition_find_first(esp_partition_type_t type,
+                         esp_partition_subtype_t subtype, const char *label) {
+  if (type != hostTable.type || subtype != hostTable.subtype ||
+      (label != nullptr && strcmp(label, hostTable.label) != 0))
+    return nullptr;
+  return &hostTable;
+}
+
+inline esp_err_t esp_partition_erase_range(const esp_partition_t *part,
+                                           size_t offset, size_t size) {
+  if (offset % SPI_FLASH_SEC_SIZE != 0 || size % SPI_FLASH_SEC_SIZE != 0)
+    return ESP_ERR_INVALID_ARG;
+  if (offset + size > part->size)
+    return ESP_ERR_INVALID_SIZE;
+  memset(hostFlash.data() + offset, 0xff, size);
+  return ESP_OK;
+}
+
+inline esp_err_t esp_partition_write(const esp_partition_t *part,
+                                     size_t offset, const void *src,
+                                     size_t size) {
+  if (offset + size > part->size)
+    return ESP_ERR_INVALID_SIZE;
+  for (size_t i = 0; i < size; i++)
+    hostFlash[offset + i] &= ((const uint8_t *)src)[i];
+  return ESP_OK;
+}
+
+inline esp_err_t esp_partition_mmap(const esp_partition_t *part,
+                                    size_t offset, size_t size,
+                                    spi_flash_mmap_memory_t memory,
+                                    const void **out,
+                                    spi_flash_mmap_handle_t *handle) {
+  if (offset + size > part->size)
+    return ESP_ERR_INVALID_SIZE;
+  *out = hostFlash.data() + offset;
+  *handle = ++hostMappings;
+  return ESP_OK;
+}
+
+inline void spi_flash_munmap(spi_flash_mmap_handle_t handle) {
+  hostMappings--;
+}
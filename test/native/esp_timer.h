@@ -0,0 +1,55 @@
+/*
+ * PutToLight - Host esp_timer
+ *
+ * Copyright (c) 2023 Serhii Nesterenko
+ * Licensed under the MIT License. See LICENSE file in the project root.
+ *
+ * Timers only record when they are due; a test fires one with
+ * esp_timer_fire() after moving the clock.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+typedef void (*esp_timer_cb_t)(void *arg);
+
+typedef struct {
+  esp_timer_cb_t callback;
+  void *arg;
+  int dispatch_method;
+  const char *name;
+  bool skip_unhandled_events;
+} esp_timer_create_args_t;
+
+struct HostTimer {
+  esp_timer_create_args_t args;
+  bool armed;   // Started and not fired or stopped
+  uint64_t due; // esp_timer_get_time() when it fires (us)
+};
+typedef HostTimer *esp_timer_handle_t;
+
+inline int64_t esp_timer_get_time() { return (int64_t)hostMillis * 1000; }
+
+inline esp_err_t esp_timer_create(const esp_timer_create_args_t *args,
+                                  esp_timer_handle_t *handle) {
+  *handle = new HostTimer{*args, false, 0};
+  return ESP_OK;
+}
+inline esp_err_t esp_timer_start_once(esp_timer_handle_t t, uint64_t us) {
+  t->armed = true;
+  t->due = esp_timer_get_time() + us;
+  return ESP_OK;
+}
+inline esp_err_t esp_timer_stop(esp_timer_handle_t t) {
+  t->armed = false;
+  return ESP_OK;
+}
+
+// Test side: run the callback of an armed timer
+inline void esp_timer_fire(esp_timer_handle_t t) {
+  if (t == nullptr || !t->armed)
+    return;
+  t->armed = false;
+  t->args.callback(t->args.arg);
+}
@@ -0,0 +1,67 @@
+/*
+ * PutToLight - Host Stand-ins for the Firmware
+ *
+ * Copyright (c) 2023 Serhii Nesterenko
+ * Licensed under the MIT License. See LICENSE file in the project root.
+ *
+ * The modules [env:native] leaves out - config, logging, sessions, tasks,
+ * the web server - reduced to what the modules under test call. Include it from exactly
+ * one file of a test suite, after ptl.hpp.
+ */
+
+#pragma once
+
+metrics_t metrics;
+uint8_t logLevel = LEVEL_WARN;
+unsigned long lastRead = 0;
+
+// Settings the tests change directly, reset by defaultConfig()
+config_t hostConfig;
+const config_t *volatile conf = &hostConfig;
+
+const config_t *holdConfig() { return conf; }
+void releaseConfig(const config_t *c) {}
+
+// Start from the settings of an empty config.json
+void defaultConfig() {
+  hostConfig = config_t();
+  memset(hostConfig.inputs, -1, sizeof(hostConfig.inputs));
+  hostConfig.brightness = BAM_FULL;
+  hostConfig.logLevel = LEVEL_WARN;
+  for (const char *key : {"00", "01", "10", "403"})
+    strcpy(hostConfig.gs1Keys[hostConfig.nGs1Keys++], key);
+  strcpy(hostConfig.fwdPath, "/");
+  hostConfig.fwdPort = 9000;
+  hostConfig.fwdLatency = 1000;
+  hostConfig.fwdBatch = 32;
+}
+
+void logWrite(uint8_t level, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  vprintf(fmt, args);
+  va_end(args);
+  putchar('\n');
+}
+
+// The clock was never set; pushTime() only records what it was given
+unsigned long getTime() { return 0; }
+unsigned long pushedTime = 0;
+bool pushTime(unsigned long t) {
+  pushedTime = t;
+  return true;
+}
+
+bool sessionConfirm(int pin) { return false; }
+bool startSession(JsonObject order) { return false; }
+void stopSession() {}
+
+// Web commands that reach beyond the modules under test do nothing
+void setDevice(JsonObject json) {}
+const char *saveConfig(JsonObject config) { return "not on the host"; }
+void requestRestart() {}
+bool applyEntry(JsonVariant entry, channel_t *frame, unsigned long now) {
+  return false;
+}
+
+TaskHandle_t startTask(TaskId id, TaskFunction_t code) { return nullptr; }
@@ -0,0 +1,375 @@
+/*
+ * PutToLight - CH423 Output Tests
+ *
+ * Copyright (c) 2023 Serhii Nesterenko
+ * Licensed under the MIT License. See LICENSE file in the project root.
+ *
+ * blink.cpp and the DFRobot driver against two emulated CH423 chips:
+ * output frames must land in the right registers with the modeled bus
+ * time the metrics report, and the chips must be set up as the wall is
+ * wired. Run with: pio test -e native -f test_ch423
+ */
+
+#include "DFRobot_CH423.h"
+#include "ptl.hpp"
+#include "firmware.h"
+#include <Wire.h>
+#include <esp_timer.h>
+#include <unity.h>
+
+#define XFER_400K 50000 // One CH423 command at 400 kHz: 20 bits (ns)
+
+// blink.cpp internals
+extern DFRobot_CH423 *ch423, *ch4231;
+extern channel_t channels[NUM_PINS];
+extern volatile uint8_t urgentRegs;
+extern uint8_t out[FRAME_BYTES], written[FRAME_BYTES];
+extern uint32_t xferNs[2];
+extern bool inputChip[2];
+extern esp_timer_handle_t bamTimer;
+extern volatile bool bamArmed;
+extern bool bamOn;
+extern int bamPlane;
+extern unsigned long lastPoll;
+void writeFrame(uint8_t urgent);
+DFRobot_CH423 *initChip(TwoWire &wire, int bus, bool input);
+
+Ch423 chip0, chip1; // On Wire and Wire1
+
+// Fresh chips on both buses and the blink state of a reset
+void setUp() {
+  defaultConfig();
+  memset(&metrics, 0, sizeof(metrics));
+  memset(channels, 0, sizeof(channels));
+  memset(inputChip, 0, sizeof(inputChip));
+  urgentRegs = 0;
+  bamArmed = bamOn = false;
+  bamPlane = 0;
+  lastPoll = 0;
+  hostMillis = 1000;
+  chip0 = Ch423();
+  chip1 = Ch423();
+  Wire.reset();
+  Wire1.reset();
+  Wire.attach(chip0);
+  Wire1.attach(chip1);
+}
+
+void tearDown() {}
+
+// Boot, then forget the boot transfers and counters
+static void boot() {
+  initBlink();
+  Wire.clearLog();
+  Wire1.clearLog();
+  memset(&metrics, 0, sizeof(metrics));
+}
+
+// Bus time of the transfers logged on both buses (ns)
+static uint64_t loggedNs() {
+  uint64_t ns = 0;
+  for (const I2cTransfer &t : Wire.transfers())
+    ns += t.ns;
+  for (const I2cTransfer &t : Wire1.transfers())
+    ns += t.ns;
+  return ns;
+}
+
+static void assertWrite(const I2cTransfer &t, uint8_t cmd, uint8_t data,
+                        uint32_t ns) {
+  TEST_ASSERT_EQUAL_HEX8(cmd, t.addr);
+  TEST_ASSERT_FALSE(t.read);
+  TEST_ASSERT_TRUE(t.ack);
+  TEST_ASSERT_EQUAL(1, t.len);
+  TEST_ASSERT_EQUAL_HEX8(data, t.data[0]);
+  TEST_ASSERT_EQUAL_UINT32(ns, t.ns);
+}
+
+// Both chips: push-pull GPO, GPIO driven, every LED off
+void test_boot_sets_up_chips() {
+  boot();
+  TEST_ASSERT_NOT_NULL(ch423);
+  TEST_ASSERT_NOT_NULL(ch4231);
+  TEST_ASSERT_EQUAL_HEX8(Ch423::IO_EN, chip0.args);
+  TEST_ASSERT_EQUAL_HEX8(Ch423::IO_EN, chip1.args);
+  TEST_ASSERT_EQUAL_HEX8(0xff, chip0.io);
+  TEST_ASSERT_EQUAL_HEX16(0xffff, chip0.gpo);
+  TEST_ASSERT_EQUAL_HEX8(0xff, chip1.io);
+  TEST_ASSERT_EQUAL_HEX16(0xffff, chip1.gpo);
+  TEST_ASSERT_EQUAL_HEX16(0xffff, chip0.gpoDriven());
+  TEST_ASSERT_EQUAL_UINT32(XFER_400K, xferNs[0]);
+  TEST_ASSERT_EQUAL_UINT32(XFER_400K, xferNs[1]);
+}
+
+// A configured input line leaves its chip's GPIO bank undriven
+void test_boot_inputs_leave_gpio_undriven() {
+  hostConfig.inputs[9] = 4; // Second chip, line 1
+  boot();
+  TEST_ASSERT_EQUAL_HEX8(Ch423::IO_EN, chip0.args);
+  TEST_ASSERT_EQUAL_HEX8(0, chip1.args);
+  TEST_ASSERT_FALSE(chip1.gpioOutput());
+  chip1.drive(0x5a);
+  TEST_ASSERT_EQUAL_HEX8(0x5a, chip1.gpioLevel());
+}
+
+// A missing chip is probed once and never written
+void test_missing_chip() {
+  Wire1.reset();
+  initBlink();
+  TEST_ASSERT_NOT_NULL(ch423);
+  TEST_ASSERT_NULL(ch4231);
+  TEST_ASSERT_EQUAL(1, Wire1.transfers().size());
+  TEST_ASSERT_FALSE(Wire1.transfers()[0].ack);
+  TEST_ASSERT_EQUAL_UINT32(Wire1.transferNs(0), Wire1.transfers()[0].ns);
+  Wire.clearLog();
+  Wire1.clearLog();
+  memset(out, 0, sizeof(out));
+  writeFrame(0);
+  TEST_ASSERT_EQUAL(0, Wire1.transfers().size());
+  TEST_ASSERT_EQUAL(3, Wire.transfers().size());
+  TEST_ASSERT_EQUAL_UINT32(3 * XFER_400K / 1000, metrics.frameBusUs);
+}
+
+// out[] byte i goes to register i % 3 of chip i / 3, one command each
+void test_frame_to_registers() {
+  static const uint8_t frame[FRAME_BYTES] = {0x12, 0x34, 0x56,
+                                             0x78, 0x9a, 0xbc};
+  boot();
+  memcpy(out, frame, sizeof(out));
+  writeFrame(0);
+  TEST_ASSERT_EQUAL_HEX8(0x12, chip0.io);
+  TEST_ASSERT_EQUAL_HEX16(0x5634, chip0.gpo);
+  TEST_ASSERT_EQUAL_HEX8(0x78, chip1.io);
+  TEST_ASSERT_EQUAL_HEX16(0xbc9a, chip1.gpo);
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(frame, written, FRAME_BYTES);
+
+  const std::vector<I2cTransfer> &a = Wire.transfers();
+  const std::vector<I2cTransfer> &b = Wire1.transfers();
+  TEST_ASSERT_EQUAL(3, a.size());
+  TEST_ASSERT_EQUAL(3, b.size());
+  assertWrite(a[0], CH423_IO, 0x12, XFER_400K);
+  assertWrite(a[1], CH423_GPO_L, 0x34, XFER_400K);
+  assertWrite(a[2], CH423_GPO_H, 0x56, XFER_400K);
+  assertWrite(b[0], CH423_IO, 0x78, XFER_400K);
+  assertWrite(b[1], CH423_GPO_L, 0x9a, XFER_400K);
+  assertWrite(b[2], CH423_GPO_H, 0xbc, XFER_400K);
+  TEST_ASSERT_TRUE(a[2].seq < b[0].seq); // Wire first, then Wire1
+}
+
+// Bus time of a frame is what the emulated buses spent on it
+void test_frame_bus_time() {
+  boot();
+  out[1] = 0x00;
+  out[5] = 0x0f;
+  writeFrame(0);
+  TEST_ASSERT_EQUAL(1, Wire.transfers().size());
+  TEST_ASSERT_EQUAL(1, Wire1.transfers().size());
+  TEST_ASSERT_EQUAL_UINT32(loggedNs() / 1000, metrics.frameBusUs);
+  TEST_ASSERT_EQUAL_UINT32(2 * XFER_400K / 1000, metrics.frameBusUs);
+  TEST_ASSERT_EQUAL_UINT32(1, metrics.i2cFrames);
+  TEST_ASSERT_EQUAL_UINT32(2, metrics.i2cWrites);
+
+  // Whole frame: six commands
+  Wire.clearLog();
+  Wire1.clearLog();
+  memset(out, 0x55, sizeof(out));
+  writeFrame(0);
+  TEST_ASSERT_EQUAL_UINT32(loggedNs() / 1000, metrics.frameBusUs);
+  TEST_ASSERT_EQUAL_UINT32(6 * XFER_400K / 1000, metrics.frameBusMax);
+  TEST_ASSERT_EQUAL_UINT32(8 * XFER_400K / 1000, metrics.i2cBusUs);
+  TEST_ASSERT_EQUAL_UINT32(2, metrics.i2cFrames);
+}
+
+// An unchanged frame stays off the bus
+void test_unchanged_frame_is_not_written() {
+  boot();
+  writeFrame(0);
+  TEST_ASSERT_EQUAL(0, Wire.transfers().size());
+  TEST_ASSERT_EQUAL(0, Wire1.transfers().size());
+  TEST_ASSERT_EQUAL_UINT32(0, metrics.i2cFrames);
+}
+
+// Bus time follows the clock the bus was started with
+void test_bus_time_at_chosen_clock() {
+  static const uint32_t clocks[] = {100000, 200000, 400000, 1000000};
+  for (uint32_t clock : clocks) {
+    setUp();
+    boot();
+    Wire.setClock(clock);
+    ch423 = initChip(Wire, 0, false);
+    Wire.clearLog();
+    memset(&metrics, 0, sizeof(metrics));
+    out[0] = 0x00;
+    out[2] = 0x00;
+    writeFrame(0);
+    TEST_ASSERT_EQUAL(2, Wire.transfers().size());
+    TEST_ASSERT_EQUAL_UINT32(Wire.transferNs(1), xferNs[0]);
+    TEST_ASSERT_EQUAL_UINT32(20 * (1000000000UL / clock),
+                             Wire.transfers()[0].ns);
+    TEST_ASSERT_EQUAL_UINT32(loggedNs() / 1000, metrics.frameBusUs);
+  }
+}
+
+// Pick lights go out before effects, across both buses
+void test_urgent_registers_first() {
+  boot();
+  memset(out, 0x00, sizeof(out));
+  writeFrame(1 << 4);
+  const std::vector<I2cTransfer> &a = Wire.transfers();
+  const std::vector<I2cTransfer> &b = Wire1.transfers();
+  TEST_ASSERT_EQUAL(3, a.size());
+  TEST_ASSERT_EQUAL(3, b.size());
+  assertWrite(b[0], CH423_GPO_L, 0x00, XFER_400K);
+  TEST_ASSERT_TRUE(b[0].seq < a[0].seq);
+}
+
+// Effects yield to a pick light that arrives while they are written
+void test_effects_deferred_for_pick() {
+  boot();
+  memset(out, 0x00, sizeof(out));
+  urgentRegs = 1; // A pick light is waiting for the next frame
+  writeFrame(0);
+  TEST_ASSERT_EQUAL(0, Wire.transfers().size());
+  TEST_ASSERT_EQUAL(0, Wire1.transfers().size());
+  TEST_ASSERT_EQUAL_UINT32(1, metrics.i2cDeferred);
+  urgentRegs = 0;
+  writeFrame(0);
+  TEST_ASSERT_EQUAL(3, Wire.transfers().size());
+  TEST_ASSERT_EQUAL(3, Wire1.transfers().size());
+}
+
+// blinkPin() to the register bit of the pin, active low
+void test_blink_pin_reaches_register() {
+  boot();
+  blinkPin(13, PRIO_PICK); // GPO5 of the first chip
+  blinkLoop();
+  TEST_ASSERT_EQUAL_HEX16(0xffdf, chip0.gpo);
+  TEST_ASSERT_EQUAL_HEX8(0xff, chip0.io);
+  TEST_ASSERT_EQUAL_HEX16(0xffff, chip1.gpo);
+  TEST_ASSERT_EQUAL(1, Wire.transfers().size());
+  TEST_ASSERT_EQUAL(0, Wire1.transfers().size());
+
+  blinkPin(30, PRIO_PICK); // GPIO6 of the second chip, 13 goes dark
+  blinkLoop();
+  TEST_ASSERT_EQUAL_HEX16(0xffff, chip0.gpo);
+  TEST_ASSERT_EQUAL_HEX8(0xbf, chip1.io);
+
+  hostMillis += blinkFill; // Off half of the blink cycle
+  blinkLoop();
+  TEST_ASSERT_EQUAL_HEX8(0xff, chip1.io);
+}
+
+// A dimmed pin is lit in the bit planes of its level
+void test_dimmed_pin_bit_planes() {
+  hostConfig.brightness = 5; // Planes 0 and 2
+  boot();
+  channel_t ch;
+  setChannel(&ch, millis(), BLINK_FOREVER, 1000, 1000);
+  blinkChannel(40, &ch); // GPO8 of the second chip
+  static const bool lit[BAM_BITS] = {true, false, true};
+  for (int p = 0; p < BAM_BITS; p++) {
+    blinkLoop();
+    TEST_ASSERT_EQUAL(p, bamPlane);
+    TEST_ASSERT_EQUAL(lit[p], !(chip1.gpo & 0x0100));
+    TEST_ASSERT_TRUE(bamTimer->armed);
+    esp_timer_fire(bamTimer);
+  }
+}
+
+// Open drain GPO only drives the low bits
+void test_open_drain() {
+  boot();
+  ch423->pinMode(DFRobot_CH423::eGPO, DFRobot_CH423::eOPEN_DRAIN);
+  TEST_ASSERT_TRUE(chip0.openDrain());
+  out[1] = 0xf0;
+  out[2] = 0x0f;
+  writeFrame(0);
+  TEST_ASSERT_EQUAL_HEX16(0x0ff0, chip0.gpo);
+  TEST_ASSERT_EQUAL_HEX16(0xf00f, chip0.gpoDriven());
+  TEST_ASSERT_EQUAL_HEX16(0xffff, chip1.gpoDriven());
+}
+
+// Driven GPIO lines read back wired-AND with the board
+void test_gpio_readback() {
+  boot();
+  chip0.drive(0xf7); // Line 3 shorted to ground
+  TEST_ASSERT_EQUAL_HEX8(0xf7, ch423->digitalRead(DFRobot_CH423::eGPIOTotal));
+  out[0] = 0x0f;
+  writeFrame(0);
+  TEST_ASSERT_EQUAL_HEX8(0x07, ch423->digitalRead(DFRobot_CH423::eGPIOTotal));
+  const I2cTransfer &t = Wire.transfers().back();
+  TEST_ASSERT_EQUAL_HEX8(CH423_RD_IO, t.addr);
+  TEST_ASSERT_TRUE(t.read);
+  TEST_ASSERT_EQUAL_UINT32(XFER_400K, t.ns);
+}
+
+// Inputs are polled, debounced over two polls and queued
+void test_input_poll() {
+  hostConfig.inputs[2] = 7;
+  boot();
+  chip0.drive(0xfb); // Button on line 2 pressed
+  input_t event;
+  hostMillis += INPUT_POLL;
+  blinkLoop();
+  TEST_ASSERT_FALSE(nextInput(&event)); // Seen once, not yet debounced
+  hostMillis += INPUT_POLL;
+  blinkLoop();
+  TEST_ASSERT_TRUE(nextInput(&event));
+  TEST_ASSERT_EQUAL(7, event.pin);
+  TEST_ASSERT_EQUAL(2, event.line);
+  TEST_ASSERT_TRUE(event.active);
+  TEST_ASSERT_EQUAL_UINT32(2, metrics.i2cReads);
+  TEST_ASSERT_EQUAL_UINT32(loggedNs() / 1000, metrics.i2cBusUs);
+}
+
+// GPO15 latches a GPIO change, even a pulse, until the lines are read
+void test_interrupt_latch() {
+  hostConfig.inputs[0] = 0;
+  boot();
+  ch423->enableInterrupt(); // SET_IO 0xff becomes the reference
+  TEST_ASSERT_TRUE(chip0.interrupts());
+  TEST_ASSERT_FALSE(chip0.latched);
+  chip0.drive(0xfe);
+  chip0.drive(0xff); // Released before anyone looked
+  TEST_ASSERT_TRUE(chip0.latched);
+  TEST_ASSERT_EQUAL_HEX16(0, chip0.gpoLevel() & 0x8000);
+  TEST_ASSERT_EQUAL_HEX8(0xff, ch423->digitalRead(DFRobot_CH423::eGPIOTotal));
+  TEST_ASSERT_FALSE(chip0.latched);
+  TEST_ASSERT_EQUAL_HEX16(0x8000, chip0.gpoLevel() & 0x8000);
+  ch423->disableInterrupt();
+  chip0.drive(0x00);
+  TEST_ASSERT_FALSE(chip0.latched);
+}
+
+// Sleep lasts until the next command
+void test_sleep() {
+  boot();
+  ch423->sleep();
+  TEST_ASSERT_TRUE(chip0.asleep);
+  TEST_ASSERT_EQUAL_HEX8(Ch423::IO_EN | Ch423::SLEEP, chip0.args);
+  out[0] = 0;
+  writeFrame(0);
+  TEST_ASSERT_FALSE(chip0.asleep);
+  TEST_ASSERT_EQUAL_HEX8(0, chip0.io);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_boot_sets_up_chips);
+  RUN_TEST(test_boot_inputs_leave_gpio_undriven);
+  RUN_TEST(test_missing_chip);
+  RUN_TEST(test_frame_to_registers);
+  RUN_TEST(test_frame_bus_time);
+  RUN_TEST(test_unchanged_frame_is_not_written);
+  RUN_TEST(test_bus_time_at_chosen_clock);
+  RUN_TEST(test_urgent_registers_first);
+  RUN_TEST(test_effects_deferred_for_pick);
+  RUN_TEST(test_blink_pin_reaches_register);
+  RUN_TEST(test_dimmed_pin_bit_planes);
+  RUN_TEST(test_open_drain);
+  RUN_TEST(test_gpio_readback);
+  RUN_TEST(test_input_poll);
+  RUN_TEST(test_interrupt_latch);
+  RUN_TEST(test_sleep);
+  return UNITY_END();
+}
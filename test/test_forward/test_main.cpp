@@ -0,0 +1,322 @@
+/*
+ * PutToLight - Scan Forwarding Tests
+ *
+ * Copyright (c) 2023 Serhii Nesterenko
+ * Licensed under the MIT License. See LICENSE file in the project root.
+ *
+ * The forward module against collectors listening on the loopback
+ * interface: UDP datagrams, a TCP stream and HTTP POSTs, the spool while
+ * the link is down, and a reboot in the middle of a spool replay.
+ * Run with: pio test -e native -f test_forward
+ */
+
+#include "ptl.hpp"
+#include "firmware.h"
+#include <LittleFS.h>
+#include <Preferences.h>
+#include <WiFi.h>
+#include <thread>
+#include <unity.h>
+
+#define WAIT 1000 // Longest wait for the collector to receive (ms)
+#define DEV "{\"dev\":\"24:0A:C4:00:00:01\","
+
+extern QueueHandle_t fwdQueue;
+extern size_t spoolOffset;
+void forwardStep();
+
+// Collector socket bound to an ephemeral port on 127.0.0.1
+class Listener {
+public:
+  explicit Listener(int type) : type(type) {
+    sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    hostAddr("127.0.0.1", 0, addr);
+    fd = socket(AF_INET, type, 0);
+    bind(fd, (sockaddr *)&addr, sizeof(addr));
+    getsockname(fd, (sockaddr *)&addr, &len);
+    port = ntohs(addr.sin_port);
+    if (type == SOCK_STREAM)
+      listen(fd, 4);
+  }
+  ~Listener() {
+    drop();
+    close(fd);
+  }
+
+  // Bytes received until want of them are in or WAIT ms pass. A stream
+  // collector takes a waiting connection first.
+  std::string receive(size_t want) {
+    std::string in;
+    char buf[2048];
+    pollfd p = {type == SOCK_STREAM ? conn : fd, POLLIN, 0};
+    if (type == SOCK_STREAM && conn < 0) {
+      p.fd = fd;
+      if (poll(&p, 1, WAIT) <= 0)
+        return in;
+      p.fd = conn = accept(fd, nullptr, nullptr);
+      accepted++;
+    }
+    while (in.size() < want && poll(&p, 1, WAIT) > 0) {
+      ssize_t n = recv(p.fd, buf, sizeof(buf), 0);
+      if (n <= 0)
+        break;
+      in.append(buf, n);
+      datagrams++;
+    }
+    return in;
+  }
+
+  // Close the accepted connection, as a collector restart would
+  void drop() {
+    if (conn >= 0)
+      close(conn);
+    conn = -1;
+  }
+
+  uint16_t port;
+  int fd, conn = -1;
+  int accepted = 0;  // Connections taken
+  int datagrams = 0; // Datagrams or stream reads
+  int type;
+};
+
+// HTTP collector answering every POST with 200 and a Date header, on its
+// own thread since the client waits for the answer
+class HttpCollector {
+public:
+  HttpCollector() : thread(&HttpCollector::run, this) {}
+  ~HttpCollector() {
+    stop = true;
+    thread.join();
+  }
+
+  std::string requests; // Request heads and bodies as received
+  int posts = 0;
+  uint16_t port() const { return listener.port; }
+
+private:
+  void run() {
+    std::string in;
+    while (!stop) {
+      in += listener.receive(1);
+      size_t head = in.find("\r\n\r\n");
+      const char *len = strstr(in.c_str(), "Content-Length: ");
+      if (head == std::string::npos || len == nullptr ||
+          in.size() < head + 4 + atoi(len + 16))
+        continue;
+      size_t end = head + 4 + atoi(len + 16);
+      requests += in.substr(0, end);
+      in.erase(0, end);
+      posts++;
+      const char ok[] = "HTTP/1.1 200 OK\r\n"
+                        "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+                        "Content-Length: 2\r\n\r\n{}";
+      send(listener.conn, ok, sizeof(ok) - 1, MSG_NOSIGNAL);
+    }
+  }
+
+  Listener listener{SOCK_STREAM};
+  volatile bool stop = false;
+  std::thread thread;
+};
+
+// Forward to a collector on this host, started as at boot
+static void start(Proto proto, uint16_t port, int batch) {
+  hostConfig.fwdProto = proto;
+  hostConfig.fwdPort = port;
+  hostConfig.fwdBatch = batch;
+  strcpy(hostConfig.fwdHost, "127.0.0.1");
+  initForward();
+}
+
+// Run the forward task until every queued event is sent or spooled
+static void pump() {
+  while (uxQueueMessagesWaiting(fwdQueue) > 0)
+    forwardStep();
+  forwardStep(); // Nothing to wait for on the host: sends or replays
+}
+
+// Queue scans n..n+count-1
+static void scans(int n, int count) {
+  char json[40];
+  for (int i = n; i < n + count; i++) {
+    snprintf(json, sizeof(json), "{\"code\":\"C%04d\"}", i);
+    forwardScan(json);
+  }
+}
+
+// The lines scans n..n+count-1 arrive as
+static std::string lines(int n, int count) {
+  std::string out;
+  char line[64];
+  for (int i = n; i < n + count; i++) {
+    snprintf(line, sizeof(line), DEV "\"code\":\"C%04d\"}\n", i);
+    out += line;
+  }
+  return out;
+}
+
+void setUp() {
+  defaultConfig();
+  LittleFS.format();
+  hostNvs.clear();
+  WiFi.upFor = -1;
+  metrics = metrics_t();
+}
+
+void tearDown() {}
+
+// A full batch goes out at once, the rest when the latency is up
+void test_udp() {
+  Listener collector(SOCK_DGRAM);
+  start(PROTO_UDP, collector.port, 3);
+  scans(0, 5);
+  pump();
+  TEST_ASSERT_EQUAL_STRING(lines(0, 5).c_str(),
+                           collector.receive(lines(0, 5).size()).c_str());
+  TEST_ASSERT_EQUAL(2, collector.datagrams);
+  TEST_ASSERT_EQUAL(5, metrics.forwarded);
+}
+
+// One connection for all batches, a new one once the collector dropped it
+void test_tcp() {
+  Listener collector(SOCK_STREAM);
+  start(PROTO_TCP, collector.port, 2);
+  scans(0, 4);
+  pump();
+  TEST_ASSERT_EQUAL_STRING(lines(0, 4).c_str(),
+                           collector.receive(lines(0, 4).size()).c_str());
+  scans(4, 2);
+  pump();
+  TEST_ASSERT_EQUAL_STRING(lines(4, 2).c_str(),
+                           collector.receive(lines(4, 2).size()).c_str());
+  TEST_ASSERT_EQUAL(1, collector.accepted);
+
+  collector.drop();
+  scans(6, 2);
+  pump();
+  TEST_ASSERT_EQUAL_STRING(lines(6, 2).c_str(),
+                           collector.receive(lines(6, 2).size()).c_str());
+  TEST_ASSERT_EQUAL(2, collector.accepted);
+  TEST_ASSERT_EQUAL(8, metrics.forwarded);
+}
+
+// NDJSON POSTs to the configured path; the Date header sets the clock
+void test_http() {
+  HttpCollector collector;
+  strcpy(hostConfig.fwdPath, "/scans");
+  start(PROTO_HTTP, collector.port(), 2);
+  scans(0, 4);
+  pump();
+  TEST_ASSERT_EQUAL(2, collector.posts);
+  TEST_ASSERT_EQUAL(4, metrics.forwarded);
+  TEST_ASSERT_EQUAL(784111777, pushedTime);
+  const std::string &req = collector.requests;
+  TEST_ASSERT_EQUAL(0, req.find("POST /scans HTTP/1.1\r\n"));
+  TEST_ASSERT_TRUE(req.find("Content-Type: application/x-ndjson\r\n") <
+                   req.find("\r\n\r\n"));
+  TEST_ASSERT_TRUE(req.find("\r\n\r\n" + lines(0, 2)) != std::string::npos);
+  TEST_ASSERT_TRUE(req.find("\r\n\r\n" + lines(2, 2)) != std::string::npos);
+}
+
+// Batches are spooled while the link is down and replayed in order
+// before the next batch once it is back
+void test_spool() {
+  Listener collector(SOCK_DGRAM);
+  start(PROTO_UDP, collector.port, 2);
+  WiFi.upFor = 0;
+  scans(0, 4);
+  pump();
+  TEST_ASSERT_EQUAL(4, metrics.fwdSpooled);
+  TEST_ASSERT_EQUAL_STRING(lines(0, 4).c_str(),
+                           LittleFS.files["/spool.jsonl"]->c_str());
+  TEST_ASSERT_EQUAL_STRING("", collector.receive(1).c_str());
+
+  WiFi.upFor = -1;
+  scans(4, 2);
+  pump();
+  TEST_ASSERT_EQUAL_STRING(lines(0, 6).c_str(),
+                           collector.receive(lines(0, 6).size()).c_str());
+  TEST_ASSERT_FALSE(LittleFS.exists("/spool.jsonl"));
+  TEST_ASSERT_EQUAL(0, spoolOffset);
+  TEST_ASSERT_EQUAL(2, metrics.forwarded);
+}
+
+// A reboot in the middle of a replay resumes after the delivered part:
+// every spooled line arrives exactly once
+void test_spool_reboot() {
+  Listener collector(SOCK_DGRAM);
+  const int n = 300; // About 14 KB, several replay chunks
+  std::string spool = lines(0, n);
+  LittleFS.open("/spool.jsonl", FILE_WRITE)
+      .write((const uint8_t *)spool.data(), spool.size());
+  start(PROTO_UDP, collector.port, 2);
+
+  WiFi.upFor = 2; // Two chunks, then the link drops
+  forwardStep();
+  std::string first = collector.receive(spool.size());
+  TEST_ASSERT_TRUE(first.size() > 0 && first.size() < spool.size());
+  TEST_ASSERT_EQUAL(first.size(), spoolOffset);
+  Preferences prefs;
+  prefs.begin("fwd", true);
+  TEST_ASSERT_EQUAL(first.size(), prefs.getUInt("offset"));
+
+  spoolOffset = 0; // Reboot: RAM is gone, NVS and the spool are not
+  WiFi.upFor = -1;
+  start(PROTO_UDP, collector.port, 2);
+  TEST_ASSERT_EQUAL(first.size(), spoolOffset);
+  forwardStep();
+  std::string rest = collector.receive(spool.size() - first.size());
+  TEST_ASSERT_EQUAL(spool.size(), first.size() + rest.size());
+  TEST_ASSERT_TRUE(first + rest == spool);
+  TEST_ASSERT_FALSE(LittleFS.exists("/spool.jsonl"));
+  TEST_ASSERT_EQUAL(0, prefs.getUInt("offset"));
+}
+
+// An offset without its spool, or past its end, starts over
+void test_stale_offset() {
+  Preferences prefs;
+  prefs.begin("fwd", false);
+  prefs.putUInt("offset", 5000);
+  start(PROTO_UDP, 9, 2);
+  TEST_ASSERT_EQUAL(0, spoolOffset);
+  TEST_ASSERT_EQUAL(0, prefs.getUInt("offset"));
+
+  Listener collector(SOCK_DGRAM);
+  std::string spool = lines(0, 3);
+  LittleFS.open("/spool.jsonl", FILE_WRITE)
+      .write((const uint8_t *)spool.data(), spool.size());
+  prefs.putUInt("offset", 5000);
+  start(PROTO_UDP, collector.port, 2);
+  forwardStep();
+  TEST_ASSERT_EQUAL_STRING(spool.c_str(),
+                           collector.receive(spool.size()).c_str());
+}
+
+// A spooled line too long for the replay buffer is skipped up to its
+// newline; the lines after it arrive whole
+void test_spool_long_line() {
+  Listener collector(SOCK_DGRAM);
+  std::string spool = lines(0, 2) + std::string(5000, 'x') + "\n";
+  spool += lines(2, 2);
+  LittleFS.open("/spool.jsonl", FILE_WRITE)
+      .write((const uint8_t *)spool.data(), spool.size());
+  start(PROTO_UDP, collector.port, 2);
+  forwardStep();
+  TEST_ASSERT_EQUAL_STRING(lines(0, 4).c_str(),
+                           collector.receive(spool.size()).c_str());
+  TEST_ASSERT_FALSE(LittleFS.exists("/spool.jsonl"));
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_udp);
+  RUN_TEST(test_tcp);
+  RUN_TEST(test_http);
+  RUN_TEST(test_spool);
+  RUN_TEST(test_spool_reboot);
+  RUN_TEST(test_stale_offset);
+  RUN_TEST(test_spool_long_line);
+  return UNITY_END();
+}
@@ -0,0 +1,246 @@
+/*
+ * PutToLight - GS1 Parser Tests
+ *
+ * Copyright (c) 2023 Serhii Nesterenko
+ * Licensed under the MIT License. See LICENSE file in the project root.
+ *
+ * Gs1Parser on element strings and Digital Link URIs, whole and in BLE
+ * sized chunks, and its throughput over a corpus of label formats.
+ * Run with: pio test -e native -f test_gs1
+ */
+
+#include "ptl.hpp"
+#include "firmware.h"
+#include <chrono>
+#include <unity.h>
+
+#define CHUNK 20           // Bytes per BLE notification
+#define BENCH_ROUNDS 20000 // Passes over the corpus in the benchmark
+
+// Label formats seen at the dock, as the scanner sends them
+static const char *const corpus[] = {
+    // GS1-128 SSCC pallet label
+    "]C100106141412345678908",
+    // GS1-128 carton: content GTIN, best before, count, lot
+    "]C10209521234543213152401313720\x1d" "10ABC123",
+    // GS1-128 routing label: routing code, ship-to postal code
+    "]C1403101\x1d" "42012345",
+    // GS1 DataMatrix on a pharma pack: GTIN, expiry, lot, serial
+    "]d201095060001343521720122510ABC123\x1d" "21SN12345",
+    // GS1 DataBar Expanded: GTIN and net weight
+    "]e001095060001343523103000195",
+    // Element string without symbology identifier
+    "0109506000134352\x1d" "10LOT7",
+    // GS1 Digital Link in a QR code
+    "https://id.gs1.org/01/09506000134352/10/ABC123/21/12345?17=201231",
+    // Digital Link from a brand resolver, GTIN-13 and a link type
+    "https://brand.example/dl/01/9506000134352?linkType=gs1:pip",
+    // Digital Link in QR alphanumeric mode
+    "HTTPS://ID.GS1.ORG/00/106141412345678908",
+    // Plain codes, not GS1
+    "PAL-12-AB-2",
+    "D1-000451",
+};
+
+void setUp() { defaultConfig(); }
+
+void tearDown() {}
+
+// Parse a code the way notifyCallback() gets it, chunk by chunk
+static bool parseChunked(Gs1Parser &p, const char *code, size_t chunk) {
+  size_t len = strlen(code);
+  p.reset();
+  for (size_t i = 0; i < len; i += chunk)
+    p.feed((const uint8_t *)code + i, min(chunk, len - i));
+  return p.end();
+}
+
+static void assertField(const Gs1Parser &p, const char *ai,
+                        const char *value) {
+  const gs1_field_t *f = p.find(ai);
+  TEST_ASSERT_NOT_NULL(f);
+  TEST_ASSERT_EQUAL_STRING(value, f->value);
+  TEST_ASSERT_EQUAL(strlen(value), f->len);
+}
+
+static void assertSameFields(const Gs1Parser &a, const Gs1Parser &b) {
+  TEST_ASSERT_EQUAL(a.n, b.n);
+  for (int i = 0; i < a.n; i++) {
+    TEST_ASSERT_EQUAL_STRING(a.field[i].ai, b.field[i].ai);
+    TEST_ASSERT_EQUAL_STRING(a.field[i].value, b.field[i].value);
+  }
+}
+
+static bool parse(Gs1Parser &p, const char *code) {
+  return p.parse(code, strlen(code));
+}
+
+// Fixed-length fields need no GS, variable ones end with it
+void test_element_string() {
+  Gs1Parser p;
+  TEST_ASSERT_TRUE(parse(p, corpus[1]));
+  TEST_ASSERT_EQUAL(4, p.n);
+  assertField(p, "02", "09521234543213");
+  assertField(p, "15", "240131");
+  assertField(p, "37", "20");
+  assertField(p, "10", "ABC123");
+  TEST_ASSERT_NULL(p.find("00"));
+}
+
+// Four-digit AIs and a symbology identifier
+void test_four_digit_ai() {
+  Gs1Parser p;
+  TEST_ASSERT_TRUE(parse(p, corpus[4]));
+  assertField(p, "01", "09506000134352");
+  assertField(p, "3103", "000195");
+}
+
+// Codes that are not GS1 element strings
+void test_not_gs1() {
+  Gs1Parser p;
+  TEST_ASSERT_FALSE(parse(p, "PAL-12-AB-2"));
+  TEST_ASSERT_EQUAL(0, p.n);
+  TEST_ASSERT_FALSE(parse(p, "]A0123456"));     // Code 39
+  TEST_ASSERT_FALSE(parse(p, "]C10012345"));    // SSCC cut short
+  TEST_ASSERT_FALSE(parse(p, "]C1\x1d"));        // No field at all
+  TEST_ASSERT_FALSE(parse(p, "]C10600000000")); // Unassigned AI
+}
+
+// Chunk boundaries anywhere give the same fields
+void test_chunked_equals_whole() {
+  for (const char *code : corpus) {
+    Gs1Parser whole, part;
+    bool ok = parse(whole, code);
+    for (size_t chunk = 1; chunk <= strlen(code); chunk++) {
+      TEST_ASSERT_EQUAL(ok, parseChunked(part, code, chunk));
+      assertSameFields(whole, part);
+    }
+  }
+}
+
+// Only GS1_FIELDS fields are kept, longer values are dropped
+void test_limits() {
+  Gs1Parser p;
+  std::string code = "]C1";
+  for (int i = 0; i < GS1_FIELDS + 2; i++)
+    code += "10L" + std::to_string(i) + "\x1d";
+  TEST_ASSERT_TRUE(parse(p, code.c_str()));
+  TEST_ASSERT_EQUAL(GS1_FIELDS, p.n);
+  std::string lot(GS1_VALUE + 1, 'X');
+  code = "]C10109506000134352\x1d" "10" + lot + "\x1d" "21S1";
+  TEST_ASSERT_TRUE(parse(p, code.c_str()));
+  TEST_ASSERT_EQUAL(2, p.n);
+  TEST_ASSERT_NULL(p.find("10"));
+  assertField(p, "21", "S1");
+}
+
+// A Digital Link gives the fields of the matching element string
+void test_digital_link() {
+  Gs1Parser link, element;
+  TEST_ASSERT_TRUE(parse(link, corpus[6]));
+  TEST_ASSERT_TRUE(
+      parse(element, "]Q3010950600013435217201231" "10ABC123\x1d" "2112345"));
+  TEST_ASSERT_EQUAL(4, link.n);
+  assertField(link, "01", "09506000134352");
+  assertField(link, "10", "ABC123");
+  assertField(link, "21", "12345");
+  assertField(link, "17", "201231");
+  for (int i = 0; i < element.n; i++)
+    assertField(link, element.field[i].ai, element.field[i].value);
+}
+
+// Resolver path segments before the primary key are skipped, short
+// GTINs padded and parameters that are not AIs ignored
+void test_digital_link_resolver() {
+  Gs1Parser p;
+  TEST_ASSERT_TRUE(parse(p, corpus[7]));
+  TEST_ASSERT_EQUAL(1, p.n);
+  assertField(p, "01", "09506000134352");
+  TEST_ASSERT_TRUE(parse(p, "https://example.com/01/12345670"));
+  assertField(p, "01", "00000012345670");
+  TEST_ASSERT_TRUE(parse(p, corpus[8]));
+  assertField(p, "00", "106141412345678908");
+  TEST_ASSERT_TRUE(parse(p, "https://x.example/00/106141412345678908/"
+                            "?403=101&linkType=all#top"));
+  TEST_ASSERT_EQUAL(2, p.n);
+  assertField(p, "403", "101");
+}
+
+// Values are %-decoded; an escaped separator is part of the value
+void test_digital_link_escapes() {
+  Gs1Parser p;
+  TEST_ASSERT_TRUE(
+      parse(p, "https://id.gs1.org/01/09506000134352/10/AB%2F1%2f2?21=A%26B"));
+  assertField(p, "10", "AB/1/2");
+  assertField(p, "21", "A&B");
+}
+
+// Links that do not carry a primary key with proper AI/value pairs
+void test_digital_link_invalid() {
+  static const char *const bad[] = {
+      "https://example.com/products/123",                  // No key
+      "https://id.gs1.org/01/09506000134352/10",           // Value missing
+      "https://id.gs1.org/00/123",                         // Wrong length
+      "https://id.gs1.org/01/09506000134352/lot/ABC",      // Not an AI
+      "https://id.gs1.org/01/09506000134352/10/A%G1",      // Bad escape
+      "https://id.gs1.org/01/09506000134352/10/A%4",       // Cut escape
+      "https://id.gs1.org?01=09506000134352",              // Key in query
+      "https://id.gs1.org/01/09506000134352?17=2012",      // Wrong length
+      "h ttps://id.gs1.org/01/09506000134352",             // Not a URI
+  };
+  Gs1Parser p;
+  for (const char *code : bad) {
+    TEST_ASSERT_FALSE_MESSAGE(parse(p, code), code);
+    TEST_ASSERT_EQUAL(0, p.n);
+  }
+}
+
+// Throughput over the corpus, whole codes and BLE chunks
+void test_throughput() {
+  static const char *const modes[] = {"whole", "chunked"};
+  const int codes = BENCH_ROUNDS * (sizeof(corpus) / sizeof(corpus[0]));
+  Gs1Parser p;
+  int expected = 0; // Fields in one pass
+  for (const char *code : corpus) {
+    parse(p, code);
+    expected += p.n;
+  }
+  for (int mode = 0; mode < 2; mode++) {
+    size_t bytes = 0;
+    int fields = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+      for (const char *code : corpus) {
+        if (mode == 0)
+          parse(p, code);
+        else
+          parseChunked(p, code, CHUNK);
+        fields += p.n;
+        bytes += strlen(code);
+      }
+    }
+    double ns = std::chrono::duration<double, std::nano>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+    char msg[120];
+    snprintf(msg, sizeof(msg), "%s: %.0f ns/code, %.0f MB/s", modes[mode],
+             ns / codes, bytes / ns * 1000.0);
+    TEST_MESSAGE(msg);
+    TEST_ASSERT_EQUAL(BENCH_ROUNDS * expected, fields);
+  }
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_element_string);
+  RUN_TEST(test_four_digit_ai);
+  RUN_TEST(test_not_gs1);
+  RUN_TEST(test_chunked_equals_whole);
+  RUN_TEST(test_limits);
+  RUN_TEST(test_digital_link);
+  RUN_TEST(test_digital_link_resolver);
+  RUN_TEST(test_digital_link_escapes);
+  RUN_TEST(test_digital_link_invalid);
+  RUN_TEST(test_throughput);
+  return UNITY_END();
+}
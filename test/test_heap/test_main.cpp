@@ -0,0 +1,384 @@
+/*
+ * PutToLight - Heap Soak Test
+ *
+ * Copyright (c) 2023 Serhii Nesterenko
+ * Licensed under the MIT License. See LICENSE file in the project root.
+ *
+ * Weeks of warehouse traffic run through the WebSocket module on a model
+ * of the ESP32 heap: one DRAM region where blocks are placed best-fit
+ * behind an 8-byte header, as multi_heap of ESP-IDF 4.4 places them.
+ * Whatever the module allocates with new, itself or through the web
+ * server library - the event buffers at boot, a buffer an event or a
+ * command would allocate - is placed in the model, so a change back to
+ * allocating per event fails the test. The documents of main.cpp are
+ * placed at boot with their sizes from ptl.hpp; what the library and lwIP
+ * allocate per connection, request and message is modelled. The largest
+ * free block is sampled with every status update, as sampleHeap() does.
+ * Run with: pio test -e native -f test_heap
+ */
+
+#include "ptl.hpp"
+#include "firmware.h"
+#include <ESPAsyncWebServer.h>
+#include <map>
+#include <new>
+#include <random>
+#include <unity.h>
+
+#define REGION 98304 // Largest DRAM heap region with WiFi and BLE up
+#define HEADER 8     // Allocator header of every block
+#define WEEKS 4      // Simulated uptime
+#define HOUR 3600
+#define DAY (24 * HOUR)
+#define WEEK (7 * DAY)
+
+// Allocations of the library and lwIP (bytes)
+#define CONN_OBJ 340    // AsyncClient and its TCP control block
+#define REQUEST_OBJ 260 // AsyncWebServerRequest with its headers
+#define WS_CLIENT 120   // AsyncWebSocketClient
+#define SSE_CLIENT 64   // AsyncEventSourceClient
+#define WS_MESSAGE 40   // Queued message referring to a shared buffer
+#define SSE_MESSAGE 40  // AsyncEventSourceMessage, plus the formatted event
+#define PBUF 56         // lwIP pbuf header, plus the segment
+
+// Traffic (bytes)
+#define EVENT_SCAN 160     // Scan event data, code and location
+#define EVENT_STATUS 700   // Status event data with eight devices
+#define EVENT_MAX 1024     // Longest event data sent
+#define EVENT_WRAP 20      // {"ev":...,"data":...} around the data
+#define METRICS_REPLY 1100 // /api/metrics response
+#define SESSION_BODY 5200  // Order of 100 lines
+
+extern AsyncWebSocket ws;
+extern DynamicJsonDocument wsCommand;
+
+// Best-fit heap over one region
+class HeapModel {
+public:
+  HeapModel() { blocks[0] = {REGION, false}; }
+
+  // Offset of a new block for size bytes, -1 if no free block fits. The
+  // smallest free block that fits is split, the lowest of equal ones.
+  int alloc(size_t size) {
+    uint32_t need = (size + HEADER + 7) & ~7u;
+    auto best = blocks.end();
+    for (auto b = blocks.begin(); b != blocks.end(); b++) {
+      if (!b->second.used && b->second.size >= need &&
+          (best == blocks.end() || b->second.size < best->second.size))
+        best = b;
+    }
+    if (best == blocks.end()) {
+      failures++;
+      return -1;
+    }
+    uint32_t at = best->first, left = best->second.size - need;
+    best->second = {need, true};
+    if (left > 0)
+      blocks[at + need] = {left, false};
+    return at;
+  }
+
+  // Free a block and merge it with free neighbours
+  void free(int at) {
+    if (at < 0)
+      return;
+    auto b = blocks.find(at);
+    b->second.used = false;
+    auto next = std::next(b);
+    if (next != blocks.end() && !next->second.used) {
+      b->second.size += next->second.size;
+      blocks.erase(next);
+    }
+    if (b != blocks.begin()) {
+      auto prev = std::prev(b);
+      if (!prev->second.used) {
+        prev->second.size += b->second.size;
+        blocks.erase(b);
+      }
+    }
+  }
+
+  uint32_t largestFree() const {
+    uint32_t largest = 0;
+    for (auto &b : blocks) {
+      if (!b.second.used && b.second.size > largest)
+        largest = b.second.size;
+    }
+    return largest > HEADER ? largest - HEADER : 0;
+  }
+
+  int failures = 0; // Allocations that found no block
+
+private:
+  struct Block {
+    uint32_t size; // Including the header
+    bool used;
+  };
+  std::map<uint32_t, Block> blocks; // By offset, covering the region
+};
+
+// Block the firmware allocated, where it was placed
+struct Placement {
+  HeapModel *heap;
+  int at; // Offset in the model
+};
+
+// Heap the firmware allocates from while a Firmware scope is open
+static HeapModel *firmwareHeap = nullptr;
+static std::map<void *, Placement> *placed; // Blocks in a model, by address
+static bool placing = false;   // In the allocator, not the firmware
+static int firmwareAllocs = 0; // Blocks the firmware allocated
+
+// Every new of the test binary; placed in the model inside the firmware
+void *operator new(size_t size) {
+  void *p = malloc(size > 0 ? size : 1);
+  if (p == nullptr)
+    throw std::bad_alloc();
+  if (firmwareHeap != nullptr && !placing) {
+    placing = true;
+    if (placed == nullptr)
+      placed = new std::map<void *, Placement>;
+    (*placed)[p] = {firmwareHeap, firmwareHeap->alloc(size)};
+    firmwareAllocs++;
+    placing = false;
+  }
+  return p;
+}
+
+// Every delete; a block placed in the model is freed there too, inside
+// the firmware or not
+void operator delete(void *p) noexcept {
+  if (p != nullptr && placed != nullptr && !placing) {
+    placing = true;
+    auto b = placed->find(p);
+    if (b != placed->end()) {
+      b->second.heap->free(b->second.at);
+      placed->erase(b);
+    }
+    placing = false;
+  }
+  free(p);
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete[](void *p) noexcept { operator delete(p); }
+void operator delete(void *p, size_t) noexcept { operator delete(p); }
+void operator delete[](void *p, size_t) noexcept { operator delete(p); }
+
+// Firmware code running on the model, for the life of the scope
+class Firmware {
+public:
+  explicit Firmware(HeapModel &heap) { firmwareHeap = &heap; }
+  ~Firmware() { firmwareHeap = nullptr; }
+};
+
+// The firmware running on the heap model
+class Soak {
+public:
+  Soak() : server(80), random(1) {
+    // main.cpp allocates the response document, which requests are parsed
+    // into, and the request body buffer; ws.cpp the command document at
+    // start-up and its event buffers in initWs()
+    heap.alloc(REPLY_DOC);
+    heap.alloc(REQUEST_MAX);
+    heap.alloc(wsCommand.capacity());
+    {
+      Firmware firmware(heap);
+      initWs(server);
+    }
+    bootAllocs = firmwareAllocs;
+    firmwareAllocs = 0;
+    connect(0, clients[0]);
+    connect(0, clients[1]);
+    connect(0, sse);
+    boot = heap.largestFree();
+  }
+
+  // Run weeks of traffic. The largest free block is sampled with every
+  // status update, as sampleHeap() does; the lowest sample of every hour
+  // is returned.
+  std::vector<uint32_t> run(int weeks) {
+    std::vector<uint32_t> hours;
+    uint32_t low = UINT32_MAX;
+    for (uint32_t t = 0; t < (uint32_t)weeks * WEEK; t++) {
+      for (auto f = frees.begin(); f != frees.end() && f->first <= t;)
+        heap.free(f->second), f = frees.erase(f);
+      ws.sendQueued(); // Events of the second before went out
+      second(t);
+      if (t % 10 == 0)
+        low = std::min(low, heap.largestFree());
+      if (t % HOUR == HOUR - 1) {
+        hours.push_back(low);
+        low = UINT32_MAX;
+      }
+    }
+    return hours;
+  }
+
+  HeapModel heap;
+  uint32_t boot;      // Largest free block after boot
+  int bootAllocs = 0; // Blocks the firmware allocated at boot
+
+private:
+  // Long-lived client connection, replaced after a random lifetime as
+  // browsers reload and handhelds roam
+  struct Client {
+    int conn = -1, obj = -1;
+    uint32_t until = 0;
+    AsyncWebSocketClient *socket = nullptr; // WebSocket clients only
+  };
+
+  // Traffic of one second: scans during the two shifts, status updates,
+  // a dashboard polling metrics, orders and WebSocket commands
+  void second(uint32_t t) {
+    uint32_t day = t % DAY;
+    bool shift = day >= 6 * HOUR && day < 22 * HOUR;
+    for (Client *c : {&clients[0], &clients[1], &sse}) {
+      if (t >= c->until)
+        connect(t, *c);
+    }
+    if (shift && random() % 6 == 0)
+      event(t, "scan", EVENT_SCAN + random() % 40);
+    if (t % 10 == 0)
+      event(t, "status", EVENT_STATUS + random() % 200);
+    if (t % 5 == 0)
+      request(t, 0, METRICS_REPLY);
+    if (shift && random() % 1200 == 0)
+      request(t, SESSION_BODY + random() % 1000, 120);
+    if (shift && random() % 600 == 0)
+      command(t);
+  }
+
+  void connect(uint32_t t, Client &c) {
+    bool socket = &c != &sse;
+    heap.free(c.obj);
+    heap.free(c.conn);
+    if (c.socket != nullptr)
+      ws.disconnect(c.socket);
+    c.conn = heap.alloc(CONN_OBJ);
+    c.obj = heap.alloc(socket ? WS_CLIENT : SSE_CLIENT);
+    c.socket = socket ? ws.connect() : nullptr;
+    c.until = t + 600 + random() % (8 * HOUR);
+  }
+
+  // Block freed a second or two later, once the peer acknowledged it
+  void later(uint32_t t, int at) { frees.emplace(t + 1 + random() % 2, at); }
+
+  // An event with len bytes of data to every SSE and WebSocket client
+  void event(uint32_t t, const char *name, size_t len) {
+    static char data[EVENT_MAX + 1];
+    snprintf(data, sizeof(data), "{\"c\":\"%0*d\"}", (int)len - 8, 0);
+    {
+      Firmware firmware(heap);
+      wsEvent(data, name);
+    }
+    len += EVENT_WRAP;
+    for (int i = 0; i < 2; i++) {
+      later(t, heap.alloc(WS_MESSAGE));
+      later(t, heap.alloc(PBUF + len));
+    }
+    later(t, heap.alloc(SSE_MESSAGE + len + 30));
+    later(t, heap.alloc(PBUF + len + 30));
+  }
+
+  // HTTP request on a connection of its own; the body is parsed into the
+  // documents main.cpp allocated at boot
+  void request(uint32_t t, size_t body, size_t reply) {
+    later(t, heap.alloc(CONN_OBJ));
+    later(t, heap.alloc(REQUEST_OBJ));
+    if (body > 0)
+      later(t, heap.alloc(PBUF + 1436)); // Body segments, one at a time
+    later(t, heap.alloc(reply + 64));    // Response stream
+    later(t, heap.alloc(PBUF + reply + 120));
+  }
+
+  // WebSocket command with its acknowledgement
+  void command(uint32_t t) {
+    char text[64]; // Parsed in place
+    size_t len = snprintf(text, sizeof(text),
+                          "{\"id\":%u,\"cmd\":\"setTime\",\"t\":%u}",
+                          (unsigned)t, 1700000000u + t);
+    {
+      Firmware firmware(heap);
+      ws.receive(clients[0].socket, text, len);
+    }
+    later(t, heap.alloc(WS_MESSAGE + 40));
+    later(t, heap.alloc(PBUF + 40));
+  }
+
+  AsyncWebServer server;
+  std::minstd_rand random;
+  Client clients[2], sse;
+  std::multimap<uint32_t, int> frees; // Blocks due to be freed, by second
+};
+
+// Lowest of the hourly samples of one week
+static uint32_t weekLow(const std::vector<uint32_t> &hours, int week) {
+  uint32_t low = UINT32_MAX;
+  for (int h = week * 7 * 24; h < (week + 1) * 7 * 24; h++)
+    low = std::min(low, hours[h]);
+  return low;
+}
+
+// The firmware soaked for WEEKS, run once for all tests
+struct Result {
+  uint32_t boot;       // Largest free block after boot
+  uint32_t low[WEEKS]; // Lowest sample of every week
+  int failures;        // Allocations that found no block
+  int bootAllocs;      // Blocks the firmware allocated at boot
+  int trafficAllocs;   // Blocks it allocated for events and commands
+};
+
+static const Result &soak() {
+  static Result r;
+  static bool done;
+  if (done)
+    return r;
+  static Soak *soak = new Soak(); // Holds the event buffers, never freed
+  std::vector<uint32_t> hours = soak->run(WEEKS);
+  char line[160];
+  int n = snprintf(line, sizeof(line), "boot %u, weekly low",
+                   (unsigned)soak->boot);
+  r.boot = soak->boot;
+  for (int w = 0; w < WEEKS; w++) {
+    r.low[w] = weekLow(hours, w);
+    n += snprintf(line + n, sizeof(line) - n, " %u", (unsigned)r.low[w]);
+  }
+  r.failures = soak->heap.failures;
+  r.bootAllocs = soak->bootAllocs;
+  r.trafficAllocs = firmwareAllocs;
+  done = true;
+  TEST_MESSAGE(line);
+  return r;
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+// The largest free block does not drift over the weeks: every week goes
+// as low as the first within the jitter of the long-lived connections
+void test_no_drift() {
+  const Result &r = soak();
+  TEST_ASSERT_EQUAL(0, r.failures);
+  for (int w = 1; w < WEEKS; w++) {
+    TEST_ASSERT_GREATER_OR_EQUAL(r.low[0] - 2048, r.low[w]);
+    TEST_ASSERT_LESS_OR_EQUAL(r.low[0] + 2048, r.low[w]);
+  }
+}
+
+// Event buffers are allocated at boot and nothing after: no event or
+// command allocates, and the pool is large enough that none is dropped
+void test_pools_at_boot() {
+  const Result &r = soak();
+  TEST_ASSERT_GREATER_THAN(0, r.bootAllocs);
+  TEST_ASSERT_EQUAL(0, r.trafficAllocs);
+  TEST_ASSERT_EQUAL(0, metrics.wsDropped);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_no_drift);
+  RUN_TEST(test_pools_at_boot);
+  return UNITY_END();
+}
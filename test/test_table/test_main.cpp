@@ -0,0 +1,352 @@
+/*
+ * PutToLight - Lookup Table Tests
+ *
+ * Copyright (c) 2023 Serhii Nesterenko
+ * Licensed under the MIT License. See LICENSE file in the project root.
+ *
+ * table.json uploads parsed in chunks of any size, string escapes, and a
+ * table of 30000 codes, indexed into the emulated "table" partition and
+ * looked up through findInTable(). Boot time and lookup cost of the index
+ * are measured against table.json deserialized into the heap and scanned,
+ * as main.cpp did before the index.
+ * Run with: pio test -e native -f test_table
+ */
+
+#include "ptl.hpp"
+#include "firmware.h"
+#include <LittleFS.h>
+#include <chrono>
+#include <esp_partition.h>
+#include <unity.h>
+
+#define BIG_CODES 30000 // Codes in the large table
+#define BIG_LOCS 100    // Locations in the large table
+#define BIG_CHUNK 1377  // Upload chunk, not a divisor of anything
+#define BENCH_HEAP 2000 // Lookups timed on the heap table, it is slow
+
+// A table with every kind of entry, and where its codes are
+static const char small[] =
+    "{\"A-01\": [\"PAL-1\", \"PAL-2\", {\"prefix\": \"D1-\"}],\n"
+    " \"A-02\": [\"(00)106141412345678908\", {\"match\": \"B?-*-X\"}],\n"
+    " \"B-01\": [{\"ai\": \"403\", \"prefix\": \"10\"}, \"PAL-3\"]}";
+static const char *const smallFinds[][2] = {
+    {"PAL-1", "A-01"},
+    {"PAL-2", "A-01"},
+    {"PAL-3", "B-01"},
+    {"D1-000451", "A-01"},
+    {"]C100106141412345678908", "A-02"},
+    {"B7-123-X", "A-02"},
+    {"]C1403101\x1d" "42012345", "B-01"},
+    {"PAL-4", ""},
+    {"B7-123-Y", ""},
+};
+
+void setUp() {
+  static bool booted = false;
+  defaultConfig();
+  if (!booted) {
+    readTable(); // Empty flash and no table.json: no table yet
+    booted = true;
+  }
+}
+
+void tearDown() {}
+
+// Upload a table the way the web server hands it over, chunk bytes at a
+// time, and swap it in. Returns the error, nullptr on success.
+static const char *upload(const char *json, size_t len, size_t chunk,
+                          uint32_t *codes = nullptr) {
+  int owner;
+  uint32_t n;
+  int locs;
+  TEST_ASSERT_TRUE(beginTableUpload(&owner));
+  for (size_t i = 0; i < len; i += chunk)
+    feedTableUpload(&owner, (const uint8_t *)json + i, min(chunk, len - i));
+  const char *msg = endTableUpload(&owner, &n, &locs);
+  if (msg == nullptr)
+    checkTable();
+  if (codes != nullptr)
+    *codes = n;
+  return msg;
+}
+
+static const char *upload(const std::string &json, size_t chunk) {
+  return upload(json.c_str(), json.size(), chunk);
+}
+
+// Location of a code, empty if it is unknown
+static std::string find(const char *code) {
+  char loc[PIN_NAME];
+  findInTable(JsonString(code), loc, nullptr);
+  return loc;
+}
+
+static void assertSmall() {
+  for (auto &f : smallFinds)
+    TEST_ASSERT_EQUAL_STRING_MESSAGE(f[1], find(f[0]).c_str(), f[0]);
+}
+
+// Values, escapes and structure split at every byte give the same table,
+// and the uploaded bytes become table.json
+void test_chunk_split() {
+  size_t len = strlen(small);
+  for (size_t chunk = 1; chunk <= len; chunk++) {
+    uint32_t codes;
+    TEST_ASSERT_NULL(upload(small, len, chunk, &codes));
+    TEST_ASSERT_EQUAL(4, codes);
+    assertSmall();
+  }
+  TEST_ASSERT_TRUE(LittleFS.exists("/table.json"));
+  TEST_ASSERT_EQUAL_STRING(small, LittleFS.files["/table.json"]->c_str());
+  TEST_ASSERT_FALSE(LittleFS.exists("/table.up"));
+  TEST_ASSERT_FALSE(LittleFS.exists("/table.rec"));
+  TEST_ASSERT_EQUAL(1, hostMappings); // Old slots unmapped on every swap
+}
+
+// JSON escapes in codes and location names, \u as UTF-8
+void test_escapes() {
+  const char json[] =
+      "{\"Dock \\\"A\\\"\": [\"A\\/1\", \"B\\\\2\", \"C\\n3\\t\"],\n"
+      " \"\\u0042ay \\u00e9\": [\"\\u0044\\u00E9\\u20ac\"],\n"
+      " \"C\": [{\"match\": \"\\u002A\\\\\"}]}";
+  for (size_t chunk = 1; chunk <= sizeof(json) - 1; chunk++) {
+    TEST_ASSERT_NULL(upload(json, sizeof(json) - 1, chunk));
+    TEST_ASSERT_EQUAL_STRING("Dock \"A\"", find("A/1").c_str());
+    TEST_ASSERT_EQUAL_STRING("Dock \"A\"", find("B\\2").c_str());
+    TEST_ASSERT_EQUAL_STRING("Dock \"A\"", find("C\n3\t").c_str());
+    TEST_ASSERT_EQUAL_STRING("Bay \xc3\xa9",
+                             find("D\xc3\xa9\xe2\x82\xac").c_str());
+    TEST_ASSERT_EQUAL_STRING("C", find("any\\").c_str()); // \u002A is *
+    TEST_ASSERT_EQUAL_STRING("", find("A\\/1").c_str());
+  }
+  TEST_ASSERT_EQUAL_STRING("bad escape",
+                           upload("{\"A\": [\"\\u00G0\"]}", 1));
+}
+
+// Malformed tables are refused and the live table stays
+void test_errors() {
+  static const char *const bad[][2] = {
+      {"[]", "table must be an object"},
+      {"{\"A\": \"PAL-1\"}", "codes must be an array"},
+      {"{\"A\": [1]}", "codes must be strings or rules"},
+      {"{\"A\": [\"PAL-1\"]", "table is incomplete"},
+      {"{\"A\": [\"PAL-1\"]} x", "data after the table"},
+      {"{\"A\": [{\"ai\": \"4x\", \"prefix\": \"1\"}]}",
+       "ai must be 2-4 digits"},
+      {"{\"A\": [{\"ai\": \"403\"}]}",
+       "rule must have one of prefix and match"},
+      {"{\"A\": [{\"size\": \"1\"}]}",
+       "rule fields are ai, prefix and match"},
+      {"{\"0123456789012345678901234567890123\": []}",
+       "location name too long"},
+  };
+  TEST_ASSERT_NULL(upload(small, strlen(small), 64));
+  for (auto &b : bad) {
+    const char *msg = upload(b[0], strlen(b[0]), 7);
+    TEST_ASSERT_EQUAL_STRING_MESSAGE(b[1], msg, b[0]);
+  }
+  std::string many = "{";
+  for (int i = 0; i <= 128; i++)
+    many += (i > 0 ? ",\"L" : "\"L") + std::to_string(i) + "\": []";
+  TEST_ASSERT_EQUAL_STRING("too many locations", upload(many + "}", 100));
+  assertSmall();
+  TEST_ASSERT_EQUAL_STRING(small, LittleFS.files["/table.json"]->c_str());
+}
+
+// Rules on the whole code and on GS1 fields, and which one wins
+void test_rules() {
+  const char json[] =
+      "{\"P1\": [{\"prefix\": \"D1-\"}],\n"
+      " \"P2\": [{\"prefix\": \"D1-7\"}],\n"
+      " \"M1\": [{\"match\": \"*-X\"}, {\"match\": \"B?-*\"}],\n"
+      " \"M2\": [{\"match\": \"B?-*-X\"}, {\"match\": \"??\"}],\n"
+      " \"M3\": [{\"match\": \"*-Y\"}, {\"match\": \"C**1\"}],\n"
+      " \"A1\": [{\"ai\": \"403\", \"prefix\": \"10\"}],\n"
+      " \"A2\": [{\"ai\": \"10\", \"match\": \"L?T*\"}],\n"
+      " \"S1\": [{\"prefix\": \"]C1\"}],\n"
+      " \"K1\": [\"(01)09506000134352\", \"D1-7777\"]}";
+  static const char *const finds[][2] = {
+      {"D1-000451", "P1"},       // Prefix
+      {"D1-", "P1"},             // A prefix matches itself
+      {"D1-7000", "P2"},         // Longer prefix wins
+      {"D1-7777", "K1"},         // Exact code before rules
+      {"D1-7-X", "P2"},          // More literals than *-X and B?-*
+      {"ZZ-X", "M1"},            // * at the start
+      {"-X", "M1"},              // * matching nothing
+      {"B7-12-X", "M2"},         // B?-*-X has more literals than B?-*
+      {"B7-12-Y", "M1"},         // B?-* and *-Y tie, the first rule wins
+      {"Q7", "M2"},              // ? is one byte
+      {"C1", "M3"},              // ** is one *
+      {"CAB1", "M3"},
+      {"B7", "M2"},
+      {"Q", ""},
+      {"Q78", ""},
+      {"]C1403101", "A1"},       // AI rule on 403
+      {"]C10109506000134352\x1d" "10LOT7", "K1"}, // Key before rules
+      {"]C10109506000134351\x1d" "10LOT7", "A2"}, // More literals than ]C1
+      {"]C10109506000134351\x1d" "10LOST", "S1"},
+  };
+  TEST_ASSERT_NULL(upload(json, sizeof(json) - 1, 16));
+  for (auto &f : finds)
+    TEST_ASSERT_EQUAL_STRING_MESSAGE(f[1], find(f[0]).c_str(), f[0]);
+}
+
+// More trie states than TABLE_ACTIVE at once: "*A" and 20 "?" follow a
+// state for every A seen, the match needs all of them
+void test_rule_states() {
+  std::string any(20, '?'), a(21, 'A');
+  std::string json = "{\"R\": [{\"match\": \"*A" + any + "\"}]}";
+  TEST_ASSERT_NULL(upload(json, 64));
+  TEST_ASSERT_EQUAL_STRING("R", find(a.c_str()).c_str());
+  TEST_ASSERT_EQUAL_STRING("R", find(("B" + a + "B").c_str()).c_str());
+  TEST_ASSERT_EQUAL_STRING("", find(a.substr(1).c_str()).c_str());
+  std::string longest(200, 'A');
+  TEST_ASSERT_EQUAL_STRING("R", find(longest.c_str()).c_str());
+}
+
+// Code i of the large table and its location
+static std::string bigCode(int i) {
+  char code[24];
+  snprintf(code, sizeof(code), "]C100%018lld", 106141410000000LL + i * 7919LL);
+  return code;
+}
+static std::string bigLoc(int i) {
+  return "R" + std::to_string(i % BIG_LOCS);
+}
+
+// The large table, codes of a location in a row
+static const std::string &bigJson() {
+  static std::string json;
+  if (!json.empty())
+    return json;
+  json = "{";
+  for (int l = 0; l < BIG_LOCS; l++) {
+    json += (l > 0 ? ",\n\"" : "\"") + bigLoc(l) + "\": [";
+    for (int i = l; i < BIG_CODES; i += BIG_LOCS)
+      json += (i > l ? ", \"" : "\"") + bigCode(i) + "\"";
+    json += "]";
+  }
+  json += "}";
+  return json;
+}
+
+static double msSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+// 30000 codes in 100 locations, in chunks that split codes and names
+void test_30k_codes() {
+  const std::string &json = bigJson();
+  uint32_t codes;
+  TEST_ASSERT_NULL(upload(json.c_str(), json.size(), BIG_CHUNK, &codes));
+  TEST_ASSERT_EQUAL(BIG_CODES, codes);
+  metrics = metrics_t();
+  for (int i = 0; i < BIG_CODES; i++) {
+    std::string code = bigCode(i);
+    TEST_ASSERT_EQUAL_STRING(bigLoc(i).c_str(), find(code.c_str()).c_str());
+  }
+  for (int i = BIG_CODES; i < BIG_CODES + 1000; i++)
+    TEST_ASSERT_EQUAL_STRING("", find(bigCode(i).c_str()).c_str());
+  TEST_ASSERT_EQUAL(BIG_CODES + 1000, metrics.lookups);
+  TEST_ASSERT_EQUAL(1000, metrics.misses);
+}
+
+// Location of a code the way main.cpp found it before the index: in
+// table.json deserialized into the heap, scanned in file order
+static JsonString heapFind(DynamicJsonDocument &tbl, JsonString x) {
+  for (JsonPair kv : tbl.as<JsonObject>()) {
+    for (JsonVariant value : kv.value().as<JsonArray>()) {
+      if (value.as<JsonString>() == x)
+        return kv.key();
+    }
+  }
+  return JsonString("");
+}
+
+// table.json into the heap against mapping the index, and building the
+// index on the first boot after a file system image
+void test_boot_time() {
+  TEST_ASSERT_NULL(upload(bigJson(), BIG_CHUNK));
+  auto start = std::chrono::steady_clock::now();
+  DynamicJsonDocument tbl(bigJson().size() * 4);
+  DeserializationError err = deserializeJson(tbl, bigJson());
+  double heapMs = msSince(start);
+  TEST_ASSERT_TRUE_MESSAGE(err == DeserializationError::Ok, err.c_str());
+
+  start = std::chrono::steady_clock::now();
+  readTable();
+  double mapMs = msSince(start);
+  TEST_ASSERT_EQUAL(1, hostMappings);
+
+  std::fill(hostFlash.begin(), hostFlash.end(), 0xff);
+  start = std::chrono::steady_clock::now();
+  readTable();
+  double buildMs = msSince(start);
+  TEST_ASSERT_EQUAL(1, hostMappings);
+  TEST_ASSERT_EQUAL_STRING("R7", find(bigCode(7).c_str()).c_str());
+
+  char msg[120];
+  snprintf(msg, sizeof(msg), "boot, heap table: %.2f ms, %u bytes of heap",
+           heapMs, (unsigned)tbl.memoryUsage());
+  TEST_MESSAGE(msg);
+  snprintf(msg, sizeof(msg), "boot, mapped index: %.3f ms, no heap", mapMs);
+  TEST_MESSAGE(msg);
+  snprintf(msg, sizeof(msg), "first boot, index built: %.2f ms", buildMs);
+  TEST_MESSAGE(msg);
+  TEST_ASSERT_TRUE(mapMs < heapMs);
+}
+
+// Lookups in the heap table against the index, hits spread over the table
+void test_lookup_cost() {
+  TEST_ASSERT_NULL(upload(bigJson(), BIG_CHUNK));
+  DynamicJsonDocument tbl(bigJson().size() * 4);
+  DeserializationError err = deserializeJson(tbl, bigJson());
+  TEST_ASSERT_TRUE_MESSAGE(err == DeserializationError::Ok, err.c_str());
+  std::vector<std::string> codes;
+  for (int i = 0; i < BIG_CODES + BIG_CODES; i++)
+    codes.push_back(bigCode(i)); // Hits, then as many misses
+  const int step = BIG_CODES / BENCH_HEAP;
+
+  static const char *const kinds[] = {"hit", "miss"};
+  for (int miss = 0; miss < 2; miss++) {
+    const std::string *first = &codes[miss * BIG_CODES];
+    int found = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < BIG_CODES; i += step)
+      found += heapFind(tbl, first[i].c_str()).size() > 0;
+    double heapNs = msSince(start) * 1e6 / BENCH_HEAP;
+    TEST_ASSERT_EQUAL(miss ? 0 : BENCH_HEAP, found);
+
+    found = 0;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < BIG_CODES; i++)
+      found += find(first[i].c_str()).size() > 0;
+    double indexNs = msSince(start) * 1e6 / BIG_CODES;
+    TEST_ASSERT_EQUAL(miss ? 0 : BIG_CODES, found);
+
+    char msg[120];
+    snprintf(msg, sizeof(msg), "%s: heap table %.0f ns, index %.0f ns",
+             kinds[miss], heapNs, indexNs);
+    TEST_MESSAGE(msg);
+    TEST_ASSERT_TRUE(indexNs < heapNs);
+  }
+  for (int i = 0; i < BIG_CODES; i += step) {
+    TEST_ASSERT_EQUAL_STRING(heapFind(tbl, codes[i].c_str()).c_str(),
+                             find(codes[i].c_str()).c_str());
+  }
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_chunk_split);
+  RUN_TEST(test_escapes);
+  RUN_TEST(test_errors);
+  RUN_TEST(test_rules);
+  RUN_TEST(test_rule_states);
+  RUN_TEST(test_30k_codes);
+  RUN_TEST(test_boot_time);
+  RUN_TEST(test_lookup_cost);
+  return UNITY_END();
+}